@@ -541,7 +541,11 @@ usage(int error_code)
 		"  --transform=TR\tThe output transformation, TR is one of:\n"
 		"\tnormal 90 180 270 flipped flipped-90 flipped-180 flipped-270\n"
 		"  --use-pixman\t\tUse the pixman (CPU) renderer (default: no rendering)\n"
+		"  --use-gl\t\tUse the GL renderer on a surfaceless EGL platform\n"
 		"  --no-outputs\t\tDo not create any virtual outputs\n"
+		"  --refresh=RATE\tRefresh rate in Hz, or free-run to finish\n"
+		"\t\t\tframes as soon as they are painted (default: 60)\n"
+		"  --output-count=COUNT\tCreate multiple outputs\n"
 		"\n");
 #endif
 
@@ -554,6 +558,8 @@ usage(int error_code)
 		"  --address=ADDR\tThe address to bind\n"
 		"  --port=PORT\t\tThe port to listen on\n"
 		"  --no-clients-resize\tThe RDP peers will be forced to the size of the desktop\n"
+		"  --encoder-threads=N\tNumber of threads encoding RemoteFX and NSCodec\n"
+		"\t\t\tupdates, defaults to the number of CPUs\n"
 		"  --rdp4-key=FILE\tThe file containing the key for RDP4 encryption\n"
 		"  --rdp-tls-cert=FILE\tThe file containing the certificate for TLS encryption\n"
 		"  --rdp-tls-key=FILE\tThe file containing the private key for TLS encryption\n"
@@ -570,6 +576,7 @@ usage(int error_code)
 		"  --use-pixman\t\tUse the pixman (CPU) renderer\n"
 		"  --output-count=COUNT\tCreate multiple outputs\n"
 		"  --sprawl\t\tCreate one fullscreen output for every parent output\n"
+		"  --use-planes\t\tShow suitable client buffers on parent subsurfaces\n"
 		"  --display=DISPLAY\tWayland display to connect to\n\n");
 #endif
 
@@ -803,6 +810,7 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	struct xkb_rule_names xkb_names;
 	struct weston_config_section *s;
 	int repaint_msec;
+	int repaint_adaptive;
 	int vt_switching;
 
 	s = weston_config_get_section(config, "keyboard", NULL, NULL);
@@ -838,8 +846,29 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	} else {
 		ec->repaint_msec = repaint_msec;
 	}
-	weston_log("Output repaint window is %d ms maximum.\n",
-		   ec->repaint_msec);
+	weston_config_section_get_bool(s, "adaptive-repaint-window",
+				       &repaint_adaptive, ec->repaint_adaptive);
+	ec->repaint_adaptive = repaint_adaptive;
+	if (ec->repaint_adaptive)
+		weston_log("Output repaint window is adaptive, "
+			   "%d ms maximum.\n", ec->repaint_msec);
+	else
+		weston_log("Output repaint window is %d ms maximum.\n",
+			   ec->repaint_msec);
+
+	weston_config_section_get_int(s, "pixman-threads",
+				      &ec->pixman_threads, 1);
+	if (ec->pixman_threads <= 0)
+		ec->pixman_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	weston_config_section_get_int(s, "occluded-frame-rate",
+				      &ec->occluded_frame_rate,
+				      ec->occluded_frame_rate);
+	if (ec->occluded_frame_rate < 0 || ec->occluded_frame_rate > 1000) {
+		weston_log("Invalid occluded-frame-rate value in config: %d\n",
+			   ec->occluded_frame_rate);
+		ec->occluded_frame_rate = 1;
+	}
 
 	return 0;
 }
@@ -1043,13 +1072,59 @@ load_drm_backend(struct weston_compositor *c,
 	return ret;
 }
 
+/* Refresh rates are given in Hz, or as free-run */
+static int
+parse_headless_refresh(const char *s, int *refresh)
+{
+	char *end;
+	double hz;
+
+	if (strcmp(s, "free-run") == 0) {
+		*refresh = WESTON_HEADLESS_FREE_RUN;
+		return 0;
+	}
+
+	errno = 0;
+	hz = strtod(s, &end);
+	if (errno != 0 || end == s || *end != '\0' || hz < 1 || hz > 1000)
+		return -1;
+
+	*refresh = hz * 1000 + 0.5;
+	return 0;
+}
+
+static int
+weston_headless_backend_config_append_output_config(struct weston_headless_backend_config *config,
+						    struct weston_headless_backend_output_config *output_config)
+{
+	struct weston_headless_backend_output_config *new_outputs;
+
+	new_outputs = realloc(config->outputs, (config->num_outputs + 1) *
+			      sizeof(struct weston_headless_backend_output_config));
+	if (new_outputs == NULL)
+		return -1;
+
+	config->outputs = new_outputs;
+	config->outputs[config->num_outputs] = *output_config;
+	config->outputs[config->num_outputs].name = strdup(output_config->name);
+	config->num_outputs++;
+
+	return 0;
+}
+
 static int
 load_headless_backend(struct weston_compositor *c,
 		      int *argc, char **argv, struct weston_config *wc)
 {
 	struct weston_headless_backend_config config = {{ 0, }};
+	struct weston_headless_backend_output_config output;
+	struct weston_config_section *section;
+	const char *section_name;
 	int ret = 0;
 	char *transform = NULL;
+	char *refresh = NULL;
+	int option_count = 1;
+	uint32_t i;
 
 	config.width = 1024;
 	config.height = 640;
@@ -1058,8 +1133,11 @@ load_headless_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_INTEGER, "width", 0, &config.width },
 		{ WESTON_OPTION_INTEGER, "height", 0, &config.height },
 		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &config.use_pixman },
+		{ WESTON_OPTION_BOOLEAN, "use-gl", 0, &config.use_gl },
 		{ WESTON_OPTION_STRING, "transform", 0, &transform },
 		{ WESTON_OPTION_BOOLEAN, "no-outputs", 0, &config.no_outputs },
+		{ WESTON_OPTION_STRING, "refresh", 0, &refresh },
+		{ WESTON_OPTION_INTEGER, "output-count", 0, &option_count },
 	};
 
 	parse_options(options, ARRAY_LENGTH(options), argc, argv);
@@ -1071,6 +1149,78 @@ load_headless_backend(struct weston_compositor *c,
 		free(transform);
 	}
 
+	config.refresh = 60000;
+	if (refresh) {
+		if (parse_headless_refresh(refresh, &config.refresh) < 0)
+			weston_log("Invalid refresh rate \"%s\"\n", refresh);
+		free(refresh);
+	}
+
+	/* Outputs named headless* in weston.ini come first, then outputs
+	 * like the one on the command line until there are as many as
+	 * --output-count asks for. */
+	section = NULL;
+	while (weston_config_next_section(wc, &section, &section_name)) {
+		char *mode, *t, *r;
+
+		if (strcmp(section_name, "output") != 0)
+			continue;
+
+		weston_config_section_get_string(section, "name",
+						 &output.name, NULL);
+		if (!output.name || strncmp(output.name, "headless", 8) != 0) {
+			free(output.name);
+			continue;
+		}
+
+		weston_config_section_get_string(section, "mode", &mode, NULL);
+		if (!mode || sscanf(mode, "%dx%d", &output.width,
+				    &output.height) != 2 ||
+		    output.width < 1 || output.height < 1) {
+			output.width = config.width;
+			output.height = config.height;
+		}
+		free(mode);
+
+		weston_config_section_get_string(section, "transform", &t,
+						 "normal");
+		if (weston_parse_transform(t, &output.transform) < 0)
+			weston_log("Invalid transform \"%s\" for output %s\n",
+				   t, output.name);
+		free(t);
+
+		output.refresh = config.refresh;
+		weston_config_section_get_string(section, "refresh", &r, NULL);
+		if (r && parse_headless_refresh(r, &output.refresh) < 0)
+			weston_log("Invalid refresh rate \"%s\" for output %s\n",
+				   r, output.name);
+		free(r);
+
+		ret = weston_headless_backend_config_append_output_config(&config,
+									  &output);
+		free(output.name);
+		if (ret < 0)
+			goto out;
+	}
+
+	for (i = config.num_outputs; option_count > 1 &&
+	     i < (uint32_t) option_count; i++) {
+		output.width = config.width;
+		output.height = config.height;
+		output.transform = config.transform;
+		output.refresh = config.refresh;
+		if (asprintf(&output.name, "headless%u", i) < 0) {
+			ret = -1;
+			goto out;
+		}
+
+		ret = weston_headless_backend_config_append_output_config(&config,
+									  &output);
+		free(output.name);
+		if (ret < 0)
+			goto out;
+	}
+
 	config.base.struct_version = WESTON_HEADLESS_BACKEND_CONFIG_VERSION;
 	config.base.struct_size = sizeof(struct weston_headless_backend_config);
 
@@ -1078,6 +1228,11 @@ load_headless_backend(struct weston_compositor *c,
 	ret = weston_compositor_load_backend(c, WESTON_BACKEND_HEADLESS,
 					     &config.base);
 
+out:
+	for (i = 0; i < config.num_outputs; i++)
+		free(config.outputs[i].name);
+	free(config.outputs);
+
 	return ret;
 }
 
@@ -1096,6 +1251,7 @@ weston_rdp_backend_config_init(struct weston_rdp_backend_config *config)
 	config->server_key = NULL;
 	config->env_socket = 0;
 	config->no_clients_resize = 0;
+	config->encoder_threads = 0;
 }
 
 static int
@@ -1114,6 +1270,7 @@ load_rdp_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_STRING,  "address", 0, &config.bind_address },
 		{ WESTON_OPTION_INTEGER, "port", 0, &config.port },
 		{ WESTON_OPTION_BOOLEAN, "no-clients-resize", 0, &config.no_clients_resize },
+		{ WESTON_OPTION_INTEGER, "encoder-threads", 0, &config.encoder_threads },
 		{ WESTON_OPTION_STRING,  "rdp4-key", 0, &config.rdp_key },
 		{ WESTON_OPTION_STRING,  "rdp-tls-cert", 0, &config.server_cert },
 		{ WESTON_OPTION_STRING,  "rdp-tls-key", 0, &config.server_key }
@@ -1415,6 +1572,7 @@ load_wayland_backend_config(struct weston_compositor *compositor, int *argc,
 		{ WESTON_OPTION_INTEGER, "output-count", 0, &count },
 		{ WESTON_OPTION_BOOLEAN, "fullscreen", 0, &config->fullscreen },
 		{ WESTON_OPTION_BOOLEAN, "sprawl", 0, &config->sprawl },
+		{ WESTON_OPTION_BOOLEAN, "use-planes", 0, &config->use_planes },
 	};
 
 	width = 0;
@@ -1425,6 +1583,7 @@ load_wayland_backend_config(struct weston_compositor *compositor, int *argc,
 	count = 1;
 	config->fullscreen = 0;
 	config->sprawl = 0;
+	config->use_planes = 0;
 	parse_options(wayland_options,
 		      ARRAY_LENGTH(wayland_options), argc, argv);
 
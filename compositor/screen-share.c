@@ -37,15 +37,32 @@
 #include <linux/input.h>
 #include <errno.h>
 #include <ctype.h>
+#include <inttypes.h>
+#include <time.h>
 
 #include <wayland-client.h>
 
 #include "compositor.h"
 #include "weston.h"
+#include "timeline.h"
 #include "shared/helpers.h"
 #include "shared/os-compatibility.h"
+#include "shared/timespec-util.h"
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
 
+/* Buffers shared with the parent at a time. When they are all in use,
+ * damage keeps accumulating until one is released. */
+#define SS_MAX_BUFFERS 3
+
+enum ss_shm_buffer_status {
+	SS_SHM_BUFFER_OK,
+	SS_SHM_BUFFER_BUSY,	/* all SS_MAX_BUFFERS held by the parent */
+	SS_SHM_BUFFER_FAILED,
+};
+
+/* Transfer statistics are reported over periods this long */
+#define SS_STATS_PERIOD_NSEC 1000000000LL
+
 struct shared_output {
 	struct weston_output *output;
 	struct wl_listener output_destroyed;
@@ -72,12 +89,29 @@ struct shared_output {
 
 		struct wl_list buffers;
 		struct wl_list free_buffers;
+		int count;	/* buffers of the current size */
 	} shm;
 
 	int cache_dirty;
 	pixman_image_t *cache_image;
 	uint32_t *tmp_data;
 	size_t tmp_data_size;
+
+	/* When the oldest damage not sent yet was captured, and when the
+	 * damage in the commit waiting for its frame callback was */
+	int64_t capture_nsec;
+	int64_t commit_capture_nsec;
+
+	/* Transfer statistics, for the current period and in total */
+	struct ss_stats {
+		uint64_t bytes_read;	/* read back from the renderer */
+		uint64_t bytes_sent;	/* copied into shared buffers */
+		uint32_t frames;
+		int64_t latency_nsec;	/* summed, capture to presentation */
+		int64_t latency_max_nsec;
+	} period, total;
+	int64_t period_start_nsec;
+	int64_t total_start_nsec;
 };
 
 struct ss_seat {
@@ -377,9 +411,84 @@ ss_seat_destroy(struct ss_seat *seat)
 	free(seat);
 }
 
+static int64_t
+shared_output_read_clock(struct shared_output *so)
+{
+	struct timespec ts;
+
+	weston_compositor_read_presentation_clock(so->output->compositor, &ts);
+
+	return timespec_to_nsec(&ts);
+}
+
+static void
+ss_stats_add_frame(struct ss_stats *stats, int64_t latency_nsec)
+{
+	stats->frames++;
+	stats->latency_nsec += latency_nsec;
+	if (latency_nsec > stats->latency_max_nsec)
+		stats->latency_max_nsec = latency_nsec;
+}
+
+/* Accounts for a frame the parent has presented, and reports the
+ * statistics of the period once it is over. */
+static void
+shared_output_frame_presented(struct shared_output *so)
+{
+	struct ss_stats *period = &so->period;
+	int64_t now, latency, elapsed;
+
+	now = shared_output_read_clock(so);
+	latency = now - so->commit_capture_nsec;
+	ss_stats_add_frame(period, latency);
+	ss_stats_add_frame(&so->total, latency);
+
+	elapsed = now - so->period_start_nsec;
+	if (elapsed < SS_STATS_PERIOD_NSEC)
+		return;
+
+	TL_POINT("screen_share_stats", TLP_OUTPUT(so->output),
+		 TLP_COUNTER("frames", period->frames),
+		 TLP_COUNTER("read_kbps",
+			     period->bytes_read * 8 * 1000000 / elapsed),
+		 TLP_COUNTER("sent_kbps",
+			     period->bytes_sent * 8 * 1000000 / elapsed),
+		 TLP_COUNTER("latency_usec",
+			     period->latency_nsec / 1000 / period->frames),
+		 TLP_COUNTER("latency_max_usec",
+			     period->latency_max_nsec / 1000),
+		 TLP_END);
+
+	memset(period, 0, sizeof *period);
+	so->period_start_nsec = now;
+}
+
+static void
+shared_output_log_stats(struct shared_output *so)
+{
+	struct ss_stats *total = &so->total;
+	double elapsed;
+
+	if (total->frames == 0)
+		return;
+
+	elapsed = (shared_output_read_clock(so) - so->total_start_nsec) / 1e9;
+	weston_log("screen share of %s: %" PRIu32 " frames, "
+		   "read %.1f MB/s, sent %.1f MB/s, "
+		   "latency %.1f ms average, %.1f ms max\n",
+		   so->output->name, total->frames,
+		   total->bytes_read / elapsed / 1e6,
+		   total->bytes_sent / elapsed / 1e6,
+		   total->latency_nsec / 1e6 / total->frames,
+		   total->latency_max_nsec / 1e6);
+}
+
 static void
 ss_shm_buffer_destroy(struct ss_shm_buffer *buffer)
 {
+	if (buffer->output)
+		buffer->output->shm.count--;
+
 	pixman_image_unref(buffer->pm_image);
 
 	wl_buffer_destroy(buffer->buffer);
@@ -392,6 +501,9 @@ ss_shm_buffer_destroy(struct ss_shm_buffer *buffer)
 	free(buffer);
 }
 
+static void
+shared_output_update(struct shared_output *so);
+
 static void
 buffer_release(void *data, struct wl_buffer *buffer)
 {
@@ -399,6 +511,9 @@ buffer_release(void *data, struct wl_buffer *buffer)
 
 	if (sb->output) {
 		wl_list_insert(&sb->output->shm.free_buffers, &sb->free_link);
+
+		/* Damage may have been waiting for a buffer */
+		shared_output_update(sb->output);
 	} else {
 		ss_shm_buffer_destroy(sb);
 	}
@@ -408,8 +523,9 @@ static const struct wl_buffer_listener buffer_listener = {
 	buffer_release
 };
 
-static struct ss_shm_buffer *
-shared_output_get_shm_buffer(struct shared_output *so)
+static enum ss_shm_buffer_status
+shared_output_get_shm_buffer(struct shared_output *so,
+			     struct ss_shm_buffer **sb_out)
 {
 	struct ss_shm_buffer *sb, *bnext;
 	struct wl_shm_pool *pool;
@@ -433,6 +549,7 @@ shared_output_get_shm_buffer(struct shared_output *so)
 		/* Orphan in-use buffers so they get destroyed */
 		wl_list_for_each(sb, &so->shm.buffers, link)
 			sb->output = NULL;
+		so->shm.count = 0;
 
 		so->shm.width = width;
 		so->shm.height = height;
@@ -444,13 +561,17 @@ shared_output_get_shm_buffer(struct shared_output *so)
 		wl_list_remove(&sb->free_link);
 		wl_list_init(&sb->free_link);
 
-		return sb;
+		*sb_out = sb;
+		return SS_SHM_BUFFER_OK;
 	}
 
+	if (so->shm.count >= SS_MAX_BUFFERS)
+		return SS_SHM_BUFFER_BUSY;
+
 	fd = os_create_anonymous_file(height * stride);
 	if (fd < 0) {
 		weston_log("os_create_anonymous_file: %m\n");
-		return NULL;
+		return SS_SHM_BUFFER_FAILED;
 	}
 
 	data = mmap(NULL, height * stride, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
@@ -464,6 +585,7 @@ shared_output_get_shm_buffer(struct shared_output *so)
 		goto out_unmap;
 
 	sb->output = so;
+	so->shm.count++;
 	wl_list_init(&sb->free_link);
 	wl_list_insert(&so->shm.buffers, &sb->link);
 
@@ -490,7 +612,8 @@ shared_output_get_shm_buffer(struct shared_output *so)
 	if (!sb->pm_image)
 		goto out_pixman_error;
 
-	return sb;
+	*sb_out = sb;
+	return SS_SHM_BUFFER_OK;
 
 out_pixman_error:
 	pixman_region32_fini(&sb->damage);
@@ -499,7 +622,7 @@ out_unmap:
 out_close:
 	if (fd != -1)
 		close(fd);
-	return NULL;
+	return SS_SHM_BUFFER_FAILED;
 }
 
 static void
@@ -590,9 +713,6 @@ shared_output_ensure_tmp_data(struct shared_output *so,
 	return 0;
 }
 
-static void
-shared_output_update(struct shared_output *so);
-
 static void
 shared_output_frame_callback(void *data, struct wl_callback *cb, uint32_t time)
 {
@@ -604,6 +724,7 @@ shared_output_frame_callback(void *data, struct wl_callback *cb, uint32_t time)
 	wl_callback_destroy(cb);
 	so->parent.frame_cb = NULL;
 
+	shared_output_frame_presented(so);
 	shared_output_update(so);
 }
 
@@ -615,16 +736,21 @@ static void
 shared_output_update(struct shared_output *so)
 {
 	struct ss_shm_buffer *sb;
+	enum ss_shm_buffer_status status;
 	pixman_box32_t *r;
 	int i, nrects;
+	int32_t width, height;
 	pixman_transform_t transform;
 
 	/* Only update if we need to */
 	if (!so->cache_dirty || so->parent.frame_cb)
 		return;
 
-	sb = shared_output_get_shm_buffer(so);
-	if (sb == NULL) {
+	status = shared_output_get_shm_buffer(so, &sb);
+	if (status == SS_SHM_BUFFER_BUSY) {
+		/* Try again once the parent releases a buffer */
+		return;
+	} else if (status == SS_SHM_BUFFER_FAILED) {
 		shared_output_destroy(so);
 		return;
 	}
@@ -632,8 +758,6 @@ shared_output_update(struct shared_output *so)
 	output_compute_transform(so->output, &transform);
 	pixman_image_set_transform(so->cache_image, &transform);
 
-	pixman_image_set_clip_region32(sb->pm_image, &sb->damage);
-
 	if (so->output->current_scale == 1) {
 		pixman_image_set_filter(so->cache_image,
 					PIXMAN_FILTER_NEAREST, NULL, 0);
@@ -642,26 +766,34 @@ shared_output_update(struct shared_output *so)
 					PIXMAN_FILTER_BILINEAR, NULL, 0);
 	}
 
-	pixman_image_composite32(PIXMAN_OP_SRC,
-				 so->cache_image, /* src */
-				 NULL, /* mask */
-				 sb->pm_image, /* dest */
-				 0, 0, /* src_x, src_y */
-				 0, 0, /* mask_x, mask_y */
-				 0, 0, /* dest_x, dest_y */
-				 so->output->width, /* width */
-				 so->output->height /* height */);
+	/* Only what changed since this buffer was last sent is copied,
+	 * one damage rectangle at a time. */
+	r = pixman_region32_rectangles(&sb->damage, &nrects);
+	for (i = 0; i < nrects; ++i) {
+		width = r[i].x2 - r[i].x1;
+		height = r[i].y2 - r[i].y1;
 
-	pixman_image_set_transform(sb->pm_image, NULL);
-	pixman_image_set_clip_region32(sb->pm_image, NULL);
+		pixman_image_composite32(PIXMAN_OP_SRC,
+					 so->cache_image, /* src */
+					 NULL, /* mask */
+					 sb->pm_image, /* dest */
+					 r[i].x1, r[i].y1, /* src_x, src_y */
+					 0, 0, /* mask_x, mask_y */
+					 r[i].x1, r[i].y1, /* dest_x, dest_y */
+					 width, height);
 
-	r = pixman_region32_rectangles(&sb->damage, &nrects);
-	for (i = 0; i < nrects; ++i)
 		wl_surface_damage(so->parent.surface, r[i].x1, r[i].y1,
-				  r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
+				  width, height);
+
+		so->period.bytes_sent += width * height * 4;
+		so->total.bytes_sent += width * height * 4;
+	}
 
 	wl_surface_attach(so->parent.surface, sb->buffer, 0, 0);
 
+	so->cache_dirty = 0;
+	so->commit_capture_nsec = so->capture_nsec;
+
 	so->parent.frame_cb = wl_surface_frame(so->parent.surface);
 	wl_callback_add_listener(so->parent.frame_cb,
 				 &shared_output_frame_listener, so);
@@ -853,7 +985,16 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
 
-		if (do_yflip) {
+		so->period.bytes_read += width * height * 4;
+		so->total.bytes_read += width * height * 4;
+
+		if (!do_yflip && width == stride) {
+			/* Whole rows land in the cache as they are */
+			so->output->compositor->renderer->read_pixels(
+				so->output, PIXMAN_a8r8g8b8,
+				cache_data + y * stride,
+				x, y, width, height);
+		} else if (do_yflip) {
 			so->output->compositor->renderer->read_pixels(
 				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
 				x, so->output->current_mode->height - r[i].y2,
@@ -873,6 +1014,8 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 
 	pixman_region32_fini(&damage);
 
+	if (!so->cache_dirty)
+		so->capture_nsec = shared_output_read_clock(so);
 	so->cache_dirty = 1;
 
 	shared_output_update(so);
@@ -968,6 +1111,9 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	output->disable_planes++;
 	weston_output_damage(output);
 
+	so->period_start_nsec = shared_output_read_clock(so);
+	so->total_start_nsec = so->period_start_nsec;
+
 	return so;
 
 err_display:
@@ -986,6 +1132,8 @@ shared_output_destroy(struct shared_output *so)
 {
 	struct ss_shm_buffer *buffer, *bnext;
 
+	shared_output_log_stats(so);
+
 	so->output->disable_planes--;
 
 	wl_list_for_each_safe(buffer, bnext, &so->shm.buffers, link)
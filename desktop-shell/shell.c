@@ -948,6 +948,7 @@ activate_workspace(struct desktop_shell *shell, unsigned int index)
 
 	ws = get_workspace(shell, index);
 	wl_list_insert(&shell->panel_layer.link, &ws->layer.link);
+	weston_compositor_invalidate_view_list(shell->compositor);
 
 	shell->workspaces.current = index;
 }
@@ -1076,6 +1077,7 @@ finish_workspace_change_animation(struct desktop_shell *shell,
 	shell->workspaces.anim_to = NULL;
 
 	wl_list_remove(&shell->workspaces.anim_from->layer.link);
+	weston_compositor_invalidate_view_list(shell->compositor);
 }
 
 static void
@@ -1158,6 +1160,7 @@ animate_workspace_change(struct desktop_shell *shell,
 		       &shell->workspaces.animation.link);
 
 	wl_list_insert(from->layer.link.prev, &to->layer.link);
+	weston_compositor_invalidate_view_list(shell->compositor);
 
 	workspace_translate_in(to, 0);
 
@@ -1173,6 +1176,7 @@ update_workspace(struct desktop_shell *shell, unsigned int index,
 	shell->workspaces.current = index;
 	wl_list_insert(&from->layer.link, &to->layer.link);
 	wl_list_remove(&from->layer.link);
+	weston_compositor_invalidate_view_list(shell->compositor);
 }
 
 static void
@@ -1298,6 +1302,7 @@ take_surface_to_workspace_by_seat(struct desktop_shell *shell,
 	    shell->workspaces.anim_to == from) {
 		wl_list_remove(&to->layer.link);
 		wl_list_insert(from->layer.link.prev, &to->layer.link);
+		weston_compositor_invalidate_view_list(shell->compositor);
 
 		reverse_workspace_change_animation(shell, index, from, to);
 
@@ -3071,7 +3076,8 @@ resume_desktop(struct desktop_shell *shell)
 	wl_list_insert(&shell->fullscreen_layer.link,
 		       &shell->panel_layer.link);
 	wl_list_insert(&shell->panel_layer.link,
-		       &ws->layer.link),
+		       &ws->layer.link);
+	weston_compositor_invalidate_view_list(shell->compositor);
 
 	restore_focus_state(shell, get_current_workspace(shell));
 
@@ -3758,6 +3764,7 @@ lock(struct desktop_shell *shell)
 	wl_list_remove(&ws->layer.link);
 	wl_list_insert(&shell->compositor->cursor_layer.link,
 		       &shell->lock_layer.link);
+	weston_compositor_invalidate_view_list(shell->compositor);
 
 	weston_compositor_sleep(shell->compositor);
 
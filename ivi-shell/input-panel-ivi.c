@@ -115,9 +115,11 @@ show_input_panels(struct wl_listener *listener, void *data)
 
 	shell->showing_input_panels = true;
 
-	if (!shell->locked)
+	if (!shell->locked) {
 		wl_list_insert(&shell->compositor->cursor_layer.link,
 			       &shell->input_panel_layer.link);
+		weston_compositor_invalidate_view_list(shell->compositor);
+	}
 
 	wl_list_for_each_safe(ipsurf, next,
 			      &shell->input_panel.surfaces, link) {
@@ -141,8 +143,10 @@ hide_input_panels(struct wl_listener *listener, void *data)
 
 	shell->showing_input_panels = false;
 
-	if (!shell->locked)
+	if (!shell->locked) {
 		wl_list_remove(&shell->input_panel_layer.link);
+		weston_compositor_invalidate_view_list(shell->compositor);
+	}
 
 	wl_list_for_each_safe(view, next,
 			      &shell->input_panel_layer.view_list.link,
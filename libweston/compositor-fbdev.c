@@ -479,7 +479,7 @@ fbdev_output_create(struct fbdev_backend *backend,
 	                   backend->output_transform,
 			   1);
 
-	if (pixman_renderer_output_create(&output->base) < 0)
+	if (pixman_renderer_output_create(&output->base, 0) < 0)
 		goto out_hw_surface;
 
 	loop = wl_display_get_event_loop(backend->compositor->wl_display);
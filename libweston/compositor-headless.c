@@ -26,35 +26,69 @@
 
 #include "config.h"
 
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
 #include <stdbool.h>
 
 #include "compositor.h"
 #include "compositor-headless.h"
+#include "timeline.h"
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include "pixman-renderer.h"
+#include "gl-renderer.h"
 #include "presentation-time-server-protocol.h"
 
+/* The refresh rate of outputs that do not ask for one */
+#define DEFAULT_MODE_REFRESH 60000
+
+/* Achieved frame rates are reported over periods this long */
+#define FRAME_RATE_PERIOD_NSEC 1000000000LL
+
 struct headless_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
 
 	struct weston_seat fake_seat;
 	bool use_pixman;
+	bool use_gl;
+	int next_x;
 };
 
 struct headless_output {
 	struct weston_output base;
 
 	struct weston_mode mode;
+	bool free_run;
+	int64_t refresh_nsec;
+	int64_t next_vblank_nsec;	/* of the virtual display */
+
+	/* Armed with the time of the next virtual vblank, or when free
+	 * running, signalled as soon as a frame is painted. Frames are
+	 * finished from the event loop either way, so that clients are
+	 * served between frames. */
 	struct wl_event_source *finish_frame_timer;
+	int finish_frame_fd;
+	struct wl_event_source *finish_frame_source;
+
+	/* Frames finished in the current frame rate period, and overall */
+	uint32_t period_frames;
+	int64_t period_start_nsec;
+	uint64_t total_frames;
+	int64_t first_frame_nsec;
+	int64_t last_frame_nsec;
+
 	uint32_t *image_buf;
 	pixman_image_t *image;
 };
 
+static struct gl_renderer_interface *gl_renderer;
+
 static inline struct headless_output *
 to_headless_output(struct weston_output *base)
 {
@@ -67,23 +101,108 @@ to_headless_backend(struct weston_compositor *base)
 	return container_of(base->backend, struct headless_backend, base);
 }
 
+static int64_t
+read_clock_nsec(struct weston_compositor *compositor)
+{
+	struct timespec ts;
+
+	weston_compositor_read_presentation_clock(compositor, &ts);
+
+	return timespec_to_nsec(&ts);
+}
+
+static void
+nsec_to_timespec(struct timespec *ts, int64_t nsec)
+{
+	ts->tv_sec = nsec / NSEC_PER_SEC;
+	ts->tv_nsec = nsec % NSEC_PER_SEC;
+}
+
+static void
+headless_output_start_repaint_loop(struct weston_output *output_base)
+{
+	struct headless_output *output = to_headless_output(output_base);
+	struct timespec ts;
+	int64_t now;
+
+	/* Stay on the grid of virtual vblanks, restarting from the last
+	 * one that passed. */
+	now = read_clock_nsec(output->base.compositor);
+	if (output->free_run || output->next_vblank_nsec == 0)
+		output->next_vblank_nsec = now;
+	else
+		output->next_vblank_nsec +=
+			(now - output->next_vblank_nsec) /
+			output->refresh_nsec * output->refresh_nsec;
+
+	nsec_to_timespec(&ts, output->next_vblank_nsec);
+	weston_output_finish_frame(output_base, &ts,
+				   WP_PRESENTATION_FEEDBACK_INVALID);
+}
+
+static void
+headless_output_count_frame(struct headless_output *output, int64_t stamp)
+{
+	int64_t elapsed;
+
+	if (output->total_frames++ == 0) {
+		output->first_frame_nsec = stamp;
+		output->period_start_nsec = stamp;
+	}
+	output->last_frame_nsec = stamp;
+	output->period_frames++;
+
+	elapsed = stamp - output->period_start_nsec;
+	if (elapsed < FRAME_RATE_PERIOD_NSEC)
+		return;
+
+	TL_POINT("headless_frame_rate", TLP_OUTPUT(&output->base),
+		 TLP_COUNTER("frames", output->period_frames),
+		 TLP_COUNTER("mhz", output->period_frames * 1000000000000LL /
+				    elapsed),
+		 TLP_END);
+
+	output->period_frames = 0;
+	output->period_start_nsec = stamp;
+}
+
 static void
-headless_output_start_repaint_loop(struct weston_output *output)
+headless_output_finish_frame(struct headless_output *output, int64_t stamp)
 {
 	struct timespec ts;
 
-	weston_compositor_read_presentation_clock(output->compositor, &ts);
-	weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
+	headless_output_count_frame(output, stamp);
+
+	nsec_to_timespec(&ts, stamp);
+	weston_output_finish_frame(&output->base, &ts, 0);
 }
 
 static int
 finish_frame_handler(void *data)
 {
 	struct headless_output *output = data;
-	struct timespec ts;
+	int64_t now = read_clock_nsec(output->base.compositor);
 
-	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
-	weston_output_finish_frame(&output->base, &ts, 0);
+	/* Fell behind by more than a frame, start a new grid */
+	if (now - output->next_vblank_nsec >= output->refresh_nsec)
+		output->next_vblank_nsec = now;
+
+	headless_output_finish_frame(output, output->next_vblank_nsec);
+
+	return 1;
+}
+
+static int
+finish_frame_fd_handler(int fd, uint32_t mask, void *data)
+{
+	struct headless_output *output = data;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) != sizeof count)
+		return 0;
+
+	headless_output_finish_frame(output,
+				     read_clock_nsec(output->base.compositor));
 
 	return 1;
 }
@@ -94,13 +213,30 @@ headless_output_repaint(struct weston_output *output_base,
 {
 	struct headless_output *output = to_headless_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
+	uint64_t one = 1;
+	int64_t now, delay;
 
 	ec->renderer->repaint_output(&output->base, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	if (output->free_run) {
+		if (write(output->finish_frame_fd, &one, sizeof one) < 0)
+			weston_log("headless: failed to signal frame: %m\n");
+		return 0;
+	}
+
+	now = read_clock_nsec(ec);
+	output->next_vblank_nsec += output->refresh_nsec;
+	if (output->next_vblank_nsec <= now)
+		output->next_vblank_nsec +=
+			((now - output->next_vblank_nsec) /
+			 output->refresh_nsec + 1) * output->refresh_nsec;
+
+	delay = (output->next_vblank_nsec - now + 999999) / 1000000;
+	wl_event_source_timer_update(output->finish_frame_timer,
+				     delay > 0 ? delay : 1);
 
 	return 0;
 }
@@ -112,9 +248,22 @@ headless_output_destroy(struct weston_output *output_base)
 	struct headless_backend *b =
 			to_headless_backend(output->base.compositor);
 
-	wl_event_source_remove(output->finish_frame_timer);
+	if (output->total_frames > 1)
+		weston_log("headless output %s: %" PRIu64 " frames, "
+			   "%.2f frames per second\n", output->base.name,
+			   output->total_frames,
+			   (output->total_frames - 1) * 1e9 /
+			   (output->last_frame_nsec - output->first_frame_nsec));
 
-	if (b->use_pixman) {
+	wl_event_source_remove(output->finish_frame_timer);
+	if (output->finish_frame_source)
+		wl_event_source_remove(output->finish_frame_source);
+	if (output->finish_frame_fd >= 0)
+		close(output->finish_frame_fd);
+
+	if (b->use_gl) {
+		gl_renderer->output_destroy(&output->base);
+	} else if (b->use_pixman) {
 		pixman_renderer_output_destroy(&output->base);
 		pixman_image_unref(output->image);
 		free(output->image_buf);
@@ -129,7 +278,7 @@ headless_output_destroy(struct weston_output *output_base)
 
 static int
 headless_backend_create_output(struct headless_backend *b,
-			       struct weston_headless_backend_config *config)
+			       struct weston_headless_backend_output_config *config)
 {
 	struct weston_compositor *c = b->compositor;
 	struct headless_output *output;
@@ -139,24 +288,55 @@ headless_backend_create_output(struct headless_backend *b,
 	if (output == NULL)
 		return -1;
 
+	output->finish_frame_fd = -1;
+	output->free_run = config->refresh == WESTON_HEADLESS_FREE_RUN;
+
 	output->mode.flags =
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 	output->mode.width = config->width;
 	output->mode.height = config->height;
-	output->mode.refresh = 60000;
+	/* Free running outputs have no fixed rate, which a refresh of zero
+	 * tells clients and the repaint scheduler alike. */
+	if (output->free_run) {
+		output->mode.refresh = 0;
+	} else {
+		if (config->refresh > 0)
+			output->mode.refresh = config->refresh;
+		else
+			output->mode.refresh = DEFAULT_MODE_REFRESH;
+		output->refresh_nsec = millihz_to_nsec(output->mode.refresh);
+	}
 	wl_list_init(&output->base.mode_list);
 	wl_list_insert(&output->base.mode_list, &output->mode.link);
 
 	output->base.current_mode = &output->mode;
-	weston_output_init(&output->base, c, 0, 0, config->width,
+	weston_output_init(&output->base, c, b->next_x, 0, config->width,
 			   config->height, config->transform, 1);
+	b->next_x += output->base.width;
 
 	output->base.make = "weston";
 	output->base.model = "headless";
+	if (config->name)
+		output->base.name = strdup(config->name);
 
 	loop = wl_display_get_event_loop(c->wl_display);
 	output->finish_frame_timer =
 		wl_event_loop_add_timer(loop, finish_frame_handler, output);
+	if (!output->finish_frame_timer)
+		goto err;
+
+	if (output->free_run) {
+		output->finish_frame_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (output->finish_frame_fd < 0)
+			goto err;
+
+		output->finish_frame_source =
+			wl_event_loop_add_fd(loop, output->finish_frame_fd,
+					     WL_EVENT_READABLE,
+					     finish_frame_fd_handler, output);
+		if (!output->finish_frame_source)
+			goto err;
+	}
 
 	output->base.start_repaint_loop = headless_output_start_repaint_loop;
 	output->base.repaint = headless_output_repaint;
@@ -166,19 +346,36 @@ headless_backend_create_output(struct headless_backend *b,
 	output->base.set_dpms = NULL;
 	output->base.switch_mode = NULL;
 
-	if (b->use_pixman) {
+	if (output->free_run)
+		weston_log("headless output %s: %dx%d, free running\n",
+			   output->base.name, config->width, config->height);
+	else
+		weston_log("headless output %s: %dx%d@%.3f\n",
+			   output->base.name, config->width, config->height,
+			   output->mode.refresh / 1000.0);
+
+	if (b->use_gl) {
+		if (gl_renderer->output_pbuffer_create(&output->base,
+						       gl_renderer->pbuffer_attribs,
+						       config->width,
+						       config->height) < 0)
+			goto err;
+	} else if (b->use_pixman) {
 		output->image_buf = malloc(config->width * config->height * 4);
 		if (!output->image_buf)
-			return -1;
+			goto err;
 
 		output->image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
 							 config->width,
 							 config->height,
 							 output->image_buf,
 							 config->width * 4);
+		if (!output->image)
+			goto err;
 
-		if (pixman_renderer_output_create(&output->base) < 0)
-			return -1;
+		if (pixman_renderer_output_create(&output->base,
+						  PIXMAN_RENDERER_OUTPUT_CACHEABLE) < 0)
+			goto err;
 
 		pixman_renderer_output_set_buffer(&output->base,
 						  output->image);
@@ -187,6 +384,21 @@ headless_backend_create_output(struct headless_backend *b,
 	weston_compositor_add_output(c, &output->base);
 
 	return 0;
+
+err:
+	if (output->finish_frame_source)
+		wl_event_source_remove(output->finish_frame_source);
+	if (output->finish_frame_timer)
+		wl_event_source_remove(output->finish_frame_timer);
+	if (output->finish_frame_fd >= 0)
+		close(output->finish_frame_fd);
+	if (output->image)
+		pixman_image_unref(output->image);
+	free(output->image_buf);
+	weston_output_destroy(&output->base);
+	free(output);
+
+	return -1;
 }
 
 static void
@@ -194,6 +406,20 @@ headless_restore(struct weston_compositor *ec)
 {
 }
 
+static int
+init_gl_renderer(struct headless_backend *b)
+{
+	gl_renderer = weston_load_module("gl-renderer.so",
+					 "gl_renderer_interface");
+	if (!gl_renderer)
+		return -1;
+
+	return gl_renderer->create(b->compositor,
+				   EGL_PLATFORM_SURFACELESS_MESA,
+				   EGL_DEFAULT_DISPLAY,
+				   gl_renderer->pbuffer_attribs, NULL, 0);
+}
+
 static void
 headless_destroy(struct weston_compositor *ec)
 {
@@ -208,7 +434,9 @@ static struct headless_backend *
 headless_backend_create(struct weston_compositor *compositor,
 			struct weston_headless_backend_config *config)
 {
+	struct weston_headless_backend_output_config output_config;
 	struct headless_backend *b;
+	uint32_t i;
 
 	b = zalloc(sizeof *b);
 	if (b == NULL)
@@ -221,17 +449,36 @@ headless_backend_create(struct weston_compositor *compositor,
 	b->base.destroy = headless_destroy;
 	b->base.restore = headless_restore;
 
-	b->use_pixman = config->use_pixman;
-	if (b->use_pixman) {
+	b->use_gl = config->use_gl;
+	b->use_pixman = config->use_pixman && !b->use_gl;
+	if (b->use_gl) {
+		if (init_gl_renderer(b) < 0) {
+			weston_log("Failed to initialize gl renderer for "
+				   "headless backend\n");
+			goto err_free;
+		}
+	} else if (b->use_pixman) {
 		pixman_renderer_init(compositor);
 	}
 
-	if (!config->no_outputs) {
-		if (headless_backend_create_output(b, config) < 0)
+	if (config->no_outputs) {
+		/* nothing */
+	} else if (config->num_outputs > 0) {
+		for (i = 0; i < config->num_outputs; i++)
+			if (headless_backend_create_output(b,
+						&config->outputs[i]) < 0)
+				goto err_input;
+	} else {
+		output_config.name = "headless";
+		output_config.width = config->width;
+		output_config.height = config->height;
+		output_config.transform = config->transform;
+		output_config.refresh = config->refresh;
+		if (headless_backend_create_output(b, &output_config) < 0)
 			goto err_input;
 	}
 
-	if (!b->use_pixman && noop_renderer_init(compositor) < 0)
+	if (!b->use_pixman && !b->use_gl && noop_renderer_init(compositor) < 0)
 		goto err_input;
 
 	compositor->backend = &b->base;
@@ -247,6 +494,7 @@ err_free:
 static void
 config_init_to_defaults(struct weston_headless_backend_config *config)
 {
+	config->refresh = DEFAULT_MODE_REFRESH;
 }
 
 WL_EXPORT int
@@ -34,7 +34,22 @@ extern "C" {
 
 #include "compositor.h"
 
-#define WESTON_HEADLESS_BACKEND_CONFIG_VERSION 1
+#define WESTON_HEADLESS_BACKEND_CONFIG_VERSION 2
+
+/** Refresh rate of an output that finishes every frame as soon as it is
+ * painted, to measure how fast the compositor can go. */
+#define WESTON_HEADLESS_FREE_RUN -1
+
+struct weston_headless_backend_output_config {
+	char *name;
+	int width;
+	int height;
+	uint32_t transform;
+
+	/** Refresh rate in mHz, or WESTON_HEADLESS_FREE_RUN. 0 selects
+	 * the default of 60 Hz. */
+	int refresh;
+};
 
 struct weston_headless_backend_config {
 	struct weston_backend_config base;
@@ -47,6 +62,20 @@ struct weston_headless_backend_config {
 
 	uint32_t transform;
 	bool no_outputs;
+
+	/** Refresh rate of the output in mHz, or WESTON_HEADLESS_FREE_RUN.
+	 * 0 selects the default of 60 Hz. */
+	int refresh;
+
+	/** Outputs to create instead of the single one described above.
+	 * Each output repaints at its own rate. */
+	uint32_t num_outputs;
+	struct weston_headless_backend_output_config *outputs;
+
+	/** Whether to render with the OpenGL ES renderer into offscreen
+	 * EGL pbuffers, on a surfaceless EGL platform. Takes precedence
+	 * over use_pixman. */
+	int use_gl;
 };
 
 #ifdef  __cplusplus
@@ -29,6 +29,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <linux/input.h>
 
 #if HAVE_FREERDP_VERSION_H
@@ -76,6 +79,7 @@
 #include <winpr/input.h>
 
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include "compositor.h"
 #include "compositor-rdp.h"
 #include "pixman-renderer.h"
@@ -84,9 +88,47 @@
 #define DEFAULT_AXIS_STEP_DISTANCE 10
 #define RDP_MODE_FREQ 60 * 1000
 
+/* How long a repaint may wait for slow peers to acknowledge or finish
+ * encoding before the output moves on without them. */
+#define RDP_FRAME_STALL_MSEC 100
 
 struct rdp_output;
 
+/* Encoding of RemoteFX and NSCodec updates runs on a pool of threads.
+ * Each peer has at most one job in flight; damage arriving meanwhile is
+ * accumulated in the peer's pending region and sent as one update once
+ * the job completes. Only the encoding happens on the workers, the
+ * FreeRDP update calls are made from the compositor thread. */
+struct rdp_encoder {
+	pthread_mutex_t mutex;
+	pthread_cond_t queue_cond;
+	pthread_cond_t done_cond;
+	pthread_t *threads;
+	int nthreads;
+	bool stopping;
+
+	struct wl_list queue;
+	struct wl_list done;
+
+	int done_fd;
+	struct wl_event_source *done_source;
+	/* Failed wakeups of the main thread, logged from there as workers
+	 * must not call weston_log() */
+	int signal_failures;
+};
+
+enum rdp_encode_state {
+	RDP_ENCODE_IDLE = 0,
+	RDP_ENCODE_QUEUED,
+	RDP_ENCODE_RUNNING,
+	RDP_ENCODE_DONE,
+};
+
+enum rdp_encode_codec {
+	RDP_CODEC_RFX,
+	RDP_CODEC_NSC,
+};
+
 struct rdp_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
@@ -100,6 +142,8 @@ struct rdp_backend {
 	char *rdp_key;
 	int tls_enabled;
 	int no_clients_resize;
+
+	struct rdp_encoder *encoder;
 };
 
 enum peer_item_flags {
@@ -120,6 +164,11 @@ struct rdp_output {
 	struct wl_event_source *finish_frame_timer;
 	pixman_image_t *shadow_surface;
 
+	/* a repaint happened and weston_output_finish_frame() is due */
+	bool frame_pending;
+	bool frame_interval_elapsed;
+	struct timespec repaint_time;
+
 	struct wl_list peers;
 };
 
@@ -133,6 +182,21 @@ struct rdp_peer_context {
 	RFX_RECT *rfx_rects;
 	NSC_CONTEXT *nsc_context;
 
+	/* copy of the damaged parts of the shadow surface being encoded */
+	pixman_image_t *snapshot;
+	pixman_region32_t pending_damage;
+	pixman_region32_t encode_damage;
+	enum rdp_encode_codec encode_codec;
+	bool encoding;
+
+	/* protected by the encoder mutex */
+	enum rdp_encode_state encode_state;
+	struct wl_list encode_link;
+
+	UINT32 frame_id;
+	UINT32 acked_frame_id;
+	UINT32 max_unacked_frames;
+
 	struct rdp_peers_item item;
 };
 typedef struct rdp_peer_context RdpPeerContext;
@@ -150,15 +214,37 @@ to_rdp_backend(struct weston_compositor *base)
 }
 
 static void
-rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_peer_begin_frame(freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	rdpUpdate *update = peer->update;
+	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
+
+	marker->frameId = ++context->frame_id;
+	marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
+	update->SurfaceFrameMarker(peer->context, marker);
+}
+
+static void
+rdp_peer_end_frame(freerdp_peer *peer)
+{
+	rdpUpdate *update = peer->update;
+	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
+
+	marker->frameAction = SURFACECMD_FRAMEACTION_END;
+	update->SurfaceFrameMarker(peer->context, marker);
+}
+
+/* Runs on an encoder thread. */
+static void
+rdp_peer_encode_rfx(RdpPeerContext *context)
 {
+	pixman_region32_t *damage = &context->encode_damage;
+	pixman_image_t *image = context->snapshot;
 	int width, height, nrects, i;
 	pixman_box32_t *region, *rects;
 	uint32_t *ptr;
 	RFX_RECT *rfxRect;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
 	Stream_Clear(context->encode_stream);
 	Stream_SetPosition(context->encode_stream, 0);
@@ -166,20 +252,6 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
-#ifdef HAVE_SKIP_COMPRESSION
-	cmd->skipCompression = TRUE;
-#else
-	memset(cmd, 0, sizeof(*cmd));
-#endif
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
-	cmd->bpp = 32;
-	cmd->codecID = peer->settings->RemoteFxCodecId;
-	cmd->width = width;
-	cmd->height = height;
-
 	ptr = pixman_image_get_data(image) + damage->extents.x1 +
 				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
 
@@ -200,22 +272,16 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 			(BYTE *)ptr, width, height,
 			pixman_image_get_stride(image)
 	);
-
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
-
-	update->SurfaceBits(update->context, cmd);
 }
 
-
+/* Runs on an encoder thread. */
 static void
-rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_peer_encode_nsc(RdpPeerContext *context)
 {
+	pixman_region32_t *damage = &context->encode_damage;
+	pixman_image_t *image = context->snapshot;
 	int width, height;
 	uint32_t *ptr;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
 	Stream_Clear(context->encode_stream);
 	Stream_SetPosition(context->encode_stream, 0);
@@ -223,6 +289,23 @@ rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
+	ptr = pixman_image_get_data(image) + damage->extents.x1 +
+				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
+
+	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
+			width, height,
+			pixman_image_get_stride(image));
+}
+
+/* Sends the result of a completed encoder job as one surface frame. */
+static void
+rdp_peer_send_encoded(RdpPeerContext *context)
+{
+	freerdp_peer *peer = context->item.peer;
+	rdpUpdate *update = peer->update;
+	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
+	pixman_region32_t *damage = &context->encode_damage;
+
 #ifdef HAVE_SKIP_COMPRESSION
 	cmd->skipCompression = TRUE;
 #else
@@ -233,19 +316,18 @@ rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	cmd->destRight = damage->extents.x2;
 	cmd->destBottom = damage->extents.y2;
 	cmd->bpp = 32;
-	cmd->codecID = peer->settings->NSCodecId;
-	cmd->width = width;
-	cmd->height = height;
-
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
-
-	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
-			cmd->width,	cmd->height,
-			pixman_image_get_stride(image));
+	if (context->encode_codec == RDP_CODEC_RFX)
+		cmd->codecID = peer->settings->RemoteFxCodecId;
+	else
+		cmd->codecID = peer->settings->NSCodecId;
+	cmd->width = damage->extents.x2 - damage->extents.x1;
+	cmd->height = damage->extents.y2 - damage->extents.y1;
 	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
 	cmd->bitmapData = Stream_Buffer(context->encode_stream);
+
+	rdp_peer_begin_frame(peer);
 	update->SurfaceBits(update->context, cmd);
+	rdp_peer_end_frame(peer);
 }
 
 static void
@@ -267,7 +349,6 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 {
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
 	pixman_box32_t *rect, subrect;
 	int nrects, i;
 	int heightIncrement, remainingHeight, top;
@@ -276,9 +357,7 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 	if (!nrects)
 		return;
 
-	marker->frameId++;
-	marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
-	update->SurfaceFrameMarker(peer->context, marker);
+	rdp_peer_begin_frame(peer);
 
 	memset(cmd, 0, sizeof(*cmd));
 	cmd->bpp = 32;
@@ -316,23 +395,336 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 		}
 	}
 
-	marker->frameAction = SURFACECMD_FRAMEACTION_END;
-	update->SurfaceFrameMarker(peer->context, marker);
+	rdp_peer_end_frame(peer);
 }
 
+static bool
+rdp_peer_is_active(RdpPeerContext *context)
+{
+	return (context->item.flags & RDP_PEER_ACTIVATED) &&
+	       (context->item.flags & RDP_PEER_OUTPUT_ENABLED);
+}
+
+/* A peer can take a new update when its previous one is encoded and, if
+ * the client acknowledges frames, it is not too many frames behind. */
+static bool
+rdp_peer_ready(RdpPeerContext *context)
+{
+	if (context->encoding)
+		return false;
+
+	if (context->max_unacked_frames &&
+	    context->frame_id - context->acked_frame_id >= context->max_unacked_frames)
+		return false;
+
+	return true;
+}
+
+static void *
+rdp_encoder_thread(void *data)
+{
+	struct rdp_encoder *encoder = data;
+	RdpPeerContext *context;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&encoder->mutex);
+	for (;;) {
+		while (!encoder->stopping && wl_list_empty(&encoder->queue))
+			pthread_cond_wait(&encoder->queue_cond, &encoder->mutex);
+		if (encoder->stopping)
+			break;
+
+		context = container_of(encoder->queue.next,
+				       RdpPeerContext, encode_link);
+		wl_list_remove(&context->encode_link);
+		context->encode_state = RDP_ENCODE_RUNNING;
+		pthread_mutex_unlock(&encoder->mutex);
+
+		if (context->encode_codec == RDP_CODEC_RFX)
+			rdp_peer_encode_rfx(context);
+		else
+			rdp_peer_encode_nsc(context);
+
+		pthread_mutex_lock(&encoder->mutex);
+		context->encode_state = RDP_ENCODE_DONE;
+		wl_list_insert(encoder->done.prev, &context->encode_link);
+		pthread_cond_broadcast(&encoder->done_cond);
+
+		if (write(encoder->done_fd, &one, sizeof one) != sizeof one)
+			encoder->signal_failures++;
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+
+	return NULL;
+}
+
+/* Drops the in-flight job of a peer, waiting for a worker that is
+ * currently encoding it. Needed before the codec contexts or the peer
+ * itself go away. */
 static void
-rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
+rdp_peer_encode_cancel(RdpPeerContext *context)
 {
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
-	struct rdp_output *output = context->rdpBackend->output;
-	rdpSettings *settings = peer->settings;
+	struct rdp_encoder *encoder = context->rdpBackend->encoder;
+
+	if (!context->encoding)
+		return;
+
+	pthread_mutex_lock(&encoder->mutex);
+	while (context->encode_state == RDP_ENCODE_RUNNING)
+		pthread_cond_wait(&encoder->done_cond, &encoder->mutex);
+	if (context->encode_state != RDP_ENCODE_IDLE)
+		wl_list_remove(&context->encode_link);
+	context->encode_state = RDP_ENCODE_IDLE;
+	pthread_mutex_unlock(&encoder->mutex);
+
+	context->encoding = false;
+	pixman_region32_clear(&context->encode_damage);
+}
+
+static int
+rdp_peer_ensure_snapshot(RdpPeerContext *context, pixman_image_t *shadow)
+{
+	int width = pixman_image_get_width(shadow);
+	int height = pixman_image_get_height(shadow);
+
+	if (context->snapshot &&
+	    pixman_image_get_width(context->snapshot) == width &&
+	    pixman_image_get_height(context->snapshot) == height)
+		return 0;
+
+	if (context->snapshot)
+		pixman_image_unref(context->snapshot);
+
+	context->snapshot = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+						     width, height,
+						     NULL, width * 4);
+	if (!context->snapshot)
+		return -1;
+
+	return 0;
+}
+
+/* Starts sending the pending damage of a peer if it is ready for it. */
+static void
+rdp_peer_flush(RdpPeerContext *context)
+{
+	struct rdp_backend *b = context->rdpBackend;
+	struct rdp_encoder *encoder = b->encoder;
+	pixman_image_t *shadow = b->output->shadow_surface;
+	rdpSettings *settings = context->item.peer->settings;
+
+	if (!rdp_peer_is_active(context) || !rdp_peer_ready(context))
+		return;
+
+	pixman_region32_intersect_rect(&context->pending_damage,
+				       &context->pending_damage, 0, 0,
+				       pixman_image_get_width(shadow),
+				       pixman_image_get_height(shadow));
+	if (!pixman_region32_not_empty(&context->pending_damage))
+		return;
+
+	if (!settings->RemoteFxCodec && !settings->NSCodec) {
+		rdp_peer_refresh_raw(&context->pending_damage, shadow,
+				     context->item.peer);
+		pixman_region32_clear(&context->pending_damage);
+		return;
+	}
+
+	if (rdp_peer_ensure_snapshot(context, shadow) < 0) {
+		weston_log("rdp: failed to allocate encoder snapshot\n");
+		return;
+	}
+
+	pixman_image_set_clip_region32(context->snapshot,
+				       &context->pending_damage);
+	pixman_image_composite32(PIXMAN_OP_SRC, shadow, NULL,
+				 context->snapshot, 0, 0, 0, 0, 0, 0,
+				 pixman_image_get_width(shadow),
+				 pixman_image_get_height(shadow));
+	pixman_image_set_clip_region32(context->snapshot, NULL);
+
+	pixman_region32_copy(&context->encode_damage,
+			     &context->pending_damage);
+	pixman_region32_clear(&context->pending_damage);
 
 	if (settings->RemoteFxCodec)
-		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
-	else if (settings->NSCodec)
-		rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
+		context->encode_codec = RDP_CODEC_RFX;
 	else
-		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+		context->encode_codec = RDP_CODEC_NSC;
+	context->encoding = true;
+
+	pthread_mutex_lock(&encoder->mutex);
+	context->encode_state = RDP_ENCODE_QUEUED;
+	wl_list_insert(encoder->queue.prev, &context->encode_link);
+	pthread_cond_signal(&encoder->queue_cond);
+	pthread_mutex_unlock(&encoder->mutex);
+}
+
+static void
+rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+
+	pixman_region32_union(&context->pending_damage,
+			      &context->pending_damage, region);
+	rdp_peer_flush(context);
+}
+
+static void
+rdp_output_finish_frame(struct rdp_output *output)
+{
+	struct timespec ts;
+
+	output->frame_pending = false;
+	wl_event_source_timer_update(output->finish_frame_timer, 0);
+
+	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
+	weston_output_finish_frame(&output->base, &ts, 0);
+}
+
+static bool
+rdp_output_peers_ready(struct rdp_output *output)
+{
+	struct rdp_peers_item *item;
+	RdpPeerContext *context;
+
+	wl_list_for_each(item, &output->peers, link) {
+		context = container_of(item, RdpPeerContext, item);
+		if (rdp_peer_is_active(context) && !rdp_peer_ready(context))
+			return false;
+	}
+
+	return true;
+}
+
+/* The frame of a repaint completes once the refresh interval passed and
+ * every peer took its update, so the repaint rate follows the slowest
+ * client up to RDP_FRAME_STALL_MSEC. */
+static void
+rdp_output_update_frame(struct rdp_output *output)
+{
+	if (!output->frame_pending || !output->frame_interval_elapsed)
+		return;
+
+	if (rdp_output_peers_ready(output))
+		rdp_output_finish_frame(output);
+}
+
+static int
+rdp_encoder_done_handler(int fd, uint32_t mask, void *data)
+{
+	struct rdp_backend *b = data;
+	struct rdp_encoder *encoder = b->encoder;
+	struct wl_list done;
+	RdpPeerContext *context, *next;
+	uint64_t count;
+	int signal_failures;
+
+	if (read(fd, &count, sizeof count) != sizeof count)
+		return 1;
+
+	wl_list_init(&done);
+	pthread_mutex_lock(&encoder->mutex);
+	wl_list_insert_list(&done, &encoder->done);
+	wl_list_init(&encoder->done);
+	wl_list_for_each(context, &done, encode_link)
+		context->encode_state = RDP_ENCODE_IDLE;
+	signal_failures = encoder->signal_failures;
+	encoder->signal_failures = 0;
+	pthread_mutex_unlock(&encoder->mutex);
+
+	if (signal_failures > 0)
+		weston_log("rdp: failed to signal %d encoded updates\n",
+			   signal_failures);
+
+	wl_list_for_each_safe(context, next, &done, encode_link) {
+		wl_list_remove(&context->encode_link);
+		context->encoding = false;
+
+		if (rdp_peer_is_active(context))
+			rdp_peer_send_encoded(context);
+		pixman_region32_clear(&context->encode_damage);
+
+		rdp_peer_flush(context);
+	}
+
+	rdp_output_update_frame(b->output);
+
+	return 1;
+}
+
+static void
+rdp_encoder_destroy(struct rdp_encoder *encoder)
+{
+	int i;
+
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->stopping = true;
+	pthread_cond_broadcast(&encoder->queue_cond);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	for (i = 0; i < encoder->nthreads; i++)
+		pthread_join(encoder->threads[i], NULL);
+
+	if (encoder->done_source)
+		wl_event_source_remove(encoder->done_source);
+	if (encoder->done_fd >= 0)
+		close(encoder->done_fd);
+
+	pthread_cond_destroy(&encoder->done_cond);
+	pthread_cond_destroy(&encoder->queue_cond);
+	pthread_mutex_destroy(&encoder->mutex);
+	free(encoder->threads);
+	free(encoder);
+}
+
+static struct rdp_encoder *
+rdp_encoder_create(struct rdp_backend *b, int nthreads)
+{
+	struct rdp_encoder *encoder;
+	struct wl_event_loop *loop;
+
+	encoder = zalloc(sizeof *encoder);
+	if (!encoder)
+		return NULL;
+
+	pthread_mutex_init(&encoder->mutex, NULL);
+	pthread_cond_init(&encoder->queue_cond, NULL);
+	pthread_cond_init(&encoder->done_cond, NULL);
+	wl_list_init(&encoder->queue);
+	wl_list_init(&encoder->done);
+
+	encoder->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (encoder->done_fd < 0)
+		goto err;
+
+	loop = wl_display_get_event_loop(b->compositor->wl_display);
+	encoder->done_source = wl_event_loop_add_fd(loop, encoder->done_fd,
+						    WL_EVENT_READABLE,
+						    rdp_encoder_done_handler, b);
+	if (!encoder->done_source)
+		goto err;
+
+	encoder->threads = zalloc(nthreads * sizeof *encoder->threads);
+	if (!encoder->threads)
+		goto err;
+
+	for (encoder->nthreads = 0; encoder->nthreads < nthreads;
+	     encoder->nthreads++) {
+		if (pthread_create(&encoder->threads[encoder->nthreads], NULL,
+				   rdp_encoder_thread, encoder) != 0)
+			goto err;
+	}
+
+	weston_log("RDP encoding on %d thread%s\n",
+		   nthreads, nthreads > 1 ? "s" : "");
+
+	return encoder;
+
+err:
+	weston_log("failed to start the RDP encoder threads\n");
+	rdp_encoder_destroy(encoder);
+	return NULL;
 }
 
 static void
@@ -367,7 +759,11 @@ rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage)
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	weston_compositor_read_presentation_clock(ec, &output->repaint_time);
+	output->frame_pending = true;
+	output->frame_interval_elapsed = false;
+	wl_event_source_timer_update(output->finish_frame_timer,
+				     1000000 / output->base.current_mode->refresh);
 	return 0;
 }
 
@@ -384,10 +780,23 @@ static int
 finish_frame_handler(void *data)
 {
 	struct rdp_output *output = data;
-	struct timespec ts;
+	struct timespec now, elapsed;
+	int64_t elapsed_msec;
 
-	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
-	weston_output_finish_frame(&output->base, &ts, 0);
+	output->frame_interval_elapsed = true;
+	if (!output->frame_pending)
+		return 1;
+
+	weston_compositor_read_presentation_clock(output->base.compositor, &now);
+	timespec_sub(&elapsed, &now, &output->repaint_time);
+	elapsed_msec = timespec_to_nsec(&elapsed) / 1000000;
+
+	if (elapsed_msec >= RDP_FRAME_STALL_MSEC ||
+	    rdp_output_peers_ready(output))
+		rdp_output_finish_frame(output);
+	else
+		wl_event_source_timer_update(output->finish_frame_timer,
+					     RDP_FRAME_STALL_MSEC - elapsed_msec);
 
 	return 1;
 }
@@ -443,7 +852,7 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 	output->current_mode->flags |= WL_OUTPUT_MODE_CURRENT;
 
 	pixman_renderer_output_destroy(output);
-	pixman_renderer_output_create(output);
+	pixman_renderer_output_create(output, PIXMAN_RENDERER_OUTPUT_CACHEABLE);
 
 	new_shadow_buffer = pixman_image_create_bits(PIXMAN_x8r8g8b8, target_mode->width,
 			target_mode->height, 0, target_mode->width * 4);
@@ -509,7 +918,8 @@ rdp_backend_create_output(struct rdp_backend *b, int width, int height)
 		goto out_output;
 	}
 
-	if (pixman_renderer_output_create(&output->base) < 0)
+	if (pixman_renderer_output_create(&output->base,
+					  PIXMAN_RENDERER_OUTPUT_CACHEABLE) < 0)
 		goto out_shadow_surface;
 
 	loop = wl_display_get_event_loop(b->compositor->wl_display);
@@ -553,6 +963,7 @@ rdp_destroy(struct weston_compositor *ec)
 			wl_event_source_remove(b->listener_events[i]);
 
 	freerdp_listener_free(b->listener);
+	rdp_encoder_destroy(b->encoder);
 
 	free(b->server_cert);
 	free(b->server_key);
@@ -630,6 +1041,9 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 	if (!context->encode_stream)
 		goto out_error_stream;
 
+	pixman_region32_init(&context->pending_damage);
+	pixman_region32_init(&context->encode_damage);
+
 	FREERDP_CB_RETURN(TRUE);
 
 out_error_nsc:
@@ -652,6 +1066,16 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 			wl_event_source_remove(context->events[i]);
 	}
 
+	rdp_peer_encode_cancel(context);
+	if (context->snapshot)
+		pixman_image_unref(context->snapshot);
+	pixman_region32_fini(&context->pending_damage);
+	pixman_region32_fini(&context->encode_damage);
+
+	/* the output may have been waiting for this peer */
+	if (context->rdpBackend)
+		rdp_output_update_frame(context->rdpBackend->output);
+
 	if (context->item.flags & RDP_PEER_ACTIVATED) {
 		weston_seat_release_keyboard(context->item.seat);
 		weston_seat_release_pointer(context->item.seat);
@@ -885,9 +1309,15 @@ xf_peer_activate(freerdp_peer* client)
 	}
 
 	weston_output = &output->base;
+	rdp_peer_encode_cancel(peerCtx);
 	RFX_RESET(peerCtx->rfx_context, weston_output->width, weston_output->height);
 	NSC_RESET(peerCtx->nsc_context, weston_output->width, weston_output->height);
 
+	/* a client announcing frame acknowledgement tells how many frames
+	 * it accepts to have outstanding, updates are paced accordingly */
+	peerCtx->max_unacked_frames = settings->FrameAcknowledge;
+	peerCtx->acked_frame_id = peerCtx->frame_id;
+
 	if (peersItem->flags & RDP_PEER_ACTIVATED)
 		return TRUE;
 
@@ -1119,6 +1549,21 @@ xf_suppress_output(rdpContext *context, BYTE allow, RECTANGLE_16 *area)
 	else
 		peerContext->item.flags &= (~RDP_PEER_OUTPUT_ENABLED);
 
+	rdp_output_update_frame(peerContext->rdpBackend->output);
+
+	FREERDP_CB_RETURN(TRUE);
+}
+
+static FREERDP_CB_RET_TYPE
+xf_surface_frame_acknowledge(rdpContext *context, UINT32 frameId)
+{
+	RdpPeerContext *peerContext = (RdpPeerContext *)context;
+
+	peerContext->acked_frame_id = frameId;
+
+	rdp_peer_flush(peerContext);
+	rdp_output_update_frame(peerContext->rdpBackend->output);
+
 	FREERDP_CB_RETURN(TRUE);
 }
 
@@ -1172,6 +1617,7 @@ rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 	client->Activate = xf_peer_activate;
 
 	client->update->SuppressOutput = xf_suppress_output;
+	client->update->SurfaceFrameAcknowledge = xf_surface_frame_acknowledge;
 
 	input = client->input;
 	input->SynchronizeEvent = xf_input_synchronize_event;
@@ -1223,7 +1669,7 @@ rdp_backend_create(struct weston_compositor *compositor,
 	struct rdp_backend *b;
 	char *fd_str;
 	char *fd_tail;
-	int fd;
+	int fd, nthreads;
 
 	b = zalloc(sizeof *b);
 	if (b == NULL)
@@ -1254,6 +1700,16 @@ rdp_backend_create(struct weston_compositor *compositor,
 	if (rdp_backend_create_output(b, config->width, config->height) < 0)
 		goto err_compositor;
 
+	nthreads = config->encoder_threads;
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	b->encoder = rdp_encoder_create(b, nthreads);
+	if (!b->encoder)
+		goto err_output;
+
 	compositor->capabilities |= WESTON_CAP_ARBITRARY_MODES;
 
 	if (!config->env_socket) {
@@ -1287,6 +1743,8 @@ rdp_backend_create(struct weston_compositor *compositor,
 err_listener:
 	freerdp_listener_free(b->listener);
 err_output:
+	if (b->encoder)
+		rdp_encoder_destroy(b->encoder);
 	weston_output_destroy(&b->output->base);
 err_compositor:
 	weston_compositor_shutdown(compositor);
@@ -1310,6 +1768,7 @@ config_init_to_defaults(struct weston_rdp_backend_config *config)
 	config->server_key = NULL;
 	config->env_socket = 0;
 	config->no_clients_resize = 0;
+	config->encoder_threads = 0;
 }
 
 WL_EXPORT int
@@ -32,7 +32,7 @@ extern "C" {
 
 #include "compositor.h"
 
-#define WESTON_RDP_BACKEND_CONFIG_VERSION 1
+#define WESTON_RDP_BACKEND_CONFIG_VERSION 2
 
 struct weston_rdp_backend_config {
 	struct weston_backend_config base;
@@ -45,6 +45,7 @@ struct weston_rdp_backend_config {
 	char *server_key;
 	int env_socket;
 	int no_clients_resize;
+	int encoder_threads;
 };
 
 #ifdef  __cplusplus
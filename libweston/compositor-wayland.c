@@ -26,6 +26,7 @@
 
 #include "config.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -49,11 +50,15 @@
 #include "shared/os-compatibility.h"
 #include "shared/cairo-util.h"
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
 #include "presentation-time-server-protocol.h"
 #include "linux-dmabuf.h"
 
 #define WINDOW_TITLE "Weston Compositor"
 
+/* Client buffers each output can forward to parent subsurfaces */
+#define WAYLAND_OUTPUT_PLANE_COUNT 4
+
 struct wayland_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
@@ -65,6 +70,9 @@ struct wayland_backend {
 		struct wl_shell *shell;
 		struct zwp_fullscreen_shell_v1 *fshell;
 		struct wl_shm *shm;
+		struct wl_subcompositor *subcompositor;
+		struct zwp_linux_dmabuf_v1 *dmabuf;
+		struct wl_array dmabuf_formats;
 
 		struct wl_list output_list;
 
@@ -73,6 +81,7 @@ struct wayland_backend {
 	} parent;
 
 	int use_pixman;
+	int use_planes;
 	int sprawl_across_outputs;
 
 	struct theme *theme;
@@ -83,6 +92,27 @@ struct wayland_backend {
 	struct wl_list input_list;
 };
 
+/* A parent subsurface of an output, showing one client buffer that is
+ * forwarded to the parent instead of being composited. */
+struct wayland_plane {
+	struct weston_plane base;
+	struct wayland_output *output;
+
+	struct wl_surface *surface;
+	struct wl_subsurface *subsurface;
+
+	/* The view assigned for the frame being repainted */
+	struct weston_view *view;
+	int32_t x, y;
+
+	/* What the parent surface currently shows */
+	struct weston_view *shown_view;
+	bool mapped;
+
+	/* Copies of SHM client buffers, see wayland_plane_get_shm_buffer() */
+	struct wl_list shm_buffers;
+};
+
 struct wayland_output {
 	struct weston_output base;
 
@@ -119,6 +149,9 @@ struct wayland_output {
 
 	struct weston_mode mode;
 	uint32_t scale;
+
+	struct wayland_plane planes[WAYLAND_OUTPUT_PLANE_COUNT];
+	int planes_used;	/* top to bottom, by this frame's views */
 };
 
 struct wayland_parent_output {
@@ -159,6 +192,31 @@ struct wayland_shm_buffer {
 	cairo_surface_t *c_surface;
 };
 
+/* A parent SHM buffer a plane copies SHM client buffers into */
+struct wayland_plane_shm_buffer {
+	struct wayland_plane *plane;	/* NULL once orphaned */
+	struct wl_list link;
+
+	struct wl_buffer *buffer;
+	void *data;
+	size_t size;
+	int32_t width, height, stride;
+	uint32_t format;
+	bool busy;
+};
+
+/* A parent wl_buffer importing the dmabuf of a client buffer. It lives
+ * as long as the client buffer, and holds a reference to it while the
+ * parent may still read from it. */
+struct wayland_dmabuf_buffer {
+	struct weston_buffer *buffer;	/* NULL once destroyed */
+	struct wl_listener buffer_destroy_listener;
+
+	struct wl_buffer *parent_buffer;
+	struct weston_buffer_reference ref;
+	bool busy;
+};
+
 struct wayland_input {
 	struct weston_seat base;
 	struct wayland_backend *backend;
@@ -330,6 +388,490 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 	return sb;
 }
 
+static void
+wayland_plane_shm_buffer_destroy(struct wayland_plane_shm_buffer *sb)
+{
+	wl_buffer_destroy(sb->buffer);
+	munmap(sb->data, sb->size);
+	wl_list_remove(&sb->link);
+	free(sb);
+}
+
+static void
+wayland_plane_shm_buffer_release(void *data, struct wl_buffer *buffer)
+{
+	struct wayland_plane_shm_buffer *sb = data;
+
+	sb->busy = false;
+	if (!sb->plane)
+		wayland_plane_shm_buffer_destroy(sb);
+}
+
+static const struct wl_buffer_listener plane_shm_buffer_listener = {
+	wayland_plane_shm_buffer_release
+};
+
+static struct wayland_plane_shm_buffer *
+wayland_plane_get_shm_buffer(struct wayland_plane *plane,
+			     int32_t width, int32_t height, int32_t stride,
+			     uint32_t format)
+{
+	struct wayland_backend *b =
+		to_wayland_backend(plane->output->base.compositor);
+	struct wayland_plane_shm_buffer *sb, *next;
+	struct wl_shm_pool *pool;
+	int fd;
+
+	wl_list_for_each_safe(sb, next, &plane->shm_buffers, link) {
+		if (sb->busy)
+			continue;
+		if (sb->width == width && sb->height == height &&
+		    sb->stride == stride && sb->format == format)
+			return sb;
+
+		wayland_plane_shm_buffer_destroy(sb);
+	}
+
+	sb = zalloc(sizeof *sb);
+	if (sb == NULL)
+		return NULL;
+
+	sb->size = height * stride;
+	fd = os_create_anonymous_file(sb->size);
+	if (fd < 0) {
+		weston_log("could not create an anonymous file buffer: %m\n");
+		free(sb);
+		return NULL;
+	}
+
+	sb->data = mmap(NULL, sb->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (sb->data == MAP_FAILED) {
+		weston_log("could not mmap %zu memory for data: %m\n",
+			   sb->size);
+		close(fd);
+		free(sb);
+		return NULL;
+	}
+
+	pool = wl_shm_create_pool(b->parent.shm, fd, sb->size);
+	sb->buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
+					       stride, format);
+	wl_buffer_add_listener(sb->buffer, &plane_shm_buffer_listener, sb);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	sb->plane = plane;
+	sb->width = width;
+	sb->height = height;
+	sb->stride = stride;
+	sb->format = format;
+	wl_list_insert(&plane->shm_buffers, &sb->link);
+
+	return sb;
+}
+
+static void
+wayland_dmabuf_buffer_destroy(struct wayland_dmabuf_buffer *db)
+{
+	wl_buffer_destroy(db->parent_buffer);
+	free(db);
+}
+
+static void
+wayland_dmabuf_buffer_release(void *data, struct wl_buffer *buffer)
+{
+	struct wayland_dmabuf_buffer *db = data;
+
+	db->busy = false;
+	weston_buffer_reference(&db->ref, NULL);
+
+	if (!db->buffer)
+		wayland_dmabuf_buffer_destroy(db);
+}
+
+static const struct wl_buffer_listener dmabuf_buffer_listener = {
+	wayland_dmabuf_buffer_release
+};
+
+static void
+wayland_dmabuf_buffer_handle_destroy(struct wl_listener *listener,
+				     void *data)
+{
+	struct wayland_dmabuf_buffer *db =
+		container_of(listener, struct wayland_dmabuf_buffer,
+			     buffer_destroy_listener);
+
+	/* While busy, the reference is cleared by its own destroy
+	 * listener, and the parent buffer is destroyed on release. */
+	wl_list_remove(&db->buffer_destroy_listener.link);
+	db->buffer = NULL;
+
+	if (!db->busy)
+		wayland_dmabuf_buffer_destroy(db);
+}
+
+static bool
+wayland_backend_has_dmabuf_format(struct wayland_backend *b, uint32_t format)
+{
+	uint32_t *f;
+
+	wl_array_for_each(f, &b->parent.dmabuf_formats)
+		if (*f == format)
+			return true;
+
+	return false;
+}
+
+static struct wayland_dmabuf_buffer *
+wayland_dmabuf_buffer_get(struct wayland_backend *b,
+			  struct weston_buffer *buffer,
+			  struct linux_dmabuf_buffer *dmabuf)
+{
+	struct dmabuf_attributes *attributes = &dmabuf->attributes;
+	struct zwp_linux_buffer_params_v1 *params;
+	struct wayland_dmabuf_buffer *db;
+	struct wl_listener *listener;
+	int i;
+
+	listener = wl_signal_get(&buffer->destroy_signal,
+				 wayland_dmabuf_buffer_handle_destroy);
+	if (listener)
+		return container_of(listener, struct wayland_dmabuf_buffer,
+				    buffer_destroy_listener);
+
+	/* create_immed failures may be fatal, so only forward what the
+	 * parent advertised */
+	if (!b->parent.dmabuf ||
+	    !wayland_backend_has_dmabuf_format(b, attributes->format))
+		return NULL;
+
+	db = zalloc(sizeof *db);
+	if (db == NULL)
+		return NULL;
+
+	params = zwp_linux_dmabuf_v1_create_params(b->parent.dmabuf);
+	for (i = 0; i < attributes->n_planes; i++)
+		zwp_linux_buffer_params_v1_add(params, attributes->fd[i], i,
+					       attributes->offset[i],
+					       attributes->stride[i],
+					       attributes->modifier[i] >> 32,
+					       attributes->modifier[i] & 0xffffffff);
+	db->parent_buffer =
+		zwp_linux_buffer_params_v1_create_immed(params,
+							attributes->width,
+							attributes->height,
+							attributes->format,
+							attributes->flags);
+	zwp_linux_buffer_params_v1_destroy(params);
+	wl_buffer_add_listener(db->parent_buffer, &dmabuf_buffer_listener, db);
+
+	db->buffer = buffer;
+	db->buffer_destroy_listener.notify =
+		wayland_dmabuf_buffer_handle_destroy;
+	wl_signal_add(&buffer->destroy_signal, &db->buffer_destroy_listener);
+
+	return db;
+}
+
+static struct weston_plane *
+wayland_output_prepare_plane_view(struct wayland_output *output,
+				  struct weston_view *ev)
+{
+	struct wayland_backend *b =
+		to_wayland_backend(output->base.compositor);
+	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct wl_shm_buffer *shm_buffer;
+	struct wayland_plane *plane;
+	pixman_box32_t *box;
+	int32_t ix = 0, iy = 0;
+
+	if (output->planes_used == WAYLAND_OUTPUT_PLANE_COUNT)
+		return NULL;
+
+	if (ev->output_mask != (1u << output->base.id))
+		return NULL;
+
+	if (buffer == NULL || ev->alpha != 1.0f)
+		return NULL;
+
+	/* The parent shows buffer pixels 1:1 at an integer offset */
+	if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    viewport->buffer.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    viewport->buffer.scale != output->base.current_scale ||
+	    viewport->buffer.src_width != wl_fixed_from_int(-1) ||
+	    viewport->surface.width != -1)
+		return NULL;
+
+	if (ev->transform.enabled &&
+	    (ev->transform.matrix.type & ~WESTON_MATRIX_TRANSFORM_TRANSLATE))
+		return NULL;
+
+	box = pixman_region32_extents(&ev->transform.boundingbox);
+	if (pixman_region32_contains_rectangle(&output->base.region,
+					       box) != PIXMAN_REGION_IN)
+		return NULL;
+
+	shm_buffer = wl_shm_buffer_get(buffer->resource);
+	if (shm_buffer) {
+		if (wl_shm_buffer_get_format(shm_buffer) != WL_SHM_FORMAT_ARGB8888 &&
+		    wl_shm_buffer_get_format(shm_buffer) != WL_SHM_FORMAT_XRGB8888)
+			return NULL;
+	} else if ((dmabuf = linux_dmabuf_buffer_get(buffer->resource))) {
+		if (!wayland_dmabuf_buffer_get(b, buffer, dmabuf))
+			return NULL;
+	} else {
+		return NULL;
+	}
+
+	if (output->frame)
+		frame_interior(output->frame, &ix, &iy, NULL, NULL);
+
+	plane = &output->planes[output->planes_used++];
+	plane->view = ev;
+	plane->x = (box->x1 - output->base.x) * output->base.current_scale + ix;
+	plane->y = (box->y1 - output->base.y) * output->base.current_scale + iy;
+
+	return &plane->base;
+}
+
+static void
+wayland_output_assign_planes(struct weston_output *output_base)
+{
+	struct wayland_output *output = to_wayland_output(output_base);
+	struct wayland_backend *b =
+		to_wayland_backend(output->base.compositor);
+	struct weston_compositor *ec = output->base.compositor;
+	struct weston_view *ev, *next;
+	struct weston_plane *primary, *next_plane;
+	pixman_region32_t overlap, surface_overlap;
+
+	/*
+	 * Forward client buffers to subsurfaces of the parent surface,
+	 * the way the DRM backend uses overlays, so that the parent
+	 * composites them and we don't have to. SHM buffers are still
+	 * copied once into a parent buffer, dmabufs are imported by the
+	 * parent as they are.
+	 *
+	 * The subsurfaces are stacked above the output, so only views
+	 * that no view left on the primary plane overlaps from above
+	 * qualify. Parent subsurfaces are restacked to match the order
+	 * of the views.
+	 */
+	pixman_region32_init(&overlap);
+	primary = &ec->primary_plane;
+	output->planes_used = 0;
+
+	wl_list_for_each_safe(ev, next, &ec->view_list, link) {
+		struct weston_surface *es = ev->surface;
+
+		/* SHM buffers are only copied at repaint, keep them
+		 * around until then, like the pixman renderer does. */
+		if (b->use_pixman ||
+		    (es->buffer_ref.buffer &&
+		     wl_shm_buffer_get(es->buffer_ref.buffer->resource)))
+			es->keep_buffer = true;
+		else
+			es->keep_buffer = false;
+
+		pixman_region32_init(&surface_overlap);
+		pixman_region32_intersect(&surface_overlap, &overlap,
+					  &ev->transform.boundingbox);
+
+		next_plane = NULL;
+		if (pixman_region32_not_empty(&surface_overlap))
+			next_plane = primary;
+		if (next_plane == NULL)
+			next_plane = wayland_output_prepare_plane_view(output,
+								       ev);
+		if (next_plane == NULL)
+			next_plane = primary;
+
+		weston_view_move_to_plane(ev, next_plane);
+
+		if (next_plane == primary) {
+			pixman_region32_union(&overlap, &overlap,
+					      &ev->transform.boundingbox);
+			ev->psf_flags = 0;
+		} else if (wl_shm_buffer_get(es->buffer_ref.buffer->resource)) {
+			ev->psf_flags = 0;
+		} else {
+			ev->psf_flags = WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
+		}
+
+		pixman_region32_fini(&surface_overlap);
+	}
+	pixman_region32_fini(&overlap);
+}
+
+static int
+wayland_plane_attach_shm(struct wayland_plane *plane,
+			 struct wl_shm_buffer *shm_buffer)
+{
+	struct wayland_plane_shm_buffer *sb;
+	int32_t width, height, stride;
+
+	width = wl_shm_buffer_get_width(shm_buffer);
+	height = wl_shm_buffer_get_height(shm_buffer);
+	stride = wl_shm_buffer_get_stride(shm_buffer);
+
+	sb = wayland_plane_get_shm_buffer(plane, width, height, stride,
+					  wl_shm_buffer_get_format(shm_buffer));
+	if (sb == NULL)
+		return -1;
+
+	wl_shm_buffer_begin_access(shm_buffer);
+	memcpy(sb->data, wl_shm_buffer_get_data(shm_buffer), sb->size);
+	wl_shm_buffer_end_access(shm_buffer);
+
+	sb->busy = true;
+	wl_surface_attach(plane->surface, sb->buffer, 0, 0);
+
+	return 0;
+}
+
+static void
+wayland_plane_attach_dmabuf(struct wayland_plane *plane,
+			    struct weston_buffer *buffer)
+{
+	struct wayland_dmabuf_buffer *db;
+	struct wl_listener *listener;
+
+	listener = wl_signal_get(&buffer->destroy_signal,
+				 wayland_dmabuf_buffer_handle_destroy);
+	db = container_of(listener, struct wayland_dmabuf_buffer,
+			  buffer_destroy_listener);
+
+	db->busy = true;
+	weston_buffer_reference(&db->ref, buffer);
+	wl_surface_attach(plane->surface, db->parent_buffer, 0, 0);
+}
+
+/* Sends the state of the planes to the parent. It is applied along with
+ * the next commit of the output surface, as the subsurfaces are
+ * synchronized. */
+static void
+wayland_output_update_planes(struct wayland_output *output)
+{
+	struct wl_surface *below = output->parent.surface;
+	struct wayland_plane *plane;
+	struct weston_buffer *buffer;
+	struct wl_shm_buffer *shm_buffer;
+	int i;
+
+	for (i = WAYLAND_OUTPUT_PLANE_COUNT - 1; i >= 0; i--) {
+		plane = &output->planes[i];
+
+		if (!plane->surface)
+			continue;
+
+		if (i >= output->planes_used) {
+			if (plane->mapped) {
+				wl_surface_attach(plane->surface, NULL, 0, 0);
+				wl_surface_commit(plane->surface);
+				plane->mapped = false;
+			}
+			plane->shown_view = NULL;
+			pixman_region32_clear(&plane->base.damage);
+			continue;
+		}
+
+		wl_subsurface_set_position(plane->subsurface,
+					   plane->x, plane->y);
+		wl_subsurface_place_above(plane->subsurface, below);
+		below = plane->surface;
+
+		if (plane->shown_view != plane->view ||
+		    pixman_region32_not_empty(&plane->base.damage)) {
+			buffer = plane->view->surface->buffer_ref.buffer;
+			shm_buffer = wl_shm_buffer_get(buffer->resource);
+			if (shm_buffer) {
+				if (wayland_plane_attach_shm(plane,
+							     shm_buffer) < 0)
+					weston_log("failed to copy a buffer "
+						   "for a parent subsurface\n");
+			} else {
+				wayland_plane_attach_dmabuf(plane, buffer);
+			}
+
+			wl_surface_damage(plane->surface, 0, 0,
+					  INT32_MAX, INT32_MAX);
+			plane->shown_view = plane->view;
+			plane->mapped = true;
+		}
+
+		wl_surface_commit(plane->surface);
+		pixman_region32_clear(&plane->base.damage);
+		plane->view = NULL;
+	}
+
+	/* Without a new assignment, the next frame shows no planes */
+	output->planes_used = 0;
+}
+
+static void
+wayland_output_init_planes(struct wayland_output *output)
+{
+	struct wayland_backend *b =
+		to_wayland_backend(output->base.compositor);
+	struct weston_compositor *ec = b->compositor;
+	struct wayland_plane *plane;
+	struct wl_region *region;
+	int i;
+
+	for (i = 0; i < WAYLAND_OUTPUT_PLANE_COUNT; i++) {
+		plane = &output->planes[i];
+		plane->output = output;
+		wl_list_init(&plane->shm_buffers);
+
+		plane->surface =
+			wl_compositor_create_surface(b->parent.compositor);
+		plane->subsurface =
+			wl_subcompositor_get_subsurface(b->parent.subcompositor,
+							plane->surface,
+							output->parent.surface);
+
+		/* Input goes to the output surface underneath */
+		region = wl_compositor_create_region(b->parent.compositor);
+		wl_surface_set_input_region(plane->surface, region);
+		wl_region_destroy(region);
+
+		weston_plane_init(&plane->base, ec, 0, 0);
+		weston_compositor_stack_plane(ec, &plane->base,
+					      &ec->primary_plane);
+	}
+}
+
+static void
+wayland_output_destroy_planes(struct wayland_output *output)
+{
+	struct wayland_plane *plane;
+	struct wayland_plane_shm_buffer *sb, *next;
+	int i;
+
+	for (i = 0; i < WAYLAND_OUTPUT_PLANE_COUNT; i++) {
+		plane = &output->planes[i];
+		if (!plane->surface)
+			continue;
+
+		wl_list_for_each_safe(sb, next, &plane->shm_buffers, link) {
+			if (sb->busy) {
+				wl_list_remove(&sb->link);
+				wl_list_init(&sb->link);
+				sb->plane = NULL;
+			} else {
+				wayland_plane_shm_buffer_destroy(sb);
+			}
+		}
+
+		wl_subsurface_destroy(plane->subsurface);
+		wl_surface_destroy(plane->surface);
+		weston_plane_release(&plane->base);
+	}
+}
+
 static void
 frame_done(void *data, struct wl_callback *callback, uint32_t time)
 {
@@ -480,6 +1022,7 @@ wayland_output_repaint_gl(struct weston_output *output_base,
 	wl_callback_add_listener(callback, &frame_listener, output);
 
 	wayland_output_update_gl_border(output);
+	wayland_output_update_planes(output);
 
 	ec->renderer->repaint_output(&output->base, damage);
 
@@ -601,6 +1144,7 @@ wayland_output_repaint_pixman(struct weston_output *output_base,
 	b->compositor->renderer->repaint_output(output_base, &sb->damage);
 
 	wayland_shm_buffer_attach(sb);
+	wayland_output_update_planes(output);
 
 	callback = wl_surface_frame(output->parent.surface);
 	wl_callback_add_listener(callback, &frame_listener, output);
@@ -623,6 +1167,8 @@ wayland_output_destroy(struct weston_output *output_base)
 	struct wayland_backend *b =
 		to_wayland_backend(output->base.compositor);
 
+	wayland_output_destroy_planes(output);
+
 	if (b->use_pixman) {
 		pixman_renderer_output_destroy(output_base);
 	} else {
@@ -689,7 +1235,7 @@ cleanup_window:
 static int
 wayland_output_init_pixman_renderer(struct wayland_output *output)
 {
-	return pixman_renderer_output_create(&output->base);
+	return pixman_renderer_output_create(&output->base, 0);
 }
 
 static void
@@ -1081,6 +1627,10 @@ wayland_output_create(struct wayland_backend *b, int x, int y,
 	output->base.start_repaint_loop = wayland_output_start_repaint_loop;
 	output->base.destroy = wayland_output_destroy;
 	output->base.assign_planes = NULL;
+	if (b->use_planes && b->parent.subcompositor && b->parent.shm) {
+		wayland_output_init_planes(output);
+		output->base.assign_planes = wayland_output_assign_planes;
+	}
 	output->base.set_backlight = NULL;
 	output->base.set_dpms = NULL;
 	output->base.switch_mode = wayland_output_switch_mode;
@@ -2040,6 +2590,21 @@ wayland_parent_output_destroy(struct wayland_parent_output *output)
 	}
 }
 
+static void
+dmabuf_format(void *data, struct zwp_linux_dmabuf_v1 *dmabuf, uint32_t format)
+{
+	struct wayland_backend *b = data;
+	uint32_t *f;
+
+	f = wl_array_add(&b->parent.dmabuf_formats, sizeof *f);
+	if (f)
+		*f = format;
+}
+
+static const struct zwp_linux_dmabuf_v1_listener dmabuf_listener = {
+	dmabuf_format
+};
+
 static void
 registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
 		       const char *interface, uint32_t version)
@@ -2065,6 +2630,18 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
 	} else if (strcmp(interface, "wl_shm") == 0) {
 		b->parent.shm =
 			wl_registry_bind(registry, name, &wl_shm_interface, 1);
+	} else if (strcmp(interface, "wl_subcompositor") == 0) {
+		b->parent.subcompositor =
+			wl_registry_bind(registry, name,
+					 &wl_subcompositor_interface, 1);
+	} else if (strcmp(interface, "zwp_linux_dmabuf_v1") == 0 &&
+		   version >= 2) {
+		/* Version 2 brings create_immed */
+		b->parent.dmabuf =
+			wl_registry_bind(registry, name,
+					 &zwp_linux_dmabuf_v1_interface, 2);
+		zwp_linux_dmabuf_v1_add_listener(b->parent.dmabuf,
+						 &dmabuf_listener, b);
 	}
 }
 
@@ -2123,6 +2700,11 @@ wayland_destroy(struct weston_compositor *ec)
 
 	if (b->parent.shm)
 		wl_shm_destroy(b->parent.shm);
+	if (b->parent.subcompositor)
+		wl_subcompositor_destroy(b->parent.subcompositor);
+	if (b->parent.dmabuf)
+		zwp_linux_dmabuf_v1_destroy(b->parent.dmabuf);
+	wl_array_release(&b->parent.dmabuf_formats);
 
 	free(b);
 }
@@ -2204,6 +2786,7 @@ wayland_backend_create(struct weston_compositor *compositor,
 
 	wl_list_init(&b->parent.output_list);
 	wl_list_init(&b->input_list);
+	wl_array_init(&b->parent.dmabuf_formats);
 	b->parent.registry = wl_display_get_registry(b->parent.wl_display);
 	wl_registry_add_listener(b->parent.registry, &registry_listener, b);
 	wl_display_roundtrip(b->parent.wl_display);
@@ -2211,6 +2794,10 @@ wayland_backend_create(struct weston_compositor *compositor,
 	create_cursor(b, new_config);
 
 	b->use_pixman = new_config->use_pixman;
+	b->use_planes = new_config->use_planes;
+	if (b->use_planes && !b->parent.subcompositor)
+		weston_log("The parent compositor has no wl_subcompositor, "
+			   "compositing all views.\n");
 
 	if (!b->use_pixman) {
 		gl_renderer = weston_load_module("gl-renderer.so",
@@ -2287,6 +2874,7 @@ wayland_backend_destroy(struct wayland_backend *b)
 static void
 config_init_to_defaults(struct weston_wayland_backend_config *config)
 {
+	config->use_planes = 0;
 }
 
 WL_EXPORT int
@@ -34,7 +34,7 @@ extern "C" {
 
 #include <stdint.h>
 
-#define WESTON_WAYLAND_BACKEND_CONFIG_VERSION 1
+#define WESTON_WAYLAND_BACKEND_CONFIG_VERSION 2
 
 struct weston_wayland_backend_output_config {
 	int width;
@@ -54,6 +54,10 @@ struct weston_wayland_backend_config {
 	int cursor_size;
 	int num_outputs;
 	struct weston_wayland_backend_output_config *outputs;
+
+	/** Whether to forward suitable client buffers to subsurfaces of
+	 * the parent compositor instead of compositing them. */
+	int use_planes;
 };
 
 #ifdef  __cplusplus
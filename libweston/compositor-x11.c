@@ -62,6 +62,10 @@
 
 #define DEFAULT_AXIS_STEP_DISTANCE 10
 
+/* SHM segments each pixman output rotates through, so that the next
+ * frame can be rendered while the X server still reads earlier ones. */
+#define X11_SHM_BUFFER_COUNT 3
+
 struct x11_backend {
 	struct weston_backend	 base;
 	struct weston_compositor *compositor;
@@ -75,6 +79,7 @@ struct x11_backend {
 	struct xkb_keymap	*xkb_keymap;
 	unsigned int		 has_xkb;
 	uint8_t			 xkb_event_base;
+	uint8_t			 shm_event_base;
 	int			 use_pixman;
 
 	int			 has_net_wm_state_fullscreen;
@@ -104,6 +109,22 @@ struct x11_backend {
 	} atom;
 };
 
+struct x11_shm_buffer {
+	xcb_shm_seg_t		segment;
+	pixman_image_t	       *hw_surface;
+	void		       *buf;
+
+	/* Output damage not yet copied into this buffer, in global
+	 * coordinates. */
+	pixman_region32_t	damage;
+
+	/* Set while the X server may still read the segment, that is
+	 * until the ShmCompletion event, or the error, for the
+	 * put_image request with this sequence number arrives. */
+	bool			busy;
+	unsigned int		sequence;
+};
+
 struct x11_output {
 	struct weston_output	base;
 
@@ -112,12 +133,15 @@ struct x11_output {
 	struct wl_event_source *finish_frame_timer;
 
 	xcb_gc_t		gc;
-	xcb_shm_seg_t		segment;
-	pixman_image_t	       *hw_surface;
-	int			shm_id;
-	void		       *buf;
+	struct x11_shm_buffer	shm_buffers[X11_SHM_BUFFER_COUNT];
+	int			next_shm_buffer;
 	uint8_t			depth;
 	int32_t                 scale;
+
+	/* A frame is only finished once a segment is free for the next
+	 * one, so that repaint never has to wait for the X server. */
+	bool			finish_pending;
+	uint32_t		finish_pending_flags;
 };
 
 struct window_delete_data {
@@ -374,13 +398,44 @@ x11_input_destroy(struct x11_backend *b)
 	weston_seat_release(&b->core_seat);
 }
 
+static struct x11_shm_buffer *
+x11_output_get_shm_buffer(struct x11_output *output)
+{
+	struct x11_shm_buffer *buffer;
+	int i, n;
+
+	for (i = 0; i < X11_SHM_BUFFER_COUNT; i++) {
+		n = (output->next_shm_buffer + i) % X11_SHM_BUFFER_COUNT;
+		buffer = &output->shm_buffers[n];
+		if (buffer->hw_surface && !buffer->busy)
+			return buffer;
+	}
+
+	return NULL;
+}
+
 static void
-x11_output_start_repaint_loop(struct weston_output *output)
+x11_output_finish_frame(struct x11_output *output, uint32_t flags)
 {
+	struct x11_backend *b = to_x11_backend(output->base.compositor);
 	struct timespec ts;
 
-	weston_compositor_read_presentation_clock(output->compositor, &ts);
-	weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
+	if (b->use_pixman && !x11_output_get_shm_buffer(output)) {
+		output->finish_pending = true;
+		output->finish_pending_flags = flags;
+		return;
+	}
+
+	output->finish_pending = false;
+	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
+	weston_output_finish_frame(&output->base, &ts, flags);
+}
+
+static void
+x11_output_start_repaint_loop(struct weston_output *output)
+{
+	x11_output_finish_frame(to_x11_output(output),
+				WP_PRESENTATION_FEEDBACK_INVALID);
 }
 
 static int
@@ -408,9 +463,7 @@ set_clip_for_output(struct weston_output *output_base, pixman_region32_t *region
 	pixman_region32_t transformed_region;
 	pixman_box32_t *rects;
 	xcb_rectangle_t *output_rects;
-	xcb_void_cookie_t cookie;
 	int nrects, i;
-	xcb_generic_error_t *err;
 
 	pixman_region32_init(&transformed_region);
 	pixman_region32_copy(&transformed_region, region);
@@ -438,15 +491,9 @@ set_clip_for_output(struct weston_output *output_base, pixman_region32_t *region
 
 	pixman_region32_fini(&transformed_region);
 
-	cookie = xcb_set_clip_rectangles_checked(b->conn, XCB_CLIP_ORDERING_UNSORTED,
-					output->gc,
-					0, 0, nrects,
-					output_rects);
-	err = xcb_request_check(b->conn, cookie);
-	if (err != NULL) {
-		weston_log("Failed to set clip rects, err: %d\n", err->error_code);
-		free(err);
-	}
+	/* Errors are reported through x11_backend_deliver_error() */
+	xcb_set_clip_rectangles(b->conn, XCB_CLIP_ORDERING_UNSORTED,
+				output->gc, 0, 0, nrects, output_rects);
 	free(output_rects);
 }
 
@@ -458,28 +505,49 @@ x11_output_repaint_shm(struct weston_output *output_base,
 	struct x11_output *output = to_x11_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
 	struct x11_backend *b = to_x11_backend(ec);
+	struct x11_shm_buffer *buffer;
+	pixman_region32_t repaint;
 	xcb_void_cookie_t cookie;
-	xcb_generic_error_t *err;
-
-	pixman_renderer_output_set_buffer(output_base, output->hw_surface);
-	ec->renderer->repaint_output(output_base, damage);
+	int i;
+
+	/* Frames are only finished with a free segment, see
+	 * x11_output_finish_frame() */
+	buffer = x11_output_get_shm_buffer(output);
+	assert(buffer);
+	output->next_shm_buffer =
+		(buffer - output->shm_buffers + 1) % X11_SHM_BUFFER_COUNT;
+
+	/* Bring the segment up to date with everything that changed
+	 * since it was last presented, and hand the new damage to the
+	 * other segments. */
+	pixman_region32_init(&repaint);
+	pixman_region32_union(&repaint, damage, &buffer->damage);
+	for (i = 0; i < X11_SHM_BUFFER_COUNT; i++)
+		pixman_region32_union(&output->shm_buffers[i].damage,
+				      &output->shm_buffers[i].damage, damage);
+	pixman_region32_clear(&buffer->damage);
+
+	pixman_renderer_output_set_buffer(output_base, buffer->hw_surface);
+	ec->renderer->repaint_output(output_base, &repaint);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
-	set_clip_for_output(output_base, damage);
-	cookie = xcb_shm_put_image_checked(b->conn, output->window, output->gc,
-					pixman_image_get_width(output->hw_surface),
-					pixman_image_get_height(output->hw_surface),
-					0, 0,
-					pixman_image_get_width(output->hw_surface),
-					pixman_image_get_height(output->hw_surface),
-					0, 0, output->depth, XCB_IMAGE_FORMAT_Z_PIXMAP,
-					0, output->segment, 0);
-	err = xcb_request_check(b->conn, cookie);
-	if (err != NULL) {
-		weston_log("Failed to put shm image, err: %d\n", err->error_code);
-		free(err);
-	}
+	set_clip_for_output(output_base, &repaint);
+	pixman_region32_fini(&repaint);
+
+	/* Neither checked nor waited for: the segment stays busy until
+	 * the ShmCompletion event for this request arrives. */
+	cookie = xcb_shm_put_image(b->conn, output->window, output->gc,
+				   pixman_image_get_width(buffer->hw_surface),
+				   pixman_image_get_height(buffer->hw_surface),
+				   0, 0,
+				   pixman_image_get_width(buffer->hw_surface),
+				   pixman_image_get_height(buffer->hw_surface),
+				   0, 0, output->depth, XCB_IMAGE_FORMAT_Z_PIXMAP,
+				   1, buffer->segment, 0);
+	buffer->busy = true;
+	buffer->sequence = cookie.sequence;
+	xcb_flush(b->conn);
 
 	wl_event_source_timer_update(output->finish_frame_timer, 10);
 	return 0;
@@ -489,30 +557,116 @@ static int
 finish_frame_handler(void *data)
 {
 	struct x11_output *output = data;
-	struct timespec ts;
 
-	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
-	weston_output_finish_frame(&output->base, &ts, 0);
+	x11_output_finish_frame(output, 0);
 
 	return 1;
 }
 
 static void
-x11_output_deinit_shm(struct x11_backend *b, struct x11_output *output)
+x11_output_release_shm_buffer(struct x11_output *output,
+			      struct x11_shm_buffer *buffer)
+{
+	buffer->busy = false;
+
+	if (output->finish_pending)
+		x11_output_finish_frame(output, output->finish_pending_flags);
+}
+
+static struct x11_shm_buffer *
+x11_backend_find_shm_buffer(struct x11_backend *b,
+			    struct x11_output **output_ret,
+			    xcb_shm_seg_t segment, unsigned int sequence)
+{
+	struct x11_output *output;
+	struct x11_shm_buffer *buffer;
+	int i;
+
+	wl_list_for_each(output, &b->compositor->output_list, base.link) {
+		for (i = 0; i < X11_SHM_BUFFER_COUNT; i++) {
+			buffer = &output->shm_buffers[i];
+			if (!buffer->busy)
+				continue;
+			if ((segment && buffer->segment == segment) ||
+			    (!segment && buffer->sequence == sequence)) {
+				*output_ret = output;
+				return buffer;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void
+x11_backend_deliver_shm_completion(struct x11_backend *b,
+				   xcb_shm_completion_event_t *completion)
+{
+	struct x11_output *output;
+	struct x11_shm_buffer *buffer;
+
+	buffer = x11_backend_find_shm_buffer(b, &output,
+					     completion->shmseg, 0);
+	if (buffer)
+		x11_output_release_shm_buffer(output, buffer);
+}
+
+static void
+x11_backend_deliver_error(struct x11_backend *b, xcb_generic_error_t *err)
+{
+	struct x11_output *output;
+	struct x11_shm_buffer *buffer;
+
+	weston_log("X11 request %d.%d failed, error %d\n",
+		   err->major_code, err->minor_code, err->error_code);
+
+	/* A failed put_image never completes */
+	buffer = x11_backend_find_shm_buffer(b, &output, 0,
+					     err->full_sequence);
+	if (buffer)
+		x11_output_release_shm_buffer(output, buffer);
+}
+
+static void
+x11_output_deinit_shm_buffer(struct x11_backend *b,
+			     struct x11_shm_buffer *buffer)
 {
 	xcb_void_cookie_t cookie;
 	xcb_generic_error_t *err;
-	xcb_free_gc(b->conn, output->gc);
 
-	pixman_image_unref(output->hw_surface);
-	output->hw_surface = NULL;
-	cookie = xcb_shm_detach_checked(b->conn, output->segment);
-	err = xcb_request_check(b->conn, cookie);
-	if (err) {
-		weston_log("xcb_shm_detach failed, error %d\n", err->error_code);
-		free(err);
+	if (buffer->hw_surface) {
+		pixman_image_unref(buffer->hw_surface);
+		buffer->hw_surface = NULL;
+	}
+
+	if (buffer->segment) {
+		cookie = xcb_shm_detach_checked(b->conn, buffer->segment);
+		err = xcb_request_check(b->conn, cookie);
+		if (err) {
+			weston_log("xcb_shm_detach failed, error %d\n",
+				   err->error_code);
+			free(err);
+		}
+		buffer->segment = 0;
+	}
+
+	if (buffer->buf) {
+		shmdt(buffer->buf);
+		buffer->buf = NULL;
 	}
-	shmdt(output->buf);
+
+	pixman_region32_fini(&buffer->damage);
+}
+
+static void
+x11_output_deinit_shm(struct x11_backend *b, struct x11_output *output)
+{
+	int i;
+
+	xcb_free_gc(b->conn, output->gc);
+
+	for (i = 0; i < X11_SHM_BUFFER_COUNT; i++)
+		x11_output_deinit_shm_buffer(b, &output->shm_buffers[i]);
 }
 
 static void
@@ -689,6 +843,54 @@ get_depth_of_visual(xcb_screen_t *screen,
 	return 0;
 }
 
+static int
+x11_output_init_shm_buffer(struct x11_backend *b, struct x11_output *output,
+			   struct x11_shm_buffer *buffer,
+			   int width, int height, int bitsperpixel,
+			   pixman_format_code_t pixman_format)
+{
+	xcb_void_cookie_t cookie;
+	xcb_generic_error_t *err;
+	int shm_id;
+
+	/* Nothing has been copied into the segment yet */
+	pixman_region32_init(&buffer->damage);
+	pixman_region32_copy(&buffer->damage, &output->base.region);
+
+	/* Create SHM segment and attach it */
+	shm_id = shmget(IPC_PRIVATE, width * height * (bitsperpixel / 8), IPC_CREAT | S_IRWXU);
+	if (shm_id == -1) {
+		weston_log("x11shm: failed to allocate SHM segment\n");
+		return -1;
+	}
+	buffer->buf = shmat(shm_id, NULL, 0 /* read/write */);
+	if (-1 == (long)buffer->buf) {
+		weston_log("x11shm: failed to attach SHM segment\n");
+		buffer->buf = NULL;
+		shmctl(shm_id, IPC_RMID, NULL);
+		return -1;
+	}
+	buffer->segment = xcb_generate_id(b->conn);
+	cookie = xcb_shm_attach_checked(b->conn, buffer->segment, shm_id, 1);
+	err = xcb_request_check(b->conn, cookie);
+	if (err) {
+		weston_log("x11shm: xcb_shm_attach error %d, op code %d, resource id %d\n",
+			   err->error_code, err->major_code, err->minor_code);
+		free(err);
+		buffer->segment = 0;
+		shmctl(shm_id, IPC_RMID, NULL);
+		return -1;
+	}
+
+	shmctl(shm_id, IPC_RMID, NULL);
+
+	/* Now create pixman image */
+	buffer->hw_surface = pixman_image_create_bits(pixman_format, width, height, buffer->buf,
+		width * (bitsperpixel / 8));
+
+	return 0;
+}
+
 static int
 x11_output_init_shm(struct x11_backend *b, struct x11_output *output,
 	int width, int height)
@@ -696,11 +898,10 @@ x11_output_init_shm(struct x11_backend *b, struct x11_output *output,
 	xcb_visualtype_t *visual_type;
 	xcb_screen_t *screen;
 	xcb_format_iterator_t fmt;
-	xcb_void_cookie_t cookie;
-	xcb_generic_error_t *err;
 	const xcb_query_extension_reply_t *ext;
 	int bitsperpixel = 0;
 	pixman_format_code_t pixman_format;
+	int i;
 
 	/* Check if SHM is available */
 	ext = xcb_get_extension_data(b->conn, &xcb_shm_id);
@@ -756,36 +957,21 @@ x11_output_init_shm(struct x11_backend *b, struct x11_output *output,
 	}
 
 
-	/* Create SHM segment and attach it */
-	output->shm_id = shmget(IPC_PRIVATE, width * height * (bitsperpixel / 8), IPC_CREAT | S_IRWXU);
-	if (output->shm_id == -1) {
-		weston_log("x11shm: failed to allocate SHM segment\n");
-		return -1;
-	}
-	output->buf = shmat(output->shm_id, NULL, 0 /* read/write */);
-	if (-1 == (long)output->buf) {
-		weston_log("x11shm: failed to attach SHM segment\n");
-		return -1;
-	}
-	output->segment = xcb_generate_id(b->conn);
-	cookie = xcb_shm_attach_checked(b->conn, output->segment, output->shm_id, 1);
-	err = xcb_request_check(b->conn, cookie);
-	if (err) {
-		weston_log("x11shm: xcb_shm_attach error %d, op code %d, resource id %d\n",
-			   err->error_code, err->major_code, err->minor_code);
-		free(err);
-		return -1;
-	}
-
-	shmctl(output->shm_id, IPC_RMID, NULL);
-
-	/* Now create pixman image */
-	output->hw_surface = pixman_image_create_bits(pixman_format, width, height, output->buf,
-		width * (bitsperpixel / 8));
+	b->shm_event_base = ext->first_event;
 
 	output->gc = xcb_generate_id(b->conn);
 	xcb_create_gc(b->conn, output->gc, output->window, 0, NULL);
 
+	for (i = 0; i < X11_SHM_BUFFER_COUNT; i++) {
+		if (x11_output_init_shm_buffer(b, output,
+					       &output->shm_buffers[i],
+					       width, height, bitsperpixel,
+					       pixman_format) < 0) {
+			x11_output_deinit_shm(b, output);
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -943,7 +1129,10 @@ x11_backend_create_output(struct x11_backend *b, int x, int y,
 			weston_log("Failed to initialize SHM for the X11 output\n");
 			return NULL;
 		}
-		if (pixman_renderer_output_create(&output->base) < 0) {
+		/* The stale damage of each segment is part of its
+		 * repaint, so it can be painted into directly. */
+		if (pixman_renderer_output_create(&output->base,
+						  PIXMAN_RENDERER_OUTPUT_CACHEABLE) < 0) {
 			weston_log("Failed to create pixman renderer for output\n");
 			x11_output_deinit_shm(b, output);
 			return NULL;
@@ -1449,6 +1638,16 @@ x11_backend_handle_event(int fd, uint32_t mask, void *data)
 		}
 #endif
 
+		if (response_type == 0) {
+			x11_backend_deliver_error(b,
+					(xcb_generic_error_t *) event);
+		} else if (b->use_pixman &&
+			   response_type ==
+			   b->shm_event_base + XCB_SHM_COMPLETION) {
+			x11_backend_deliver_shm_completion(b,
+					(xcb_shm_completion_event_t *) event);
+		}
+
 		count++;
 		if (prev != event)
 			free (event);
@@ -63,6 +63,7 @@
 #include "git-version.h"
 #include "version.h"
 #include "plugin-registry.h"
+#include "repaint-deadline.h"
 
 #define DEFAULT_REPAINT_WINDOW 7 /* milliseconds */
 
@@ -78,6 +79,7 @@ static void weston_mode_switch_finish(struct weston_output *output,
 				      int scale_changed)
 {
 	struct weston_seat *seat;
+	struct weston_view *view;
 	struct wl_resource *resource;
 	pixman_region32_t old_output_region;
 	int version;
@@ -94,6 +96,9 @@ static void weston_mode_switch_finish(struct weston_output *output,
 
 	weston_output_update_matrix(output);
 
+	wl_list_for_each(view, &output->compositor->view_list, link)
+		weston_view_geometry_dirty(view);
+
 	/* If a pointer falls outside the outputs new geometry, move it to its
 	 * lower-right corner */
 	wl_list_for_each(seat, &output->compositor->seat_list, link) {
@@ -455,6 +460,8 @@ weston_surface_create(struct weston_compositor *compositor)
 	if (surface == NULL)
 		return NULL;
 
+	surface->occluded_mask = ~0u;
+
 	wl_signal_init(&surface->destroy_signal);
 	wl_signal_init(&surface->commit_signal);
 
@@ -1213,6 +1220,182 @@ get_view_layer(struct weston_view *view)
 	return view->layer_link.layer;
 }
 
+/* The pick grid is a fixed number of cells that wraps around, so views
+ * far apart in the global space may share a cell. That only costs a
+ * bounding box check during picking.
+ */
+#define PICK_GRID_CELL_SHIFT	7	/* 128 pixel cells */
+#define PICK_GRID_DIM		32
+
+static struct wl_array *
+pick_grid_cell(struct weston_compositor *ec, int32_t cx, int32_t cy)
+{
+	int32_t mask = PICK_GRID_DIM - 1;
+
+	return &ec->pick_grid.cells[(cy & mask) * PICK_GRID_DIM + (cx & mask)];
+}
+
+static bool
+pick_grid_cell_insert(struct wl_array *cell, struct weston_view *view)
+{
+	struct weston_view **views;
+	size_t i;
+
+	if (!wl_array_add(cell, sizeof *views))
+		return false;
+
+	/* Keep the cell in view list order. Views are appended in order
+	 * when the grid is rebuilt, so this rarely needs to move any. */
+	views = cell->data;
+	i = cell->size / sizeof *views - 1;
+	while (i > 0 && views[i - 1]->pick_grid.index > view->pick_grid.index) {
+		views[i] = views[i - 1];
+		i--;
+	}
+	views[i] = view;
+
+	return true;
+}
+
+static void
+pick_grid_cell_remove(struct wl_array *cell, struct weston_view *view)
+{
+	struct weston_view **views = cell->data;
+	size_t n = cell->size / sizeof *views;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (views[i] != view)
+			continue;
+
+		memmove(&views[i], &views[i + 1],
+			(n - i - 1) * sizeof *views);
+		cell->size -= sizeof *views;
+		return;
+	}
+}
+
+static bool
+pick_grid_in_grid(struct weston_view *view)
+{
+	struct weston_compositor *ec = view->surface->compositor;
+
+	return ec->pick_grid.valid &&
+	       view->pick_grid.serial == ec->pick_grid.serial;
+}
+
+static void
+pick_grid_unlink_view(struct weston_view *view)
+{
+	struct weston_compositor *ec = view->surface->compositor;
+	int32_t cx, cy;
+
+	for (cy = view->pick_grid.y1; cy < view->pick_grid.y2; cy++)
+		for (cx = view->pick_grid.x1; cx < view->pick_grid.x2; cx++)
+			pick_grid_cell_remove(pick_grid_cell(ec, cx, cy), view);
+
+	view->pick_grid.serial = 0;
+}
+
+static void
+pick_grid_link_view(struct weston_view *view)
+{
+	struct weston_compositor *ec = view->surface->compositor;
+	pixman_box32_t *box;
+	int32_t cx, cy;
+
+	view->pick_grid.serial = ec->pick_grid.serial;
+	view->pick_grid.x1 = view->pick_grid.x2 = 0;
+	view->pick_grid.y1 = view->pick_grid.y2 = 0;
+
+	box = pixman_region32_extents(&view->transform.boundingbox);
+	if (box->x1 >= box->x2 || box->y1 >= box->y2)
+		return;
+
+	/* A view wider or taller than the grid is in every column or
+	 * row, but only once. */
+	view->pick_grid.x1 = box->x1 >> PICK_GRID_CELL_SHIFT;
+	view->pick_grid.x2 = ((box->x2 - 1) >> PICK_GRID_CELL_SHIFT) + 1;
+	if (view->pick_grid.x2 - view->pick_grid.x1 > PICK_GRID_DIM)
+		view->pick_grid.x2 = view->pick_grid.x1 + PICK_GRID_DIM;
+
+	view->pick_grid.y1 = box->y1 >> PICK_GRID_CELL_SHIFT;
+	view->pick_grid.y2 = ((box->y2 - 1) >> PICK_GRID_CELL_SHIFT) + 1;
+	if (view->pick_grid.y2 - view->pick_grid.y1 > PICK_GRID_DIM)
+		view->pick_grid.y2 = view->pick_grid.y1 + PICK_GRID_DIM;
+
+	for (cy = view->pick_grid.y1; cy < view->pick_grid.y2; cy++) {
+		for (cx = view->pick_grid.x1; cx < view->pick_grid.x2; cx++) {
+			if (pick_grid_cell_insert(pick_grid_cell(ec, cx, cy),
+						  view))
+				continue;
+
+			/* Out of memory, fall back to the view list. */
+			ec->pick_grid.valid = false;
+			return;
+		}
+	}
+}
+
+static void
+pick_grid_rebuild(struct weston_compositor *ec)
+{
+	struct weston_view *view;
+	uint32_t index = 0;
+	int i;
+
+	if (!ec->pick_grid.cells) {
+		ec->pick_grid.cells = calloc(PICK_GRID_DIM * PICK_GRID_DIM,
+					     sizeof *ec->pick_grid.cells);
+		if (!ec->pick_grid.cells)
+			return;
+
+		for (i = 0; i < PICK_GRID_DIM * PICK_GRID_DIM; i++)
+			wl_array_init(&ec->pick_grid.cells[i]);
+	}
+
+	for (i = 0; i < PICK_GRID_DIM * PICK_GRID_DIM; i++)
+		ec->pick_grid.cells[i].size = 0;
+
+	if (++ec->pick_grid.serial == 0)
+		++ec->pick_grid.serial;
+	ec->pick_grid.valid = true;
+
+	wl_list_for_each(view, &ec->view_list, link) {
+		view->pick_grid.index = index++;
+		pick_grid_link_view(view);
+		if (!ec->pick_grid.valid)
+			return;
+	}
+}
+
+static void
+pick_grid_release(struct weston_compositor *ec)
+{
+	int i;
+
+	if (!ec->pick_grid.cells)
+		return;
+
+	for (i = 0; i < PICK_GRID_DIM * PICK_GRID_DIM; i++)
+		wl_array_release(&ec->pick_grid.cells[i]);
+
+	free(ec->pick_grid.cells);
+	ec->pick_grid.cells = NULL;
+	ec->pick_grid.valid = false;
+}
+
+/* Move the view to the grid cells of its new bounding box. */
+static void
+weston_view_update_pick_grid(struct weston_view *view)
+{
+	if (!pick_grid_in_grid(view))
+		return;
+
+	pick_grid_unlink_view(view);
+	pick_grid_link_view(view);
+}
+
 WL_EXPORT void
 weston_view_update_transform(struct weston_view *view)
 {
@@ -1269,6 +1452,9 @@ weston_view_update_transform(struct weston_view *view)
 
 	weston_view_assign_output(view);
 
+	weston_view_update_pick_grid(view);
+	view->surface->compositor->geometry_generation++;
+
 	wl_signal_emit(&view->surface->compositor->transform_signal,
 		       view->surface);
 }
@@ -1691,38 +1877,74 @@ weston_compositor_get_time(void)
        return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
-WL_EXPORT struct weston_view *
-weston_compositor_pick_view(struct weston_compositor *compositor,
-			    wl_fixed_t x, wl_fixed_t y,
-			    wl_fixed_t *vx, wl_fixed_t *vy)
+static bool
+view_accepts_point(struct weston_view *view, wl_fixed_t x, wl_fixed_t y,
+		   wl_fixed_t *vx, wl_fixed_t *vy)
 {
-	struct weston_view *view;
 	wl_fixed_t view_x, view_y;
 	int view_ix, view_iy;
-	int ix = wl_fixed_to_int(x);
-	int iy = wl_fixed_to_int(y);
 
-	wl_list_for_each(view, &compositor->view_list, link) {
-		if (!pixman_region32_contains_point(
-				&view->transform.boundingbox, ix, iy, NULL))
-			continue;
+	if (!pixman_region32_contains_point(&view->transform.boundingbox,
+					    wl_fixed_to_int(x),
+					    wl_fixed_to_int(y), NULL))
+		return false;
 
-		weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
-		view_ix = wl_fixed_to_int(view_x);
-		view_iy = wl_fixed_to_int(view_y);
+	weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
+	view_ix = wl_fixed_to_int(view_x);
+	view_iy = wl_fixed_to_int(view_y);
 
-		if (!pixman_region32_contains_point(&view->surface->input,
-						    view_ix, view_iy, NULL))
-			continue;
+	if (!pixman_region32_contains_point(&view->surface->input,
+					    view_ix, view_iy, NULL))
+		return false;
 
-		if (view->geometry.scissor_enabled &&
-		    !pixman_region32_contains_point(&view->geometry.scissor,
-						    view_ix, view_iy, NULL))
-			continue;
+	if (view->geometry.scissor_enabled &&
+	    !pixman_region32_contains_point(&view->geometry.scissor,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	*vx = view_x;
+	*vy = view_y;
+	return true;
+}
+
+/** Find the topmost view accepting input at a point
+ *
+ * \param compositor The compositor.
+ * \param x Global x coordinate.
+ * \param y Global y coordinate.
+ * \param vx Returns the x coordinate in the view's coordinate space.
+ * \param vy Returns the y coordinate in the view's coordinate space.
+ * \return The view, or NULL if there is none.
+ *
+ * Only the views in the grid cell containing the point are checked. The
+ * grid is rebuilt on demand after the view list has been invalidated,
+ * and kept up to date by weston_view_update_transform() otherwise.
+ */
+WL_EXPORT struct weston_view *
+weston_compositor_pick_view(struct weston_compositor *compositor,
+			    wl_fixed_t x, wl_fixed_t y,
+			    wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	struct weston_view *view, **vp;
+	struct wl_array *cell;
+
+	if (!compositor->pick_grid.valid)
+		pick_grid_rebuild(compositor);
+
+	if (compositor->pick_grid.valid) {
+		cell = pick_grid_cell(compositor,
+				      wl_fixed_to_int(x) >> PICK_GRID_CELL_SHIFT,
+				      wl_fixed_to_int(y) >> PICK_GRID_CELL_SHIFT);
 
-		*vx = view_x;
-		*vy = view_y;
-		return view;
+		wl_array_for_each(vp, cell) {
+			if (view_accepts_point(*vp, x, y, vx, vy))
+				return *vp;
+		}
+	} else {
+		wl_list_for_each(view, &compositor->view_list, link) {
+			if (view_accepts_point(view, x, y, vx, vy))
+				return view;
+		}
 	}
 
 	*vx = wl_fixed_from_int(-1000000);
@@ -1730,6 +1952,10 @@ weston_compositor_pick_view(struct weston_compositor *compositor,
 	return NULL;
 }
 
+/* Picking is deterministic for a given pointer position and scene
+ * geometry, and pointer motion repicks on its own. So if no geometry
+ * changed since the last repick, repicking would not change anything.
+ */
 static void
 weston_compositor_repick(struct weston_compositor *compositor)
 {
@@ -1738,6 +1964,15 @@ weston_compositor_repick(struct weston_compositor *compositor)
 	if (!compositor->session_active)
 		return;
 
+	if (compositor->repicks > 0 &&
+	    compositor->repick_generation == compositor->geometry_generation) {
+		compositor->repicks_skipped++;
+		return;
+	}
+
+	compositor->repick_generation = compositor->geometry_generation;
+	compositor->repicks++;
+
 	wl_list_for_each(seat, &compositor->seat_list, link)
 		weston_seat_repick(seat);
 }
@@ -1754,6 +1989,7 @@ weston_view_unmap(struct weston_view *view)
 	view->output = NULL;
 	view->plane = NULL;
 	view->is_mapped = false;
+	weston_compositor_invalidate_view_list(view->surface->compositor);
 	weston_layer_entry_remove(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
@@ -1787,6 +2023,7 @@ weston_surface_unmap(struct weston_surface *surface)
 	wl_list_for_each(view, &surface->views, surface_link)
 		weston_view_unmap(view);
 	surface->output = NULL;
+	weston_compositor_invalidate_view_list(surface->compositor);
 }
 
 static void
@@ -1814,6 +2051,11 @@ weston_view_destroy(struct weston_view *view)
 	wl_list_remove(&view->link);
 	weston_layer_entry_remove(&view->layer_link);
 
+	if (pick_grid_in_grid(view))
+		pick_grid_unlink_view(view);
+
+	view->surface->compositor->geometry_generation++;
+
 	pixman_region32_fini(&view->clip);
 	pixman_region32_fini(&view->geometry.scissor);
 	pixman_region32_fini(&view->transform.boundingbox);
@@ -2037,9 +2279,31 @@ view_accumulate_damage(struct weston_view *view,
 	pixman_region32_union(opaque, opaque, &view->transform.opaque);
 }
 
+/** Accumulate the damage of the views shown on an output
+ *
+ * \param output The output about to be repainted.
+ *
+ * Only the views of surfaces shown on the output are considered, so on
+ * a multi-head setup an output does not pay for the scene on the other
+ * heads. Flushing a surface clears its damage, so all views of such a
+ * surface are accumulated, and the damage is added to the planes as a
+ * whole, not clipped to the output. The other outputs then still see it
+ * in the plane damage when they repaint.
+ *
+ * weston_view::clip is only accurate inside the output region, which is
+ * all the renderer needs. Outside of it the clip can only be smaller,
+ * which makes weston_view_damage_below() err on the side of more damage.
+ *
+ * The result is stored in weston_output::damage and weston_output::clip.
+ *
+ * Surfaces that are on no output at all are flushed too, so that their
+ * buffers still get released early.
+ */
 static void
-compositor_accumulate_damage(struct weston_compositor *ec)
+output_accumulate_damage(struct weston_output *output)
 {
+	struct weston_compositor *ec = output->compositor;
+	uint32_t output_bit = 1u << output->id;
 	struct weston_plane *plane;
 	struct weston_view *ev;
 	pixman_region32_t opaque, clip;
@@ -2055,6 +2319,9 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 			if (ev->plane != plane)
 				continue;
 
+			if (!(ev->surface->output_mask & output_bit))
+				continue;
+
 			view_accumulate_damage(ev, &opaque);
 		}
 
@@ -2064,12 +2331,24 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 
 	pixman_region32_fini(&clip);
 
+	pixman_region32_intersect(&output->clip,
+				  &ec->primary_plane.clip, &output->region);
+	pixman_region32_intersect(&output->damage,
+				  &ec->primary_plane.damage, &output->region);
+	pixman_region32_subtract(&output->damage,
+				 &output->damage, &output->clip);
+
 	wl_list_for_each(ev, &ec->view_list, link)
 		ev->surface->touched = false;
 
 	wl_list_for_each(ev, &ec->view_list, link) {
 		if (ev->surface->touched)
 			continue;
+
+		if (ev->surface->output_mask != 0 &&
+		    !(ev->surface->output_mask & output_bit))
+			continue;
+
 		ev->surface->touched = true;
 
 		surface_flush_damage(ev->surface);
@@ -2196,6 +2475,8 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	struct weston_view *view;
 	struct weston_layer *layer;
 
+	compositor->view_list_rebuilds++;
+
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_stash_subsurface_views(view->surface);
@@ -2210,6 +2491,52 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_free_unused_subsurface_views(view->surface);
+
+	/* Freeing the unused views above unmaps them, which invalidates
+	 * the list again. The list is consistent now, so clear it last. */
+	compositor->view_list_needs_rebuild = false;
+	compositor->pick_grid.valid = false;
+	compositor->geometry_generation++;
+}
+
+/** Mark the compositor view list as stale
+ *
+ * \param compositor The compositor.
+ *
+ * The view list is derived from the layer list, the views in each layer
+ * and the sub-surface stacking of their surfaces. It is rebuilt before
+ * a repaint only if something marked it stale since the last rebuild.
+ *
+ * The layer entry, view unmap and sub-surface functions call this
+ * automatically. A shell that inserts or removes a weston_layer from
+ * weston_compositor::layer_list with wl_list functions directly must call
+ * this afterwards.
+ */
+WL_EXPORT void
+weston_compositor_invalidate_view_list(struct weston_compositor *compositor)
+{
+	compositor->view_list_needs_rebuild = true;
+	compositor->pick_grid.valid = false;
+	compositor->geometry_generation++;
+}
+
+/* Rebuild the view list if it is stale, otherwise only update the
+ * transforms of the views already in it.
+ */
+static void
+weston_compositor_update_view_list(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+
+	if (compositor->view_list_needs_rebuild) {
+		weston_compositor_build_view_list(compositor);
+		return;
+	}
+
+	compositor->view_list_rebuilds_skipped++;
+
+	wl_list_for_each(view, &compositor->view_list, link)
+		weston_view_update_transform(view);
 }
 
 static void
@@ -2237,6 +2564,111 @@ weston_output_take_feedback_list(struct weston_output *output,
 	wl_list_init(&surface->feedback_list);
 }
 
+/* Work out which surfaces on the output are covered by opaque views or
+ * off the output entirely, from the clip left by
+ * output_accumulate_damage(). Subsurfaces usually only get committed
+ * with their parent, so a surface tree counts as visible if any of its
+ * views is. */
+static void
+output_update_occlusion(struct weston_output *output)
+{
+	struct weston_compositor *ec = output->compositor;
+	uint32_t output_bit = 1u << output->id;
+	struct weston_surface *main_surface;
+	struct weston_view *ev;
+	pixman_region32_t visible;
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		main_surface = weston_surface_get_main_surface(ev->surface);
+		main_surface->occluded_mask |= output_bit;
+	}
+
+	pixman_region32_init(&visible);
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (!(ev->output_mask & output_bit))
+			continue;
+
+		pixman_region32_intersect(&visible,
+					  &ev->transform.boundingbox,
+					  &output->region);
+		pixman_region32_subtract(&visible, &visible, &ev->clip);
+		pixman_region32_subtract(&visible, &visible, &ev->plane->clip);
+		if (pixman_region32_not_empty(&visible)) {
+			main_surface =
+				weston_surface_get_main_surface(ev->surface);
+			main_surface->occluded_mask &= ~output_bit;
+		}
+	}
+	pixman_region32_fini(&visible);
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		main_surface = weston_surface_get_main_surface(ev->surface);
+		ev->surface->occluded_mask = main_surface->occluded_mask;
+	}
+}
+
+/* A surface is only hidden if it is hidden on every output, whichever
+ * of them it is assigned to. */
+static bool
+surface_is_occluded(struct weston_surface *surface)
+{
+	struct weston_compositor *ec = surface->compositor;
+
+	return ec->occluded_frame_rate > 0 &&
+	       (surface->occluded_mask & ec->output_id_pool) ==
+	       ec->output_id_pool;
+}
+
+/* Move the frame callbacks and presentation feedback of a surface over
+ * to the output. Hidden surfaces get their feedback discarded, and
+ * their frame callbacks only at occluded_frame_rate; callbacks held
+ * back stay with the surface and the returned number of milliseconds
+ * until they are due is >0. */
+static int
+output_take_frame_callbacks(struct weston_output *output,
+			    struct weston_surface *surface,
+			    struct wl_list *frame_callback_list)
+{
+	struct weston_compositor *ec = output->compositor;
+	uint32_t interval, elapsed;
+
+	if (!surface_is_occluded(surface)) {
+		wl_list_insert_list(frame_callback_list,
+				    &surface->frame_callback_list);
+		wl_list_init(&surface->frame_callback_list);
+
+		weston_output_take_feedback_list(output, surface);
+		return 0;
+	}
+
+	weston_presentation_feedback_discard_list(&surface->feedback_list);
+
+	if (wl_list_empty(&surface->frame_callback_list))
+		return 0;
+
+	interval = 1000 / ec->occluded_frame_rate;
+	elapsed = output->frame_time - surface->occluded_frame_time;
+	if (elapsed < interval)
+		return interval - elapsed;
+
+	surface->occluded_frame_time = output->frame_time;
+	wl_list_insert_list(frame_callback_list,
+			    &surface->frame_callback_list);
+	wl_list_init(&surface->frame_callback_list);
+
+	return 0;
+}
+
+static int
+frame_throttle_timer_handler(void *data)
+{
+	struct weston_output *output = data;
+
+	weston_output_schedule_repaint(output);
+
+	return 0;
+}
+
 static int
 weston_output_repaint(struct weston_output *output)
 {
@@ -2245,16 +2677,21 @@ weston_output_repaint(struct weston_output *output)
 	struct weston_animation *animation, *next;
 	struct weston_frame_callback *cb, *cnext;
 	struct wl_list frame_callback_list;
-	pixman_region32_t output_damage;
-	int r;
+	int r, hold, hold_msec = 0;
 
 	if (output->destroying)
 		return 0;
 
 	TL_POINT("core_repaint_begin", TLP_OUTPUT(output), TLP_END);
 
-	/* Rebuild the surface list and update surface transforms up front. */
-	weston_compositor_build_view_list(ec);
+	/* Rebuild the surface list if needed and update surface transforms
+	 * up front. */
+	weston_compositor_update_view_list(ec);
+
+	TL_POINT("core_view_list", TLP_OUTPUT(output),
+		 TLP_COUNTER("rebuilds", ec->view_list_rebuilds),
+		 TLP_COUNTER("skipped", ec->view_list_rebuilds_skipped),
+		 TLP_END);
 
 	if (output->assign_planes && !output->disable_planes) {
 		output->assign_planes(output);
@@ -2265,39 +2702,42 @@ weston_output_repaint(struct weston_output *output)
 		}
 	}
 
+	output_accumulate_damage(output);
+
+	if (ec->occluded_frame_rate > 0)
+		output_update_occlusion(output);
+
 	wl_list_init(&frame_callback_list);
 	wl_list_for_each(ev, &ec->view_list, link) {
 		/* Note: This operation is safe to do multiple times on the
 		 * same surface.
 		 */
 		if (ev->surface->output == output) {
-			wl_list_insert_list(&frame_callback_list,
-					    &ev->surface->frame_callback_list);
-			wl_list_init(&ev->surface->frame_callback_list);
-
-			weston_output_take_feedback_list(output, ev->surface);
+			hold = output_take_frame_callbacks(output, ev->surface,
+							   &frame_callback_list);
+			if (hold > 0 && (hold_msec == 0 || hold < hold_msec))
+				hold_msec = hold;
 		}
 	}
 
-	compositor_accumulate_damage(ec);
-
-	pixman_region32_init(&output_damage);
-	pixman_region32_intersect(&output_damage,
-				  &ec->primary_plane.damage, &output->region);
-	pixman_region32_subtract(&output_damage,
-				 &output_damage, &ec->primary_plane.clip);
+	if (hold_msec > 0)
+		wl_event_source_timer_update(output->frame_throttle_timer,
+					     hold_msec);
 
 	if (output->dirty)
 		weston_output_update_matrix(output);
 
-	r = output->repaint(output, &output_damage);
-
-	pixman_region32_fini(&output_damage);
+	r = output->repaint(output, &output->damage);
 
 	output->repaint_needed = 0;
 
 	weston_compositor_repick(ec);
 
+	TL_POINT("core_repick", TLP_OUTPUT(output),
+		 TLP_COUNTER("repicks", ec->repicks),
+		 TLP_COUNTER("skipped", ec->repicks_skipped),
+		 TLP_END);
+
 	wl_list_for_each_safe(cb, cnext, &frame_callback_list, link) {
 		wl_callback_send_done(cb->resource, output->frame_time);
 		wl_resource_destroy(cb->resource);
@@ -2320,17 +2760,128 @@ weston_output_schedule_repaint_reset(struct weston_output *output)
 	TL_POINT("core_repaint_exit_loop", TLP_OUTPUT(output), TLP_END);
 }
 
+/* A mode refresh of zero means the rate is unknown, e.g. on outputs that
+ * present as fast as they can repaint. */
+static int64_t
+output_refresh_nsec(struct weston_output *output)
+{
+	if (output->current_mode->refresh == 0)
+		return 0;
+
+	return millihz_to_nsec(output->current_mode->refresh);
+}
+
+static void
+repaint_deadline_begin(struct weston_output *output)
+{
+	struct weston_repaint_deadline *d = &output->repaint_deadline;
+	int64_t refresh_nsec, now_nsec, target;
+
+	weston_compositor_read_presentation_clock(output->compositor,
+						  &d->start);
+	d->target_nsec = 0;
+	refresh_nsec = output_refresh_nsec(output);
+	if (!d->next_vblank_nsec || !refresh_nsec)
+		return;
+
+	/* The first vblank still ahead is the one to make */
+	now_nsec = timespec_to_nsec(&d->start);
+	target = d->next_vblank_nsec;
+	if (target <= now_nsec)
+		target += ((now_nsec - target) / refresh_nsec + 1) *
+			  refresh_nsec;
+	d->target_nsec = target;
+}
+
+static void
+repaint_deadline_end(struct weston_output *output)
+{
+	struct weston_repaint_deadline *d = &output->repaint_deadline;
+	struct timespec now, duration;
+
+	weston_compositor_read_presentation_clock(output->compositor, &now);
+	timespec_sub(&duration, &now, &d->start);
+	repaint_deadline_add_sample(d, timespec_to_nsec(&duration) / 1000);
+}
+
+/* Account the frame just presented and update the repaint window */
+static void
+repaint_deadline_finish(struct weston_output *output,
+			const struct timespec *stamp, int64_t refresh_nsec,
+			uint32_t presented_flags)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_repaint_deadline *d = &output->repaint_deadline;
+	int64_t stamp_nsec = timespec_to_nsec(stamp);
+
+	d->next_vblank_nsec = stamp_nsec + refresh_nsec;
+
+	if (!d->target_nsec)
+		return;
+
+	repaint_deadline_present(d, stamp_nsec, refresh_nsec,
+				 presented_flags &
+				 WP_PRESENTATION_FEEDBACK_KIND_VSYNC,
+				 compositor->repaint_adaptive,
+				 compositor->repaint_msec);
+
+	TL_POINT("core_repaint_deadline", TLP_OUTPUT(output),
+		 TLP_COUNTER("window_us", d->window_usec),
+		 TLP_COUNTER("repaint_us", d->last_usec),
+		 TLP_COUNTER("misses", d->misses),
+		 TLP_END);
+}
+
+static int
+repaint_window_msec(struct weston_output *output)
+{
+	struct weston_compositor *compositor = output->compositor;
+
+	return repaint_deadline_window_msec(&output->repaint_deadline,
+					    compositor->repaint_adaptive,
+					    compositor->repaint_msec);
+}
+
+/** Get the repaint scheduling statistics of an output
+ *
+ * \param output The output to query.
+ * \param stats Filled in with the current repaint window, the
+ * distribution of the recent repaint durations and the number of
+ * repaints that missed the vblank they aimed at.
+ */
+WL_EXPORT void
+weston_output_get_repaint_stats(struct weston_output *output,
+				struct weston_repaint_stats *stats)
+{
+	struct weston_repaint_deadline *d = &output->repaint_deadline;
+
+	stats->adaptive = output->compositor->repaint_adaptive;
+	stats->window_usec = d->window_usec;
+	stats->margin_usec = d->margin_usec;
+	stats->p50_usec = repaint_deadline_percentile(d, 50);
+	stats->p99_usec = repaint_deadline_percentile(d, 99);
+	stats->repaints = d->repaints;
+	stats->misses = d->misses;
+}
+
 static int
 output_repaint_timer_handler(void *data)
 {
 	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
+	int r;
 
 	if (output->repaint_needed &&
 	    compositor->state != WESTON_COMPOSITOR_SLEEPING &&
-	    compositor->state != WESTON_COMPOSITOR_OFFSCREEN &&
-	    weston_output_repaint(output) == 0)
-		return 0;
+	    compositor->state != WESTON_COMPOSITOR_OFFSCREEN) {
+		repaint_deadline_begin(output);
+		r = weston_output_repaint(output);
+		if (r == 0) {
+			repaint_deadline_end(output);
+			return 0;
+		}
+		output->repaint_deadline.target_nsec = 0;
+	}
 
 	weston_output_schedule_repaint_reset(output);
 
@@ -2351,7 +2902,7 @@ weston_output_finish_frame(struct weston_output *output,
 	TL_POINT("core_repaint_finished", TLP_OUTPUT(output),
 		 TLP_VBLANK(stamp), TLP_END);
 
-	refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+	refresh_nsec = output_refresh_nsec(output);
 	weston_presentation_feedback_present_list(&output->feedback_list,
 						  output, refresh_nsec, stamp,
 						  output->msc,
@@ -2359,10 +2910,12 @@ weston_output_finish_frame(struct weston_output *output,
 
 	output->frame_time = stamp->tv_sec * 1000 + stamp->tv_nsec / 1000000;
 
+	repaint_deadline_finish(output, stamp, refresh_nsec, presented_flags);
+
 	weston_compositor_read_presentation_clock(compositor, &now);
 	timespec_sub(&gone, &now, stamp);
 	msec = (refresh_nsec - timespec_to_nsec(&gone)) / 1000000; /* floor */
-	msec -= compositor->repaint_msec;
+	msec -= repaint_window_msec(output);
 
 	if (msec < -1000 || msec > 1000) {
 		static bool warned;
@@ -2376,7 +2929,7 @@ weston_output_finish_frame(struct weston_output *output,
 	}
 
 	/* Called from restart_repaint_loop and restart happens already after
-	 * the deadline given by repaint_msec? In that case we delay until
+	 * the deadline given by the repaint window? In that case we delay until
 	 * the deadline of the next frame, to give clients a more predictable
 	 * timing of the repaint cycle to lock on. */
 	if (presented_flags == WP_PRESENTATION_FEEDBACK_INVALID && msec < 0)
@@ -2400,13 +2953,23 @@ WL_EXPORT void
 weston_layer_entry_insert(struct weston_layer_entry *list,
 			  struct weston_layer_entry *entry)
 {
+	struct weston_view *view =
+		container_of(entry, struct weston_view, layer_link);
+
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+	weston_compositor_invalidate_view_list(view->surface->compositor);
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	struct weston_view *view =
+		container_of(entry, struct weston_view, layer_link);
+
+	if (entry->layer)
+		weston_compositor_invalidate_view_list(view->surface->compositor);
+
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
@@ -2609,16 +3172,37 @@ surface_set_input_region(struct wl_client *client,
 	}
 }
 
+static bool
+weston_surface_subsurface_order_changed(struct weston_surface *surface)
+{
+	struct wl_list *cur = surface->subsurface_list.next;
+	struct weston_subsurface *sub;
+
+	wl_list_for_each(sub, &surface->subsurface_list_pending,
+			 parent_link_pending) {
+		if (cur != &sub->parent_link)
+			return true;
+		cur = cur->next;
+	}
+
+	return cur != &surface->subsurface_list;
+}
+
 static void
 weston_surface_commit_subsurface_order(struct weston_surface *surface)
 {
 	struct weston_subsurface *sub;
 
+	if (!weston_surface_subsurface_order_changed(surface))
+		return;
+
 	wl_list_for_each_reverse(sub, &surface->subsurface_list_pending,
 				 parent_link_pending) {
 		wl_list_remove(&sub->parent_link);
 		wl_list_insert(&surface->subsurface_list, &sub->parent_link);
 	}
+
+	weston_compositor_invalidate_view_list(surface->compositor);
 }
 
 static void
@@ -2823,7 +3407,7 @@ weston_surface_commit_state(struct weston_surface *surface,
 			    struct weston_surface_state *state)
 {
 	struct weston_view *view;
-	pixman_region32_t opaque;
+	pixman_region32_t opaque, input;
 
 	/* wl_surface.set_buffer_transform */
 	/* wl_surface.set_buffer_scale */
@@ -2881,9 +3465,17 @@ weston_surface_commit_state(struct weston_surface *surface,
 	pixman_region32_fini(&opaque);
 
 	/* wl_surface.set_input_region */
-	pixman_region32_intersect_rect(&surface->input, &state->input,
+	pixman_region32_init(&input);
+	pixman_region32_intersect_rect(&input, &state->input,
 				       0, 0, surface->width, surface->height);
 
+	if (!pixman_region32_equal(&input, &surface->input)) {
+		pixman_region32_copy(&surface->input, &input);
+		surface->compositor->geometry_generation++;
+	}
+
+	pixman_region32_fini(&input);
+
 	/* wl_surface.frame */
 	wl_list_insert_list(&surface->frame_callback_list,
 			    &state->frame_callback_list);
@@ -3284,6 +3876,7 @@ subsurface_committed(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 	if (!weston_surface_is_mapped(surface)) {
 		surface->is_mapped = true;
+		weston_compositor_invalidate_view_list(surface->compositor);
 
 		/* Cannot call weston_view_update_transform(),
 		 * because that would call it also for the parent surface,
@@ -3628,6 +4221,7 @@ weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
+	weston_compositor_invalidate_view_list(sub->parent->compositor);
 	sub->parent = NULL;
 }
 
@@ -3691,6 +4285,7 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+	weston_compositor_invalidate_view_list(parent->compositor);
 }
 
 static void
@@ -3735,6 +4330,7 @@ weston_subsurface_destroy(struct weston_subsurface *sub)
 		assert(sub->parent_destroy_listener.notify == NULL);
 		wl_list_remove(&sub->parent_link);
 		wl_list_remove(&sub->parent_link_pending);
+		weston_compositor_invalidate_view_list(sub->surface->compositor);
 	}
 
 	wl_list_remove(&sub->surface_destroy_listener.link);
@@ -3799,6 +4395,7 @@ weston_subsurface_create_for_parent(struct weston_surface *parent)
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+	weston_compositor_invalidate_view_list(parent->compositor);
 
 	return sub;
 }
@@ -4157,6 +4754,7 @@ weston_output_destroy(struct weston_output *output)
 	}
 
 	wl_event_source_remove(output->repaint_timer);
+	wl_event_source_remove(output->frame_throttle_timer);
 
 	weston_presentation_feedback_discard_list(&output->feedback_list);
 
@@ -4169,6 +4767,8 @@ weston_output_destroy(struct weston_output *output)
 	free(output->name);
 	pixman_region32_fini(&output->region);
 	pixman_region32_fini(&output->previous_damage);
+	pixman_region32_fini(&output->damage);
+	pixman_region32_fini(&output->clip);
 	output->compositor->output_id_pool &= ~(1u << output->id);
 
 	wl_resource_for_each(resource, &output->resource_list) {
@@ -4267,6 +4867,7 @@ WL_EXPORT void
 weston_output_move(struct weston_output *output, int x, int y)
 {
 	struct wl_resource *resource;
+	struct weston_view *view;
 
 	output->move_x = x - output->x;
 	output->move_y = y - output->y;
@@ -4278,6 +4879,11 @@ weston_output_move(struct weston_output *output, int x, int y)
 
 	output->dirty = 1;
 
+	/* The views' output masks decide what gets repainted on which
+	 * output, refresh them. */
+	wl_list_for_each(view, &output->compositor->view_list, link)
+		weston_view_geometry_dirty(view);
+
 	/* Move views on this output. */
 	wl_signal_emit(&output->compositor->output_moved_signal, output);
 
@@ -4345,6 +4951,8 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 	weston_output_init_zoom(output);
 
 	weston_output_init_geometry(output, x, y);
+	pixman_region32_init(&output->damage);
+	pixman_region32_init(&output->clip);
 	weston_output_damage(output);
 
 	wl_signal_init(&output->frame_signal);
@@ -4354,9 +4962,13 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 	wl_list_init(&output->feedback_list);
 	wl_list_init(&output->link);
 
+	repaint_deadline_init(&output->repaint_deadline, c->repaint_msec);
+
 	loop = wl_display_get_event_loop(c->wl_display);
 	output->repaint_timer = wl_event_loop_add_timer(loop,
 					output_repaint_timer_handler, output);
+	output->frame_throttle_timer = wl_event_loop_add_timer(loop,
+					frame_throttle_timer_handler, output);
 
 	/* Invert the output id pool and look for the lowest numbered
 	 * switch (the least significant bit).  Take that bit's position
@@ -4699,6 +5311,28 @@ weston_environment_get_fd(const char *env)
 	return fd;
 }
 
+static void
+repaint_stats_binding(struct weston_keyboard *keyboard, uint32_t time,
+		      uint32_t key, void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_output *output;
+	struct weston_repaint_stats stats;
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		weston_output_get_repaint_stats(output, &stats);
+		weston_log("%s: %s repaint window %.1f ms (margin %.1f ms), "
+			   "repaint p50 %.1f ms p99 %.1f ms, "
+			   "%u of %u repaints missed\n",
+			   output->name,
+			   stats.adaptive ? "adaptive" : "fixed",
+			   stats.window_usec / 1000.0,
+			   stats.margin_usec / 1000.0,
+			   stats.p50_usec / 1000.0, stats.p99_usec / 1000.0,
+			   stats.misses, stats.repaints);
+	}
+}
+
 static void
 timeline_key_binding_handler(struct weston_keyboard *keyboard, uint32_t time,
 			     uint32_t key, void *data)
@@ -4752,6 +5386,9 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 
 	ec->output_id_pool = 0;
 	ec->repaint_msec = DEFAULT_REPAINT_WINDOW;
+	ec->repaint_adaptive = false;
+	ec->pixman_threads = 1;
+	ec->occluded_frame_rate = 1;
 
 	ec->activate_serial = 1;
 
@@ -4777,6 +5414,7 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 	wl_list_init(&ec->view_list);
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
+	ec->view_list_needs_rebuild = true;
 	wl_list_init(&ec->seat_list);
 	wl_list_init(&ec->output_list);
 	wl_list_init(&ec->key_binding_list);
@@ -4803,6 +5441,8 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 
 	weston_compositor_add_debug_binding(ec, KEY_T,
 					    timeline_key_binding_handler, ec);
+	weston_compositor_add_debug_binding(ec, KEY_D,
+					    repaint_stats_binding, ec);
 
 	return ec;
 
@@ -5036,6 +5676,8 @@ weston_compositor_destroy(struct weston_compositor *compositor)
 
 	weston_plugin_api_destroy_list(compositor);
 
+	pick_grid_release(compositor);
+
 	free(compositor);
 }
 
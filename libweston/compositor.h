@@ -147,6 +147,44 @@ enum dpms_enum {
 	WESTON_DPMS_OFF
 };
 
+#define WESTON_REPAINT_HISTORY 128
+#define WESTON_REPAINT_BUCKETS 256
+#define WESTON_REPAINT_BUCKET_USEC 100
+
+/** Measured repaint durations of an output and the repaint window
+ * derived from them. */
+struct weston_repaint_deadline {
+	/* Histogram bucket of each of the last WESTON_REPAINT_HISTORY
+	 * repaints, and the histogram of those */
+	uint8_t history[WESTON_REPAINT_HISTORY];
+	uint16_t histogram[WESTON_REPAINT_BUCKETS];
+	int nsamples;
+	int next;
+
+	int32_t window_usec;
+	int32_t margin_usec;	/* added to the measured duration */
+	int32_t last_usec;
+
+	struct timespec start;
+	int64_t next_vblank_nsec;
+	int64_t target_nsec;	/* vblank of the repaint in flight, or 0 */
+
+	uint32_t repaints;
+	uint32_t misses;	/* repaints presented after their target */
+};
+
+/** Repaint scheduling state of an output, as returned by
+ * weston_output_get_repaint_stats(). */
+struct weston_repaint_stats {
+	bool adaptive;
+	int32_t window_usec;
+	int32_t margin_usec;
+	int32_t p50_usec;	/* of the recent repaint durations */
+	int32_t p99_usec;
+	uint32_t repaints;
+	uint32_t misses;
+};
+
 struct weston_output {
 	uint32_t id;
 	char *name;
@@ -171,9 +209,19 @@ struct weston_output {
 	pixman_region32_t region;
 
 	pixman_region32_t previous_damage;
+
+	/** Damage and opaque clip of the planes above the primary plane,
+	 * accumulated from the views on this output by the last repaint.
+	 * In global coordinates, within region. */
+	pixman_region32_t damage;
+	pixman_region32_t clip;
+
 	int repaint_needed;
 	int repaint_scheduled;
 	struct wl_event_source *repaint_timer;
+	struct weston_repaint_deadline repaint_deadline;
+	/* Repaints the output when held back frame callbacks are due */
+	struct wl_event_source *frame_throttle_timer;
 	struct weston_output_zoom zoom;
 	int dirty;
 	struct wl_signal frame_signal;
@@ -641,11 +689,43 @@ struct weston_plane {
 	struct wl_list link;
 };
 
+/** Completion callback for weston_renderer::read_pixels_async
+ *
+ * \param data The user data passed to read_pixels_async.
+ * \param pixels The read back pixels, or NULL if the read back failed.
+ * \param stride The distance in bytes between two rows of \c pixels.
+ *
+ * The pixel data is only valid for the duration of the call.
+ */
+typedef void (*weston_read_pixels_done_func_t)(void *data,
+					       const void *pixels,
+					       int32_t stride);
+
 struct weston_renderer {
 	int (*read_pixels)(struct weston_output *output,
 			       pixman_format_code_t format, void *pixels,
 			       uint32_t x, uint32_t y,
 			       uint32_t width, uint32_t height);
+
+	/** Start an asynchronous read back of the current output contents
+	 *
+	 * Must be called from within the output's frame_signal.  The
+	 * copy is queued behind the rendering of the current frame and
+	 * \c done is invoked once the data has arrived, during the next
+	 * repaint of \c output or after about one refresh period if
+	 * there is none, so no further repaint is needed.  Returns -1 if the
+	 * read back could not be started, in which case \c done is not
+	 * called and the caller should fall back to read_pixels.
+	 *
+	 * Optional, may be NULL.
+	 */
+	int (*read_pixels_async)(struct weston_output *output,
+				 pixman_format_code_t format,
+				 uint32_t x, uint32_t y,
+				 uint32_t width, uint32_t height,
+				 weston_read_pixels_done_func_t done,
+				 void *data);
+
 	void (*repaint_output)(struct weston_output *output,
 			       pixman_region32_t *output_damage);
 	void (*flush_damage)(struct weston_surface *surface);
@@ -801,6 +881,29 @@ struct weston_compositor {
 	struct weston_plane primary_plane;
 	uint32_t capabilities; /* combination of enum weston_capability */
 
+	/* Set when layers, sub-surface stacking or mapping changed and
+	 * view_list must be rebuilt before the next repaint. */
+	bool view_list_needs_rebuild;
+	uint32_t view_list_rebuilds;
+	uint32_t view_list_rebuilds_skipped;
+
+	/* Uniform grid over the view bounding boxes, to avoid walking the
+	 * whole view list in weston_compositor_pick_view(). Each cell is
+	 * an array of struct weston_view pointers in view list order. */
+	struct {
+		struct wl_array *cells;
+		uint32_t serial;
+		bool valid;
+	} pick_grid;
+
+	/* Bumped whenever view positions, transformations, input regions
+	 * or stacking change. Repicking after a repaint is skipped if it
+	 * has not moved since the last repick. */
+	uint32_t geometry_generation;
+	uint32_t repick_generation;
+	uint32_t repicks;
+	uint32_t repicks_skipped;
+
 	struct weston_renderer *renderer;
 
 	pixman_format_code_t read_format;
@@ -827,6 +930,17 @@ struct weston_compositor {
 
 	clockid_t presentation_clock;
 	int32_t repaint_msec;
+	/* Derive the repaint window of each output from its measured
+	 * repaint durations, starting from repaint_msec. */
+	bool repaint_adaptive;
+
+	/* Threads the pixman renderer composites with, 1 to stay on the
+	 * main thread. Read when the renderer is initialized. */
+	int32_t pixman_threads;
+
+	/* Frame callbacks per second of surfaces hidden behind opaque
+	 * views, 0 to send them at the output rate like for any other. */
+	int32_t occluded_frame_rate;
 
 	unsigned int activate_serial;
 
@@ -1000,6 +1114,16 @@ struct weston_view {
 	uint32_t psf_flags;
 
 	bool is_mapped;
+
+	/* Membership in weston_compositor::pick_grid. The view is in the
+	 * grid only if serial matches the grid serial. The cell range is
+	 * x1, y1 inclusive to x2, y2 exclusive.
+	 */
+	struct {
+		uint32_t serial;
+		uint32_t index; /* position in the view list */
+		int32_t x1, y1, x2, y2;
+	} pick_grid;
 };
 
 struct weston_surface_state {
@@ -1084,6 +1208,14 @@ struct weston_surface {
 	 */
 	bool touched;
 
+	/* Outputs on which no view of the surface tree shows, as of their
+	 * last repaint. Outputs that have not repainted the surface yet
+	 * count as hiding it. */
+	uint32_t occluded_mask;
+	/* Output frame time of the last frame callbacks sent while
+	 * occluded */
+	uint32_t occluded_frame_time;
+
 	void *renderer_state;
 
 	struct wl_list views;
@@ -1301,6 +1433,8 @@ void
 weston_layer_entry_remove(struct weston_layer_entry *entry);
 void
 weston_layer_init(struct weston_layer *layer, struct wl_list *below);
+void
+weston_compositor_invalidate_view_list(struct weston_compositor *compositor);
 
 void
 weston_layer_set_mask(struct weston_layer *layer, int x, int y, int width, int height);
@@ -1330,6 +1464,9 @@ weston_output_finish_frame(struct weston_output *output,
 void
 weston_output_schedule_repaint(struct weston_output *output);
 void
+weston_output_get_repaint_stats(struct weston_output *output,
+				struct weston_repaint_stats *stats);
+void
 weston_output_damage(struct weston_output *output);
 void
 weston_compositor_schedule_repaint(struct weston_compositor *compositor);
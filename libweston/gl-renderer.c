@@ -31,16 +31,25 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <float.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <linux/input.h>
 #include <drm_fourcc.h>
 
 #include "gl-renderer.h"
 #include "vertex-clipping.h"
+#include "timeline.h"
 #include "linux-dmabuf.h"
 #include "linux-dmabuf-unstable-v1-server-protocol.h"
 
@@ -79,6 +88,7 @@ struct gl_border_image {
 
 struct gl_output_state {
 	EGLSurface egl_surface;
+	bool pbuffer;		/* keeps its contents, no buffer age needed */
 	pixman_region32_t buffer_damage[BUFFER_DAMAGE_COUNT];
 	int buffer_damage_index;
 	enum gl_border_status border_damage[BUFFER_DAMAGE_COUNT];
@@ -86,6 +96,20 @@ struct gl_output_state {
 	enum gl_border_status border_status;
 
 	struct weston_matrix output_matrix;
+
+	/* Pending asynchronous read back into a pixel pack buffer. The
+	 * buffer object is kept around and only grown, so periodic
+	 * captures do not reallocate. The timer completes the read back
+	 * when no repaint follows the captured frame. */
+	struct {
+		GLuint pbo;
+		GLsizeiptr size;
+		GLsizeiptr length;
+		int32_t stride;
+		weston_read_pixels_done_func_t done;
+		void *data;
+		struct wl_event_source *timer;
+	} readback;
 };
 
 enum buffer_type {
@@ -166,6 +190,26 @@ struct gl_surface_state {
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* A run of triangles in the frame's vertex buffer that can be drawn
+ * with a single call: same shader, textures, uniforms and blending. */
+struct gl_batch {
+	struct weston_view *view;
+	struct gl_shader *shader;
+	bool blend;
+	GLint filter;
+	GLint first;
+	GLsizei count;
+};
+
+/* Pixel unpack buffers used round-robin for wl_shm uploads, so that
+ * filling one does not wait for the GPU to finish reading another. */
+#define GL_RENDERER_UPLOAD_BUFFERS 4
+
+struct gl_upload_buffer {
+	GLuint pbo;
+	size_t size;
+};
+
 struct gl_renderer {
 	struct weston_renderer base;
 	int fragment_shader_debug;
@@ -181,6 +225,25 @@ struct gl_renderer {
 
 	struct wl_array vertices;
 	struct wl_array vtxcnt;
+	struct wl_array clip_scratch;	/* quads, boxes and clipped polygons */
+
+	/* Triangle list and batches of the output being repainted,
+	 * uploaded into vertex_buffer in one go. */
+	struct wl_array batch_vertices;
+	struct wl_array batches;	/* struct gl_batch */
+	GLuint vertex_buffer;
+
+	/* Opaque front-to-back pass, toggled with the debug binding */
+	int two_pass;
+	struct weston_binding *two_pass_binding;
+	struct wl_array pass_views;	/* struct gl_pass_view */
+
+	struct {
+		unsigned int draws;
+		unsigned int vertices;
+		uint64_t upload_bytes;
+		uint64_t fragments;
+	} stats;
 
 	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d;
 	PFNEGLCREATEIMAGEKHRPROC create_image;
@@ -190,6 +253,29 @@ struct gl_renderer {
 
 	int has_unpack_subimage;
 
+	int has_pack_buffer;
+	int has_unpack_buffer;
+	void *(GL_APIENTRYP map_buffer_range)(GLenum target, GLintptr offset,
+					      GLsizeiptr length,
+					      GLbitfield access);
+	GLboolean (GL_APIENTRYP unmap_buffer)(GLenum target);
+
+	struct gl_upload_buffer upload[GL_RENDERER_UPLOAD_BUFFERS];
+	int upload_next;
+
+	PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+	PFNGLPROGRAMBINARYOESPROC program_binary;
+	char *program_cache_dir;
+	uint64_t program_cache_id;
+
+	/* Programs built since program_stats_log() last ran */
+	struct {
+		int compiled;
+		int loaded;
+		double compile_ms;
+		double load_ms;
+	} program_stats;
+
 	PFNEGLBINDWAYLANDDISPLAYWL bind_display;
 	PFNEGLUNBINDWAYLANDDISPLAYWL unbind_display;
 	PFNEGLQUERYWAYLANDBUFFERWL query_buffer;
@@ -363,81 +449,6 @@ gl_renderer_print_egl_error_state(void)
 		egl_error_string(code), (long)code);
 }
 
-#define max(a, b) (((a) > (b)) ? (a) : (b))
-#define min(a, b) (((a) > (b)) ? (b) : (a))
-
-/*
- * Compute the boundary vertices of the intersection of the global coordinate
- * aligned rectangle 'rect', and an arbitrary quadrilateral produced from
- * 'surf_rect' when transformed from surface coordinates into global coordinates.
- * The vertices are written to 'ex' and 'ey', and the return value is the
- * number of vertices. Vertices are produced in clockwise winding order.
- * Guarantees to produce either zero vertices, or 3-8 vertices with non-zero
- * polygon area.
- */
-static int
-calculate_edges(struct weston_view *ev, pixman_box32_t *rect,
-		pixman_box32_t *surf_rect, GLfloat *ex, GLfloat *ey)
-{
-
-	struct clip_context ctx;
-	int i, n;
-	GLfloat min_x, max_x, min_y, max_y;
-	struct polygon8 surf = {
-		{ surf_rect->x1, surf_rect->x2, surf_rect->x2, surf_rect->x1 },
-		{ surf_rect->y1, surf_rect->y1, surf_rect->y2, surf_rect->y2 },
-		4
-	};
-
-	ctx.clip.x1 = rect->x1;
-	ctx.clip.y1 = rect->y1;
-	ctx.clip.x2 = rect->x2;
-	ctx.clip.y2 = rect->y2;
-
-	/* transform surface to screen space: */
-	for (i = 0; i < surf.n; i++)
-		weston_view_to_global_float(ev, surf.x[i], surf.y[i],
-					    &surf.x[i], &surf.y[i]);
-
-	/* find bounding box: */
-	min_x = max_x = surf.x[0];
-	min_y = max_y = surf.y[0];
-
-	for (i = 1; i < surf.n; i++) {
-		min_x = min(min_x, surf.x[i]);
-		max_x = max(max_x, surf.x[i]);
-		min_y = min(min_y, surf.y[i]);
-		max_y = max(max_y, surf.y[i]);
-	}
-
-	/* First, simple bounding box check to discard early transformed
-	 * surface rects that do not intersect with the clip region:
-	 */
-	if ((min_x >= ctx.clip.x2) || (max_x <= ctx.clip.x1) ||
-	    (min_y >= ctx.clip.y2) || (max_y <= ctx.clip.y1))
-		return 0;
-
-	/* Simple case, bounding box edges are parallel to surface edges,
-	 * there will be only four edges.  We just need to clip the surface
-	 * vertices to the clip rect bounds:
-	 */
-	if (!ev->transform.enabled)
-		return clip_simple(&ctx, &surf, ex, ey);
-
-	/* Transformed case: use a general polygon clipping algorithm to
-	 * clip the surface rectangle with each side of 'rect'.
-	 * The algorithm is Sutherland-Hodgman, as explained in
-	 * http://www.codeguru.com/cpp/misc/misc/graphics/article.php/c8965/Polygon-Clipping.htm
-	 * but without looking at any of that code.
-	 */
-	n = clip_transformed(&ctx, &surf, ex, ey);
-
-	if (n < 3)
-		return 0;
-
-	return n;
-}
-
 static bool
 merge_down(pixman_box32_t *a, pixman_box32_t *b, pixman_box32_t *merge)
 {
@@ -487,6 +498,85 @@ compress_bands(pixman_box32_t *inrects, int nrects,
 	return nout;
 }
 
+/*
+ * Clip the surface rectangles 'surf_rects', transformed into arbitrary
+ * quadrilaterals in global coordinates, against every global coordinate
+ * aligned rectangle in 'rects'. The vertices of the resulting polygons
+ * are stored in gr->clip_scratch and pointed to by 'ex' and 'ey', their
+ * counts by 'en', and the return value is the number of polygons. Each
+ * polygon is in clockwise winding order and has 3-8 vertices with
+ * non-zero area.
+ */
+static int
+clip_surface_rects(struct weston_view *ev,
+		   pixman_box32_t *rects, int nrects,
+		   pixman_box32_t *surf_rects, int nsurf,
+		   GLfloat **ex, GLfloat **ey, int **en)
+{
+	struct gl_renderer *gr = get_renderer(ev->surface->compositor);
+	struct clip_batch batch;
+	struct clip_quad *quads;
+	struct clip_box *boxes;
+	size_t npairs = (size_t) nrects * nsurf;
+	pixman_box32_t *r;
+	char *p;
+	int i, k;
+
+	gr->clip_scratch.size = 0;
+	p = wl_array_add(&gr->clip_scratch,
+			 nsurf * sizeof *quads + nrects * sizeof *boxes +
+			 npairs * (sizeof **en + 2 * 8 * sizeof **ex));
+	if (!p)
+		return 0;
+
+	quads = (struct clip_quad *) p;
+	p += nsurf * sizeof *quads;
+	boxes = (struct clip_box *) p;
+	p += nrects * sizeof *boxes;
+	*en = (int *) p;
+	p += npairs * sizeof **en;
+	*ex = (GLfloat *) p;
+	p += npairs * 8 * sizeof **ex;
+	*ey = (GLfloat *) p;
+
+	/* transform surface to screen space, once per surface rect: */
+	for (i = 0; i < nsurf; i++) {
+		r = &surf_rects[i];
+		quads[i].x[0] = r->x1; quads[i].y[0] = r->y1;
+		quads[i].x[1] = r->x2; quads[i].y[1] = r->y1;
+		quads[i].x[2] = r->x2; quads[i].y[2] = r->y2;
+		quads[i].x[3] = r->x1; quads[i].y[3] = r->y2;
+		for (k = 0; k < 4; k++)
+			weston_view_to_global_float(ev,
+						    quads[i].x[k], quads[i].y[k],
+						    &quads[i].x[k], &quads[i].y[k]);
+	}
+
+	for (i = 0; i < nrects; i++) {
+		boxes[i].x1 = rects[i].x1;
+		boxes[i].y1 = rects[i].y1;
+		boxes[i].x2 = rects[i].x2;
+		boxes[i].y2 = rects[i].y2;
+	}
+
+	/* Simple case, bounding box edges are parallel to surface edges,
+	 * there will be only four edges and the surface vertices only
+	 * need clamping to the clip rect bounds. Otherwise every pair is
+	 * clipped with Sutherland-Hodgman, as explained in
+	 * http://www.codeguru.com/cpp/misc/misc/graphics/article.php/c8965/Polygon-Clipping.htm
+	 */
+	batch.quads = quads;
+	batch.nquads = nsurf;
+	batch.boxes = boxes;
+	batch.nboxes = nrects;
+	batch.transformed = ev->transform.enabled;
+	batch.x = *ex;
+	batch.y = *ey;
+	batch.n = *en;
+
+	return clip_batch(&batch);
+}
+
 static int
 texture_region(struct weston_view *ev, pixman_region32_t *region,
 		pixman_region32_t *surf_region)
@@ -495,10 +585,11 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
 	GLfloat *v, inv_width, inv_height;
+	GLfloat *ex, *ey;		/* edge points in screen space */
 	unsigned int *vtxcnt, nvtx = 0;
 	pixman_box32_t *rects, *surf_rects;
 	pixman_box32_t *raw_rects;
-	int i, j, k, nrects, nsurf, raw_nrects;
+	int i, k, n, nrects, nsurf, raw_nrects, npolygons, *en;
 	bool used_band_compression;
 	raw_rects = pixman_region32_rectangles(region, &raw_nrects);
 	surf_rects = pixman_region32_rectangles(surf_region, &nsurf);
@@ -520,53 +611,50 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	inv_width = 1.0 / gs->pitch;
         inv_height = 1.0 / gs->height;
 
-	for (i = 0; i < nrects; i++) {
-		pixman_box32_t *rect = &rects[i];
-		for (j = 0; j < nsurf; j++) {
-			pixman_box32_t *surf_rect = &surf_rects[j];
-			GLfloat sx, sy, bx, by;
-			GLfloat ex[8], ey[8];          /* edge points in screen space */
-			int n;
-
-			/* The transformed surface, after clipping to the clip region,
-			 * can have as many as eight sides, emitted as a triangle-fan.
-			 * The first vertex in the triangle fan can be chosen arbitrarily,
-			 * since the area is guaranteed to be convex.
-			 *
-			 * If a corner of the transformed surface falls outside of the
-			 * clip region, instead of emitting one vertex for the corner
-			 * of the surface, up to two are emitted for two corresponding
-			 * intersection point(s) between the surface and the clip region.
-			 *
-			 * To do this, we first calculate the (up to eight) points that
-			 * form the intersection of the clip rect and the transformed
-			 * surface.
-			 */
-			n = calculate_edges(ev, rect, surf_rect, ex, ey);
-			if (n < 3)
-				continue;
-
-			/* emit edge points: */
-			for (k = 0; k < n; k++) {
-				weston_view_from_global_float(ev, ex[k], ey[k],
-							      &sx, &sy);
-				/* position: */
-				*(v++) = ex[k];
-				*(v++) = ey[k];
-				/* texcoord: */
-				weston_surface_to_buffer_float(ev->surface,
-							       sx, sy,
-							       &bx, &by);
-				*(v++) = bx * inv_width;
-				if (gs->y_inverted) {
-					*(v++) = by * inv_height;
-				} else {
-					*(v++) = (gs->height - by) * inv_height;
-				}
+	/* The transformed surface, after clipping to the clip region,
+	 * can have as many as eight sides, emitted as a triangle-fan.
+	 * The first vertex in the triangle fan can be chosen arbitrarily,
+	 * since the area is guaranteed to be convex.
+	 *
+	 * If a corner of the transformed surface falls outside of the
+	 * clip region, instead of emitting one vertex for the corner
+	 * of the surface, up to two are emitted for two corresponding
+	 * intersection point(s) between the surface and the clip region.
+	 *
+	 * To do this, we first calculate the (up to eight) points that
+	 * form the intersection of each clip rect and transformed surface
+	 * rect, all pairs in one go.
+	 */
+	npolygons = clip_surface_rects(ev, rects, nrects, surf_rects, nsurf,
+				       &ex, &ey, &en);
+
+	for (i = 0; i < npolygons; i++) {
+		GLfloat sx, sy, bx, by;
+
+		n = en[i];
+
+		/* emit edge points: */
+		for (k = 0; k < n; k++) {
+			weston_view_from_global_float(ev, ex[k], ey[k],
+						      &sx, &sy);
+			/* position: */
+			*(v++) = ex[k];
+			*(v++) = ey[k];
+			/* texcoord: */
+			weston_surface_to_buffer_float(ev->surface,
+						       sx, sy,
+						       &bx, &by);
+			*(v++) = bx * inv_width;
+			if (gs->y_inverted) {
+				*(v++) = by * inv_height;
+			} else {
+				*(v++) = (gs->height - by) * inv_height;
 			}
-
-			vtxcnt[nvtx++] = n;
 		}
+
+		ex += n;
+		ey += n;
+		vtxcnt[nvtx++] = n;
 	}
 
 	if (used_band_compression)
@@ -614,6 +702,27 @@ triangle_fan_debug(struct weston_view *view, int first, int count)
 	free(buffer);
 }
 
+/* Area in pixels of the triangle fans built by texture_region(), as an
+ * estimate of the fragments they generate. */
+static uint64_t
+fans_area(const GLfloat *v, const unsigned int *vtxcnt, int nfans)
+{
+	double area, total = 0.0;
+	int i, k, n;
+
+	for (i = 0; i < nfans; i++) {
+		n = vtxcnt[i];
+		area = 0.0;
+		for (k = 0; k < n; k++)
+			area += v[k * 4] * v[((k + 1) % n) * 4 + 1] -
+				v[((k + 1) % n) * 4] * v[k * 4 + 1];
+		total += (area < 0.0 ? -area : area) / 2.0;
+		v += n * 4;
+	}
+
+	return total + 0.5;
+}
+
 static void
 repaint_region(struct weston_view *ev, pixman_region32_t *region,
 		pixman_region32_t *surf_region)
@@ -652,6 +761,10 @@ repaint_region(struct weston_view *ev, pixman_region32_t *region,
 		first += vtxcnt[i];
 	}
 
+	gr->stats.draws += nfans;
+	gr->stats.vertices += first;
+	gr->stats.fragments += fans_area(v, vtxcnt, nfans);
+
 	glDisableVertexAttribArray(1);
 	glDisableVertexAttribArray(0);
 
@@ -725,117 +838,483 @@ shader_uniforms(struct gl_shader *shader,
 }
 
 static void
-draw_view(struct weston_view *ev, struct weston_output *output,
-	  pixman_region32_t *damage) /* in global coordinates */
+bind_textures(struct gl_surface_state *gs, GLint filter)
 {
-	struct weston_compositor *ec = ev->surface->compositor;
-	struct gl_renderer *gr = get_renderer(ec);
-	struct gl_surface_state *gs = get_surface_state(ev->surface);
-	/* repaint bounding region in global coordinates: */
-	pixman_region32_t repaint;
-	/* opaque region in surface coordinates: */
-	pixman_region32_t surface_opaque;
-	/* non-opaque region in surface coordinates: */
-	pixman_region32_t surface_blend;
-	GLint filter;
 	int i;
 
-	/* In case of a runtime switch of renderers, we may not have received
-	 * an attach for this surface since the switch. In that case we don't
-	 * have a valid buffer or a proper shader set up so skip rendering. */
-	if (!gs->shader)
+	for (i = 0; i < gs->num_textures; i++) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(gs->target, gs->textures[i]);
+		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
+		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
+	}
+}
+
+static bool
+batch_compatible(const struct gl_batch *batch, struct weston_view *ev,
+		 struct gl_shader *shader, bool blend, GLint filter)
+{
+	struct gl_surface_state *prev, *gs;
+	int i;
+
+	if (batch->shader != shader || batch->blend != blend ||
+	    batch->filter != filter)
+		return false;
+
+	if (batch->view == ev)
+		return true;
+
+	if (batch->view->alpha != ev->alpha)
+		return false;
+
+	prev = get_surface_state(batch->view->surface);
+	gs = get_surface_state(ev->surface);
+	if (prev == gs)
+		return true;
+
+	if (prev->num_textures != gs->num_textures ||
+	    prev->target != gs->target ||
+	    memcmp(prev->color, gs->color, sizeof gs->color) != 0)
+		return false;
+
+	for (i = 0; i < gs->num_textures; i++)
+		if (prev->textures[i] != gs->textures[i])
+			return false;
+
+	return true;
+}
+
+/* Like repaint_region(), but instead of drawing the triangle fans right
+ * away, append them as a triangle list to the frame's vertex buffer.
+ * Consecutive regions that need the same GL state end up in one batch,
+ * drawn by batch_flush() with a single glDrawArrays(). */
+static void
+batch_region(struct weston_view *ev, pixman_region32_t *region,
+	     pixman_region32_t *surf_region, struct gl_shader *shader,
+	     bool blend, GLint filter)
+{
+	struct gl_renderer *gr = get_renderer(ev->surface->compositor);
+	const size_t stride = 4 * sizeof(GLfloat);
+	struct gl_batch *batch = NULL;
+	unsigned int *vtxcnt;
+	GLfloat *v, *dst;
+	GLsizei count = 0;
+	GLint first;
+	int i, k, nfans;
+
+	nfans = texture_region(ev, region, surf_region);
+
+	v = gr->vertices.data;
+	vtxcnt = gr->vtxcnt.data;
+	for (i = 0; i < nfans; i++)
+		count += (vtxcnt[i] - 2) * 3;
+
+	gr->stats.fragments += fans_area(v, vtxcnt, nfans);
+
+	first = gr->batch_vertices.size / stride;
+	dst = count ? wl_array_add(&gr->batch_vertices, count * stride) : NULL;
+
+	for (i = 0; dst && i < nfans; i++) {
+		for (k = 1; k < (int) vtxcnt[i] - 1; k++) {
+			memcpy(dst, &v[0], stride);
+			memcpy(dst + 4, &v[k * 4], 2 * stride);
+			dst += 12;
+		}
+		v += vtxcnt[i] * 4;
+	}
+
+	gr->vertices.size = 0;
+	gr->vtxcnt.size = 0;
+
+	if (!dst)
 		return;
 
-	pixman_region32_init(&repaint);
-	pixman_region32_intersect(&repaint,
-				  &ev->transform.boundingbox, damage);
-	pixman_region32_subtract(&repaint, &repaint, &ev->clip);
+	if (gr->batches.size > 0)
+		batch = (struct gl_batch *) ((char *) gr->batches.data +
+					     gr->batches.size) - 1;
 
-	if (!pixman_region32_not_empty(&repaint))
-		goto out;
+	if (batch && batch->first + batch->count == first &&
+	    batch_compatible(batch, ev, shader, blend, filter)) {
+		batch->count += count;
+		return;
+	}
+
+	batch = wl_array_add(&gr->batches, sizeof *batch);
+	if (!batch)
+		return;
+
+	batch->view = ev;
+	batch->shader = shader;
+	batch->blend = blend;
+	batch->filter = filter;
+	batch->first = first;
+	batch->count = count;
+}
+
+static void
+batch_flush(struct weston_output *output)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_batch *batch;
+
+	if (gr->batches.size == 0)
+		return;
+
+	if (!gr->vertex_buffer)
+		glGenBuffers(1, &gr->vertex_buffer);
+
+	glBindBuffer(GL_ARRAY_BUFFER, gr->vertex_buffer);
+	glBufferData(GL_ARRAY_BUFFER, gr->batch_vertices.size,
+		     gr->batch_vertices.data, GL_STREAM_DRAW);
+
+	/* position: */
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE,
+			      4 * sizeof(GLfloat), (void *) 0);
+	glEnableVertexAttribArray(0);
+
+	/* texcoord: */
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE,
+			      4 * sizeof(GLfloat),
+			      (void *) (2 * sizeof(GLfloat)));
+	glEnableVertexAttribArray(1);
 
 	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 
-	if (gr->fan_debug) {
-		use_shader(gr, &gr->solid_shader);
-		shader_uniforms(&gr->solid_shader, ev, output);
-	}
+	wl_array_for_each(batch, &gr->batches) {
+		use_shader(gr, batch->shader);
+		shader_uniforms(batch->shader, batch->view, output);
+		bind_textures(get_surface_state(batch->view->surface),
+			      batch->filter);
 
-	use_shader(gr, gs->shader);
-	shader_uniforms(gs->shader, ev, output);
+		if (batch->blend)
+			glEnable(GL_BLEND);
+		else
+			glDisable(GL_BLEND);
 
-	if (ev->transform.enabled || output->zoom.active ||
-	    output->current_scale != ev->surface->buffer_viewport.buffer.scale)
-		filter = GL_LINEAR;
-	else
-		filter = GL_NEAREST;
+		glDrawArrays(GL_TRIANGLES, batch->first, batch->count);
 
-	for (i = 0; i < gs->num_textures; i++) {
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
-		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
+		gr->stats.draws++;
+		gr->stats.vertices += batch->count;
 	}
 
-	/* blended region is whole surface minus opaque region: */
-	pixman_region32_init_rect(&surface_blend, 0, 0,
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	gr->batch_vertices.size = 0;
+	gr->batches.size = 0;
+}
+
+/* Which parts of a view draw_view_region() draws: everything in the
+ * usual order, or only what goes into the opaque or the translucent
+ * pass of the two-pass mode. */
+enum draw_pass {
+	DRAW_ALL,
+	DRAW_OPAQUE,
+	DRAW_BLEND,
+};
+
+/* Whether the shader produces alpha 1.0 everywhere, independent of the
+ * contents of the buffer. */
+static bool
+shader_is_opaque(struct gl_renderer *gr, struct gl_surface_state *gs)
+{
+	if (gs->shader == &gr->solid_shader)
+		return gs->color[3] == 1.0f;
+
+	return gs->shader == &gr->texture_shader_rgbx ||
+	       gs->shader == &gr->texture_shader_y_uv ||
+	       gs->shader == &gr->texture_shader_y_u_v ||
+	       gs->shader == &gr->texture_shader_y_xuxv;
+}
+
+/* Split a view's surface into the parts to draw without and with
+ * blending, in surface coordinates. Surfaces whose buffer has no alpha
+ * channel are opaque as a whole, even without an opaque region. */
+static void
+view_surface_regions(struct weston_view *ev,
+		     pixman_region32_t *surface_opaque,
+		     pixman_region32_t *surface_blend)
+{
+	struct gl_renderer *gr = get_renderer(ev->surface->compositor);
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+
+	pixman_region32_init_rect(surface_blend, 0, 0,
 				  ev->surface->width, ev->surface->height);
 	if (ev->geometry.scissor_enabled)
-		pixman_region32_intersect(&surface_blend, &surface_blend,
+		pixman_region32_intersect(surface_blend, surface_blend,
 					  &ev->geometry.scissor);
-	pixman_region32_subtract(&surface_blend, &surface_blend,
-				 &ev->surface->opaque);
+
+	pixman_region32_init(surface_opaque);
+	if (shader_is_opaque(gr, gs)) {
+		pixman_region32_copy(surface_opaque, surface_blend);
+		pixman_region32_clear(surface_blend);
+		return;
+	}
 
 	/* XXX: Should we be using ev->transform.opaque here? */
-	pixman_region32_init(&surface_opaque);
 	if (ev->geometry.scissor_enabled)
-		pixman_region32_intersect(&surface_opaque,
+		pixman_region32_intersect(surface_opaque,
 					  &ev->surface->opaque,
 					  &ev->geometry.scissor);
 	else
-		pixman_region32_copy(&surface_opaque, &ev->surface->opaque);
-
-	if (pixman_region32_not_empty(&surface_opaque)) {
-		if (gs->shader == &gr->texture_shader_rgba) {
-			/* Special case for RGBA textures with possibly
-			 * bad data in alpha channel: use the shader
-			 * that forces texture alpha = 1.0.
-			 * Xwayland surfaces need this.
-			 */
-			use_shader(gr, &gr->texture_shader_rgbx);
-			shader_uniforms(&gr->texture_shader_rgbx, ev, output);
-		}
+		pixman_region32_copy(surface_opaque, &ev->surface->opaque);
+
+	/* blended region is whole surface minus opaque region: */
+	pixman_region32_subtract(surface_blend, surface_blend,
+				 surface_opaque);
+}
+
+static void
+draw_view_region(struct weston_view *ev, struct weston_output *output,
+		 pixman_region32_t *repaint, /* in global coordinates */
+		 enum draw_pass pass)
+{
+	struct weston_compositor *ec = ev->surface->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	/* opaque region in surface coordinates: */
+	pixman_region32_t surface_opaque;
+	/* non-opaque region in surface coordinates: */
+	pixman_region32_t surface_blend;
+	struct gl_shader *opaque_shader;
+	bool draw_opaque, draw_blend;
+	GLint filter;
+
+	if (ev->transform.enabled || output->zoom.active ||
+	    output->current_scale != ev->surface->buffer_viewport.buffer.scale)
+		filter = GL_LINEAR;
+	else
+		filter = GL_NEAREST;
+
+	/* Special case for RGBA textures with possibly bad data in alpha
+	 * channel: use the shader that forces texture alpha = 1.0 for the
+	 * opaque region. Xwayland surfaces need this.
+	 */
+	if (gs->shader == &gr->texture_shader_rgba)
+		opaque_shader = &gr->texture_shader_rgbx;
+	else
+		opaque_shader = gs->shader;
+
+	view_surface_regions(ev, &surface_opaque, &surface_blend);
+
+	/* With alpha < 1.0 even the opaque region is translucent, and has
+	 * to be drawn in back-to-front order. */
+	switch (pass) {
+	case DRAW_OPAQUE:
+		draw_opaque = ev->alpha == 1.0;
+		draw_blend = false;
+		break;
+	case DRAW_BLEND:
+		draw_opaque = ev->alpha < 1.0;
+		draw_blend = true;
+		break;
+	default:
+		draw_opaque = true;
+		draw_blend = true;
+		break;
+	}
+
+	if (!pixman_region32_not_empty(&surface_opaque))
+		draw_opaque = false;
+	if (!pixman_region32_not_empty(&surface_blend))
+		draw_blend = false;
+
+	/* The triangle fan debug lines need the fans, so draw them one
+	 * by one instead of batching. */
+	if (!gr->fan_debug) {
+		if (draw_opaque)
+			batch_region(ev, repaint, &surface_opaque,
+				     opaque_shader, ev->alpha < 1.0, filter);
+
+		if (draw_blend)
+			batch_region(ev, repaint, &surface_blend,
+				     gs->shader, true, filter);
+
+		goto out;
+	}
+
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	use_shader(gr, &gr->solid_shader);
+	shader_uniforms(&gr->solid_shader, ev, output);
+
+	bind_textures(gs, filter);
+
+	if (draw_opaque) {
+		use_shader(gr, opaque_shader);
+		shader_uniforms(opaque_shader, ev, output);
 
 		if (ev->alpha < 1.0)
 			glEnable(GL_BLEND);
 		else
 			glDisable(GL_BLEND);
 
-		repaint_region(ev, &repaint, &surface_opaque);
+		repaint_region(ev, repaint, &surface_opaque);
 	}
 
-	if (pixman_region32_not_empty(&surface_blend)) {
+	if (draw_blend) {
 		use_shader(gr, gs->shader);
+		shader_uniforms(gs->shader, ev, output);
 		glEnable(GL_BLEND);
-		repaint_region(ev, &repaint, &surface_blend);
+		repaint_region(ev, repaint, &surface_blend);
 	}
 
+out:
 	pixman_region32_fini(&surface_blend);
 	pixman_region32_fini(&surface_opaque);
+}
+
+/* Compute the part of the view that needs repainting, in global
+ * coordinates. Returns false if there is none. */
+static bool
+view_repaint_region(struct weston_view *ev, pixman_region32_t *damage,
+		    pixman_region32_t *repaint)
+{
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+
+	pixman_region32_init(repaint);
+
+	/* In case of a runtime switch of renderers, we may not have received
+	 * an attach for this surface since the switch. In that case we don't
+	 * have a valid buffer or a proper shader set up so skip rendering. */
+	if (!gs->shader)
+		return false;
+
+	pixman_region32_intersect(repaint,
+				  &ev->transform.boundingbox, damage);
+	pixman_region32_subtract(repaint, repaint, &ev->clip);
+
+	return pixman_region32_not_empty(repaint);
+}
+
+static void
+draw_view(struct weston_view *ev, struct weston_output *output,
+	  pixman_region32_t *damage) /* in global coordinates */
+{
+	/* repaint bounding region in global coordinates: */
+	pixman_region32_t repaint;
+
+	if (view_repaint_region(ev, damage, &repaint))
+		draw_view_region(ev, output, &repaint, DRAW_ALL);
 
-out:
 	pixman_region32_fini(&repaint);
 }
 
+struct gl_pass_view {
+	struct weston_view *view;
+	pixman_region32_t repaint;
+};
+
+/* Add what the view covers opaquely to the occluded region, in global
+ * coordinates. This catches what weston_view::clip does not know
+ * about: surfaces that are opaque because of their buffer format. Only
+ * untransformed views are considered, to keep this exact. */
+static void
+view_add_occluder(struct weston_view *ev, pixman_region32_t *occluded)
+{
+	pixman_region32_t surface_opaque, surface_blend;
+
+	if (ev->alpha < 1.0 || ev->transform.enabled)
+		return;
+
+	view_surface_regions(ev, &surface_opaque, &surface_blend);
+	pixman_region32_translate(&surface_opaque,
+				  ev->geometry.x, ev->geometry.y);
+	pixman_region32_intersect(&surface_opaque, &surface_opaque,
+				  &ev->transform.boundingbox);
+	pixman_region32_union(occluded, occluded, &surface_opaque);
+
+	pixman_region32_fini(&surface_blend);
+	pixman_region32_fini(&surface_opaque);
+}
+
+/* Draw the opaque parts of all views front-to-back with blending
+ * disabled, each culled against what is opaque above it, then the
+ * translucent parts back-to-front. No fragment is drawn opaquely twice,
+ * and blending only happens where something translucent is visible. */
+static void
+repaint_views_two_pass(struct weston_output *output,
+		       pixman_region32_t *damage)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
+	struct gl_surface_state *gs;
+	struct gl_pass_view *pv;
+	struct weston_view *view;
+	pixman_region32_t occluded;
+	int i;
+
+	pixman_region32_init(&occluded);
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		if (view->plane != &compositor->primary_plane)
+			continue;
+
+		gs = get_surface_state(view->surface);
+		if (!gs->shader)
+			continue;
+
+		pv = wl_array_add(&gr->pass_views, sizeof *pv);
+		if (!pv)
+			break;
+
+		pv->view = view;
+		if (view_repaint_region(view, damage, &pv->repaint)) {
+			pixman_region32_subtract(&pv->repaint, &pv->repaint,
+						 &occluded);
+			if (pixman_region32_not_empty(&pv->repaint))
+				draw_view_region(view, output, &pv->repaint,
+						 DRAW_OPAQUE);
+		}
+
+		view_add_occluder(view, &occluded);
+	}
+
+	pixman_region32_fini(&occluded);
+
+	pv = gr->pass_views.data;
+	for (i = (int) (gr->pass_views.size / sizeof *pv) - 1; i >= 0; i--) {
+		if (pixman_region32_not_empty(&pv[i].repaint))
+			draw_view_region(pv[i].view, output, &pv[i].repaint,
+					 DRAW_BLEND);
+		pixman_region32_fini(&pv[i].repaint);
+	}
+
+	gr->pass_views.size = 0;
+}
+
+static uint64_t
+region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *rects;
+	uint64_t area = 0;
+	int i, n;
+
+	rects = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++)
+		area += (uint64_t) (rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	return area;
+}
+
 static void
 repaint_views(struct weston_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
 	struct weston_view *view;
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link)
-		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+	if (gr->two_pass && !gr->fan_debug) {
+		repaint_views_two_pass(output, damage);
+	} else {
+		wl_list_for_each_reverse(view, &compositor->view_list, link)
+			if (view->plane == &compositor->primary_plane)
+				draw_view(view, output, damage);
+	}
+
+	batch_flush(output);
 }
 
 static void
@@ -1018,7 +1497,9 @@ output_get_damage(struct weston_output *output,
 	EGLBoolean ret;
 	int i;
 
-	if (gr->has_egl_buffer_age) {
+	if (go->pbuffer) {
+		buffer_age = 1;
+	} else if (gr->has_egl_buffer_age) {
 		ret = eglQuerySurface(gr->egl_display, go->egl_surface,
 				      EGL_BUFFER_AGE_EXT, &buffer_age);
 		if (ret == EGL_FALSE) {
@@ -1066,6 +1547,67 @@ output_rotate_damage(struct weston_output *output,
 	go->border_damage[go->buffer_damage_index] = border_status;
 }
 
+static GLenum
+gl_read_format(pixman_format_code_t format)
+{
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+		return GL_BGRA_EXT;
+	case PIXMAN_a8b8g8r8:
+		return GL_RGBA;
+	default:
+		return GL_NONE;
+	}
+}
+
+/* Hand a pending read back to its owner.  By the time the next frame
+ * starts the copy has long been executed by the GPU, so mapping the
+ * buffer does not stall the pipeline. Assumes the output's context is
+ * current. */
+static void
+finish_readback(struct weston_output *output)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+	weston_read_pixels_done_func_t done = go->readback.done;
+	void *pixels;
+
+	if (!done)
+		return;
+
+	go->readback.done = NULL;
+	wl_event_source_timer_update(go->readback.timer, 0);
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, go->readback.pbo);
+	pixels = gr->map_buffer_range(GL_PIXEL_PACK_BUFFER, 0,
+				      go->readback.length, GL_MAP_READ_BIT);
+	if (pixels == NULL)
+		weston_log("failed to map pixel pack buffer\n");
+
+	done(go->readback.data, pixels, go->readback.stride);
+
+	if (pixels)
+		gr->unmap_buffer(GL_PIXEL_PACK_BUFFER);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+/* Programs are built when first used, so this sums up those a repaint
+ * needed: all of the first frame's after startup or after the fragment
+ * debug binding, or one for a newly seen buffer type. */
+static void
+program_stats_log(struct gl_renderer *gr)
+{
+	if (gr->program_stats.compiled == 0 && gr->program_stats.loaded == 0)
+		return;
+
+	weston_log("GL programs: %d compiled in %.2f ms, "
+		   "%d loaded from cache in %.2f ms\n",
+		   gr->program_stats.compiled, gr->program_stats.compile_ms,
+		   gr->program_stats.loaded, gr->program_stats.load_ms);
+
+	memset(&gr->program_stats, 0, sizeof gr->program_stats);
+}
+
 /* NOTE: We now allow falling back to ARGB gl visuals when XRGB is
  * unavailable, so we're assuming the background has no transparency
  * and that everything with a blend, like drop shadows, will have something
@@ -1092,6 +1634,12 @@ gl_renderer_repaint_output(struct weston_output *output,
 	if (use_output(output) < 0)
 		return;
 
+	finish_readback(output);
+
+	gr->stats.draws = 0;
+	gr->stats.vertices = 0;
+	gr->stats.fragments = 0;
+
 	/* Calculate the viewport */
 	glViewport(go->borders[GL_RENDERER_BORDER_LEFT].width,
 		   go->borders[GL_RENDERER_BORDER_BOTTOM].height,
@@ -1132,6 +1680,16 @@ gl_renderer_repaint_output(struct weston_output *output,
 
 	repaint_views(output, &total_damage);
 
+	/* fragments / damage_pixels is the overdraw factor */
+	TL_POINT("renderer_gl_draw", TLP_OUTPUT(output),
+		 TLP_COUNTER("draws", gr->stats.draws),
+		 TLP_COUNTER("vertices", gr->stats.vertices),
+		 TLP_COUNTER("upload_bytes", gr->stats.upload_bytes),
+		 TLP_COUNTER("fragments", gr->stats.fragments),
+		 TLP_COUNTER("damage_pixels", region_area(&total_damage)),
+		 TLP_END);
+	gr->stats.upload_bytes = 0;
+
 	pixman_region32_fini(&total_damage);
 	pixman_region32_fini(&buffer_damage);
 
@@ -1184,40 +1742,309 @@ gl_renderer_repaint_output(struct weston_output *output,
 		gl_renderer_print_egl_error_state();
 	}
 
-	go->border_status = BORDER_STATUS_CLEAN;
+	go->border_status = BORDER_STATUS_CLEAN;
+
+	program_stats_log(gr);
+}
+
+static int
+gl_renderer_read_pixels(struct weston_output *output,
+			       pixman_format_code_t format, void *pixels,
+			       uint32_t x, uint32_t y,
+			       uint32_t width, uint32_t height)
+{
+	GLenum gl_format;
+	struct gl_output_state *go = get_output_state(output);
+
+	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
+	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+
+	gl_format = gl_read_format(format);
+	if (gl_format == GL_NONE)
+		return -1;
+
+	if (use_output(output) < 0)
+		return -1;
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x, y, width, height, gl_format,
+		     GL_UNSIGNED_BYTE, pixels);
+
+	return 0;
+}
+
+static int
+readback_timer_handler(void *data)
+{
+	struct weston_output *output = data;
+
+	if (use_output(output) == 0)
+		finish_readback(output);
+
+	return 0;
+}
+
+static int
+gl_renderer_read_pixels_async(struct weston_output *output,
+			      pixman_format_code_t format,
+			      uint32_t x, uint32_t y,
+			      uint32_t width, uint32_t height,
+			      weston_read_pixels_done_func_t done,
+			      void *data)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+	struct wl_event_loop *loop;
+	GLenum gl_format;
+	GLsizeiptr length;
+	int timeout;
+
+	gl_format = gl_read_format(format);
+	if (!gr->has_pack_buffer || gl_format == GL_NONE)
+		return -1;
+
+	/* Only one read back per output can be in flight. */
+	if (go->readback.done)
+		return -1;
+
+	if (use_output(output) < 0)
+		return -1;
+
+	if (!go->readback.timer) {
+		loop = wl_display_get_event_loop(output->compositor->wl_display);
+		go->readback.timer =
+			wl_event_loop_add_timer(loop, readback_timer_handler,
+						output);
+		if (!go->readback.timer)
+			return -1;
+	}
+
+	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
+	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+	length = (GLsizeiptr) width * height * 4;
+
+	if (go->readback.pbo == 0)
+		glGenBuffers(1, &go->readback.pbo);
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, go->readback.pbo);
+	if (length > go->readback.size) {
+		glBufferData(GL_PIXEL_PACK_BUFFER, length,
+			     NULL, GL_STREAM_READ);
+		go->readback.size = length;
+	}
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x, y, width, height, gl_format, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	go->readback.length = length;
+	go->readback.stride = width * 4;
+	go->readback.done = done;
+	go->readback.data = data;
+
+	/* This runs inside the repaint, so scheduling another one here
+	 * would be dropped when the repaint finishes. An idle output may
+	 * not repaint again, so collect the result after one refresh
+	 * period at the latest, by which the copy has completed. */
+	timeout = 16;
+	if (output->current_mode && output->current_mode->refresh > 0)
+		timeout = 1000000 / output->current_mode->refresh;
+	wl_event_source_timer_update(go->readback.timer, MAX(timeout, 1));
+
+	return 0;
+}
+
+/* Merge damage rectangles, already in buffer coordinates, whenever
+ * uploading their bounding box instead costs at most a quarter more
+ * pixels, or a small fixed amount for tiny rectangles. Returns the new
+ * number of rectangles. */
+static int
+coalesce_rects(pixman_box32_t *rects, int n)
+{
+	pixman_box32_t box;
+	int64_t covered, area, merged;
+	int i, out = 0;
+
+	if (n == 0)
+		return 0;
+
+	box = rects[0];
+	covered = (int64_t) (box.x2 - box.x1) * (box.y2 - box.y1);
+
+	for (i = 1; i < n; i++) {
+		pixman_box32_t *r = &rects[i];
+		pixman_box32_t u;
+
+		u.x1 = MIN(box.x1, r->x1);
+		u.y1 = MIN(box.y1, r->y1);
+		u.x2 = MAX(box.x2, r->x2);
+		u.y2 = MAX(box.y2, r->y2);
+
+		area = (int64_t) (r->x2 - r->x1) * (r->y2 - r->y1);
+		merged = (int64_t) (u.x2 - u.x1) * (u.y2 - u.y1);
+
+		if (merged <= (covered + area) * 5 / 4 ||
+		    merged - covered - area <= 4096) {
+			box = u;
+			covered += area;
+		} else {
+			rects[out++] = box;
+			box = *r;
+			covered = area;
+		}
+	}
+	rects[out++] = box;
+
+	return out;
+}
+
+static void *
+map_upload_buffer(struct gl_renderer *gr, size_t size)
+{
+	struct gl_upload_buffer *ub = &gr->upload[gr->upload_next];
+	void *ptr;
+
+	gr->upload_next = (gr->upload_next + 1) % GL_RENDERER_UPLOAD_BUFFERS;
+
+	if (!ub->pbo)
+		glGenBuffers(1, &ub->pbo);
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ub->pbo);
+	if (ub->size < size) {
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL,
+			     GL_STREAM_DRAW);
+		ub->size = size;
+	}
+
+	ptr = gr->map_buffer_range(GL_PIXEL_UNPACK_BUFFER, 0, size,
+				   GL_MAP_WRITE_BIT |
+				   GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (!ptr)
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	return ptr;
 }
 
-static int
-gl_renderer_read_pixels(struct weston_output *output,
-			       pixman_format_code_t format, void *pixels,
-			       uint32_t x, uint32_t y,
-			       uint32_t width, uint32_t height)
+/* Upload the damaged parts of a wl_shm buffer through a pixel unpack
+ * buffer. The rectangles are packed one after another into the mapped
+ * buffer, and the texture updates then source from it, which lets the
+ * driver copy them to the texture asynchronously instead of stalling
+ * here until the previous frame is done with the texture.
+ *
+ * Returns the number of bytes uploaded, or -1 if the caller should
+ * fall back to uploading directly from the shm buffer.
+ */
+static int64_t
+upload_shm_pbo(struct weston_surface *surface, struct gl_surface_state *gs,
+	       struct wl_shm_buffer *shm_buffer)
 {
-	GLenum gl_format;
-	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+	int32_t stride = wl_shm_buffer_get_stride(shm_buffer);
+	int32_t height = wl_shm_buffer_get_height(shm_buffer);
+	int bpp = stride / gs->pitch;
+	pixman_box32_t *rectangles, *rects;
+	uint8_t *data, *dst;
+	size_t size, offset, row, *offsets;
+	int i, y, n;
 
-	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
-	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+	if (gs->needs_full_upload) {
+		n = 1;
+		rects = malloc(sizeof *rects);
+		if (!rects)
+			return -1;
+		rects[0].x1 = 0;
+		rects[0].y1 = 0;
+		rects[0].x2 = gs->pitch;
+		rects[0].y2 = height;
+	} else {
+		rectangles = pixman_region32_rectangles(&gs->texture_damage,
+							&n);
+		rects = malloc(n * sizeof *rects);
+		if (!rects)
+			return -1;
+		for (i = 0; i < n; i++) {
+			rects[i] = weston_surface_to_buffer_rect(surface,
+								 rectangles[i]);
+			rects[i].x1 = MAX(rects[i].x1, 0);
+			rects[i].y1 = MAX(rects[i].y1, 0);
+			rects[i].x2 = MAX(MIN(rects[i].x2, gs->pitch),
+					  rects[i].x1);
+			rects[i].y2 = MAX(MIN(rects[i].y2, height),
+					  rects[i].y1);
+		}
+		n = coalesce_rects(rects, n);
+	}
 
-	switch (format) {
-	case PIXMAN_a8r8g8b8:
-		gl_format = GL_BGRA_EXT;
-		break;
-	case PIXMAN_a8b8g8r8:
-		gl_format = GL_RGBA;
-		break;
-	default:
+	/* Rows of each rectangle are packed to the default 4 byte
+	 * GL_UNPACK_ALIGNMENT. */
+	offsets = malloc(n * sizeof *offsets);
+	if (!offsets) {
+		free(rects);
 		return -1;
 	}
 
-	if (use_output(output) < 0)
+	size = 0;
+	for (i = 0; i < n; i++) {
+		row = ((rects[i].x2 - rects[i].x1) * bpp + 3) & ~3;
+		offsets[i] = size;
+		size += row * (rects[i].y2 - rects[i].y1);
+	}
+
+	if (size == 0) {
+		free(offsets);
+		free(rects);
+		return 0;
+	}
+
+	dst = map_upload_buffer(gr, size);
+	if (!dst) {
+		free(offsets);
+		free(rects);
 		return -1;
+	}
 
-	glPixelStorei(GL_PACK_ALIGNMENT, 1);
-	glReadPixels(x, y, width, height, gl_format,
-		     GL_UNSIGNED_BYTE, pixels);
+	data = wl_shm_buffer_get_data(shm_buffer);
+	wl_shm_buffer_begin_access(shm_buffer);
+	for (i = 0; i < n; i++) {
+		row = ((rects[i].x2 - rects[i].x1) * bpp + 3) & ~3;
+		offset = offsets[i];
+		for (y = rects[i].y1; y < rects[i].y2; y++) {
+			memcpy(dst + offset,
+			       data + y * stride + rects[i].x1 * bpp,
+			       (rects[i].x2 - rects[i].x1) * bpp);
+			offset += row;
+		}
+	}
+	wl_shm_buffer_end_access(shm_buffer);
 
-	return 0;
+	gr->unmap_buffer(GL_PIXEL_UNPACK_BUFFER);
+
+	if (gr->has_unpack_subimage) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	}
+
+	if (gs->needs_full_upload) {
+		glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format,
+			     gs->pitch, height, 0,
+			     gs->gl_format, gs->gl_pixel_type, NULL);
+	} else {
+		for (i = 0; i < n; i++)
+			glTexSubImage2D(GL_TEXTURE_2D, 0,
+					rects[i].x1, rects[i].y1,
+					rects[i].x2 - rects[i].x1,
+					rects[i].y2 - rects[i].y1,
+					gs->gl_format, gs->gl_pixel_type,
+					(void *) offsets[i]);
+	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	free(offsets);
+	free(rects);
+
+	return size;
 }
 
 static void
@@ -1229,6 +2056,7 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	struct weston_view *view;
 	bool texture_used;
 	pixman_box32_t *rectangles;
+	int64_t uploaded;
 	void *data;
 	int i, n;
 
@@ -1259,6 +2087,16 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 
 	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
 
+	if (gr->has_unpack_buffer) {
+		uploaded = upload_shm_pbo(surface, gs, buffer->shm_buffer);
+		if (uploaded >= 0) {
+			gr->stats.upload_bytes += uploaded;
+			TL_POINT("renderer_gl_upload", TLP_SURFACE(surface),
+				 TLP_COUNTER("bytes", uploaded), TLP_END);
+			goto done;
+		}
+	}
+
 	if (!gr->has_unpack_subimage) {
 		wl_shm_buffer_begin_access(buffer->shm_buffer);
 		glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format,
@@ -2281,6 +3119,230 @@ static const char solid_fragment_shader[] =
 	"   gl_FragColor = alpha * color\n;"
 	;
 
+/* Linked programs are cached in $XDG_CACHE_HOME/weston/gl-programs,
+ * one file per program. The file name is a hash of the driver identity
+ * and all shader sources, so a driver update or a shader change simply
+ * misses the cache. A binary the driver refuses is recompiled from
+ * source and overwritten. */
+#define PROGRAM_CACHE_MAGIC	0x50475457	/* "WTGP" */
+
+struct program_cache_header {
+	uint32_t magic;
+	uint32_t format;
+	uint64_t key;
+	uint32_t length;
+	uint32_t reserved;
+};
+
+static uint64_t
+hash_string(uint64_t hash, const char *str)
+{
+	/* FNV-1a, including the terminating zero as a separator */
+	do {
+		hash ^= (uint8_t) *str;
+		hash *= 0x100000001b3ULL;
+	} while (*str++);
+
+	return hash;
+}
+
+static uint64_t
+program_cache_key(struct gl_renderer *gr, const char *vertex_source,
+		  int count, const char **fragment_sources)
+{
+	uint64_t key = gr->program_cache_id;
+	int i;
+
+	key = hash_string(key, vertex_source);
+	for (i = 0; i < count; i++)
+		key = hash_string(key, fragment_sources[i]);
+
+	return key;
+}
+
+static void
+program_cache_path(struct gl_renderer *gr, uint64_t key,
+		   char *path, size_t size)
+{
+	snprintf(path, size, "%s/%016" PRIx64 ".bin",
+		 gr->program_cache_dir, key);
+}
+
+static int
+program_cache_load(struct gl_renderer *gr, struct gl_shader *shader,
+		   uint64_t key)
+{
+	struct program_cache_header header;
+	char path[PATH_MAX];
+	GLint status;
+	void *binary;
+	struct stat st;
+	int fd;
+
+	program_cache_path(gr, key, path, sizeof path);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 ||
+	    read(fd, &header, sizeof header) != sizeof header ||
+	    header.magic != PROGRAM_CACHE_MAGIC || header.key != key ||
+	    st.st_size != (off_t) (sizeof header + header.length)) {
+		close(fd);
+		return -1;
+	}
+
+	binary = malloc(header.length);
+	if (!binary ||
+	    read(fd, binary, header.length) != (ssize_t) header.length) {
+		free(binary);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	shader->program = glCreateProgram();
+	gr->program_binary(shader->program, header.format,
+			   binary, header.length);
+	free(binary);
+
+	glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
+	if (!status) {
+		weston_log("GL program cache entry %s rejected\n", path);
+		glDeleteProgram(shader->program);
+		shader->program = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+program_cache_store(struct gl_renderer *gr, GLuint program, uint64_t key)
+{
+	struct program_cache_header header;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	GLint length = 0;
+	GLsizei written = 0;
+	GLenum format;
+	void *binary;
+	int fd, ok;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0)
+		return;
+
+	binary = malloc(length);
+	if (!binary)
+		return;
+
+	gr->get_program_binary(program, length, &written, &format, binary);
+	if (written <= 0) {
+		free(binary);
+		return;
+	}
+
+	memset(&header, 0, sizeof header);
+	header.magic = PROGRAM_CACHE_MAGIC;
+	header.format = format;
+	header.key = key;
+	header.length = written;
+
+	/* Write to a temporary file and rename, so that a concurrently
+	 * starting compositor never sees a partial entry. */
+	program_cache_path(gr, key, path, sizeof path);
+	snprintf(tmp, sizeof tmp, "%s.%d", path, (int) getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		free(binary);
+		return;
+	}
+
+	ok = write(fd, &header, sizeof header) == sizeof header &&
+	     write(fd, binary, written) == written;
+	close(fd);
+	free(binary);
+
+	if (!ok || rename(tmp, path) < 0) {
+		weston_log("failed to write GL program cache entry %s: %m\n",
+			   path);
+		unlink(tmp);
+	}
+}
+
+static int
+mkdir_parents(char *path)
+{
+	char *p;
+
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+static void
+program_cache_init(struct gl_renderer *gr)
+{
+	const char *cache_home, *home, *str;
+	GLint nformats = 0;
+	uint64_t id = 0xcbf29ce484222325ULL;
+	char *dir;
+	int r;
+
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &nformats);
+	if (nformats <= 0)
+		return;
+
+	cache_home = getenv("XDG_CACHE_HOME");
+	home = getenv("HOME");
+	if (cache_home && cache_home[0] == '/')
+		r = asprintf(&dir, "%s/weston/gl-programs", cache_home);
+	else if (home && home[0] == '/')
+		r = asprintf(&dir, "%s/.cache/weston/gl-programs", home);
+	else
+		return;
+
+	if (r < 0)
+		return;
+
+	if (mkdir_parents(dir) < 0) {
+		weston_log("cannot create GL program cache %s: %m\n", dir);
+		free(dir);
+		return;
+	}
+
+	str = (const char *) glGetString(GL_VENDOR);
+	id = hash_string(id, str ? str : "");
+	str = (const char *) glGetString(GL_RENDERER);
+	id = hash_string(id, str ? str : "");
+	str = (const char *) glGetString(GL_VERSION);
+	id = hash_string(id, str ? str : "");
+
+	gr->program_cache_dir = dir;
+	gr->program_cache_id = id;
+}
+
+static double
+elapsed_ms(const struct timespec *begin)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - begin->tv_sec) * 1000.0 +
+		(now.tv_nsec - begin->tv_nsec) / 1000000.0;
+}
+
 static int
 compile_shader(GLenum type, int count, const char **sources)
 {
@@ -2309,9 +3371,10 @@ shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
 	GLint status;
 	int count;
 	const char *sources[3];
+	struct timespec begin;
+	uint64_t key = 0;
 
-	shader->vertex_shader =
-		compile_shader(GL_VERTEX_SHADER, 1, &vertex_source);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
 
 	if (renderer->fragment_shader_debug) {
 		sources[0] = fragment_source;
@@ -2324,6 +3387,18 @@ shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
 		count = 2;
 	}
 
+	if (renderer->program_cache_dir) {
+		key = program_cache_key(renderer, vertex_source,
+					count, sources);
+		if (program_cache_load(renderer, shader, key) == 0) {
+			renderer->program_stats.loaded++;
+			renderer->program_stats.load_ms += elapsed_ms(&begin);
+			goto uniforms;
+		}
+	}
+
+	shader->vertex_shader =
+		compile_shader(GL_VERTEX_SHADER, 1, &vertex_source);
 	shader->fragment_shader =
 		compile_shader(GL_FRAGMENT_SHADER, count, sources);
 
@@ -2341,6 +3416,13 @@ shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
 		return -1;
 	}
 
+	renderer->program_stats.compiled++;
+	renderer->program_stats.compile_ms += elapsed_ms(&begin);
+
+	if (renderer->program_cache_dir)
+		program_cache_store(renderer, shader->program, key);
+
+uniforms:
 	shader->proj_uniform = glGetUniformLocation(shader->program, "proj");
 	shader->tex_uniforms[0] = glGetUniformLocation(shader->program, "tex");
 	shader->tex_uniforms[1] = glGetUniformLocation(shader->program, "tex1");
@@ -2544,26 +3626,21 @@ static int
 gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface);
 
 static int
-gl_renderer_output_create(struct weston_output *output,
-			  EGLNativeWindowType window_for_legacy,
-			  void *window_for_platform,
-			  const EGLint *attribs,
-			  const EGLint *visual_id,
-			  int n_ids)
+gl_renderer_output_choose_config(struct weston_output *output,
+				 const EGLint *attribs,
+				 const EGLint *visual_id,
+				 int n_ids,
+				 EGLConfig *egl_config)
 {
-	struct weston_compositor *ec = output->compositor;
-	struct gl_renderer *gr = get_renderer(ec);
-	struct gl_output_state *go;
-	EGLConfig egl_config;
-	int i;
+	struct gl_renderer *gr = get_renderer(output->compositor);
 
 	if (egl_choose_config(gr, attribs, visual_id,
-			      n_ids, &egl_config) == -1) {
+			      n_ids, egl_config) == -1) {
 		weston_log("failed to choose EGL config for output\n");
 		return -1;
 	}
 
-	if (egl_config != gr->egl_config &&
+	if (*egl_config != gr->egl_config &&
 	    !gr->has_configless_context) {
 		weston_log("attempted to use a different EGL config for an "
 			   "output but EGL_MESA_configless_context is not "
@@ -2571,37 +3648,96 @@ gl_renderer_output_create(struct weston_output *output,
 		return -1;
 	}
 
+	return 0;
+}
+
+static int
+gl_renderer_output_init(struct weston_output *output,
+			EGLSurface egl_surface, EGLConfig egl_config,
+			bool pbuffer)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go;
+	int i;
+
+	if (egl_surface == EGL_NO_SURFACE) {
+		weston_log("failed to create egl surface\n");
+		return -1;
+	}
+
 	go = zalloc(sizeof *go);
-	if (go == NULL)
+	if (go == NULL) {
+		eglDestroySurface(gr->egl_display, egl_surface);
+		return -1;
+	}
+
+	go->egl_surface = egl_surface;
+	go->pbuffer = pbuffer;
+
+	for (i = 0; i < BUFFER_DAMAGE_COUNT; i++)
+		pixman_region32_init(&go->buffer_damage[i]);
+
+	output->renderer_state = go;
+
+	log_egl_config_info(gr->egl_display, egl_config);
+
+	return 0;
+}
+
+static int
+gl_renderer_output_create(struct weston_output *output,
+			  EGLNativeWindowType window_for_legacy,
+			  void *window_for_platform,
+			  const EGLint *attribs,
+			  const EGLint *visual_id,
+			  int n_ids)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	EGLConfig egl_config;
+	EGLSurface egl_surface;
+
+	if (gl_renderer_output_choose_config(output, attribs, visual_id,
+					     n_ids, &egl_config) < 0)
 		return -1;
 
 	if (gr->create_platform_window) {
-		go->egl_surface =
+		egl_surface =
 			gr->create_platform_window(gr->egl_display,
 						   egl_config,
 						   window_for_platform,
 						   NULL);
 	} else {
-		go->egl_surface =
+		egl_surface =
 			eglCreateWindowSurface(gr->egl_display,
 					       egl_config,
 					       window_for_legacy, NULL);
 	}
 
-	if (go->egl_surface == EGL_NO_SURFACE) {
-		weston_log("failed to create egl surface\n");
-		free(go);
-		return -1;
-	}
+	return gl_renderer_output_init(output, egl_surface, egl_config, false);
+}
 
-	for (i = 0; i < BUFFER_DAMAGE_COUNT; i++)
-		pixman_region32_init(&go->buffer_damage[i]);
+static int
+gl_renderer_output_pbuffer_create(struct weston_output *output,
+				  const EGLint *attribs,
+				  int32_t width, int32_t height)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	EGLConfig egl_config;
+	EGLSurface egl_surface;
+	const EGLint pbuffer_attribs[] = {
+		EGL_WIDTH, width,
+		EGL_HEIGHT, height,
+		EGL_NONE
+	};
 
-	output->renderer_state = go;
+	if (gl_renderer_output_choose_config(output, attribs, NULL, 0,
+					     &egl_config) < 0)
+		return -1;
 
-	log_egl_config_info(gr->egl_display, egl_config);
+	egl_surface = eglCreatePbufferSurface(gr->egl_display, egl_config,
+					      pbuffer_attribs);
 
-	return 0;
+	return gl_renderer_output_init(output, egl_surface, egl_config, true);
 }
 
 static void
@@ -2614,6 +3750,15 @@ gl_renderer_output_destroy(struct weston_output *output)
 	for (i = 0; i < 2; i++)
 		pixman_region32_fini(&go->buffer_damage[i]);
 
+	if (go->readback.pbo && use_output(output) == 0) {
+		finish_readback(output);
+		glDeleteBuffers(1, &go->readback.pbo);
+	} else if (go->readback.done) {
+		go->readback.done(go->readback.data, NULL, 0);
+	}
+	if (go->readback.timer)
+		wl_event_source_remove(go->readback.timer);
+
 	eglDestroySurface(gr->egl_display, go->egl_surface);
 
 	free(go);
@@ -2655,11 +3800,19 @@ gl_renderer_destroy(struct weston_compositor *ec)
 
 	wl_array_release(&gr->vertices);
 	wl_array_release(&gr->vtxcnt);
+	wl_array_release(&gr->clip_scratch);
+	wl_array_release(&gr->batch_vertices);
+	wl_array_release(&gr->batches);
+	wl_array_release(&gr->pass_views);
+
+	free(gr->program_cache_dir);
 
 	if (gr->fragment_binding)
 		weston_binding_destroy(gr->fragment_binding);
 	if (gr->fan_binding)
 		weston_binding_destroy(gr->fan_binding);
+	if (gr->two_pass_binding)
+		weston_binding_destroy(gr->two_pass_binding);
 
 	free(gr);
 }
@@ -2760,6 +3913,16 @@ static const EGLint gl_renderer_alpha_attribs[] = {
 	EGL_NONE
 };
 
+static const EGLint gl_renderer_pbuffer_attribs[] = {
+	EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+	EGL_RED_SIZE, 1,
+	EGL_GREEN_SIZE, 1,
+	EGL_BLUE_SIZE, 1,
+	EGL_ALPHA_SIZE, 0,
+	EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+	EGL_NONE
+};
+
 
 /** Checks whether a platform EGL client extension is supported
  *
@@ -2833,6 +3996,8 @@ platform_to_extension(EGLenum platform)
 		return "wayland";
 	case EGL_PLATFORM_X11_KHR:
 		return "x11";
+	case EGL_PLATFORM_SURFACELESS_MESA:
+		return "surfaceless";
 	default:
 		assert(0 && "bad EGL platform enum");
 	}
@@ -2909,7 +4074,10 @@ gl_renderer_create(struct weston_compositor *ec, EGLenum platform,
 	if (gr == NULL)
 		return -1;
 
+	gr->two_pass = 1;
+
 	gr->base.read_pixels = gl_renderer_read_pixels;
+	gr->base.read_pixels_async = gl_renderer_read_pixels_async;
 	gr->base.repaint_output = gl_renderer_repaint_output;
 	gr->base.flush_damage = gl_renderer_flush_damage;
 	gr->base.attach = gl_renderer_attach;
@@ -3069,6 +4237,19 @@ fragment_debug_binding(struct weston_keyboard *keyboard, uint32_t time,
 		weston_output_damage(output);
 }
 
+static void
+two_pass_binding(struct weston_keyboard *keyboard, uint32_t time,
+		 uint32_t key, void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct gl_renderer *gr = get_renderer(compositor);
+
+	gr->two_pass = !gr->two_pass;
+	weston_log("GL renderer opaque front-to-back pass %s\n",
+		   gr->two_pass ? "enabled" : "disabled");
+	weston_compositor_damage_all(compositor);
+}
+
 static void
 fan_debug_repaint_binding(struct weston_keyboard *keyboard, uint32_t time,
 			  uint32_t key, void *data)
@@ -3084,7 +4265,7 @@ static int
 gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 {
 	struct gl_renderer *gr = get_renderer(ec);
-	const char *extensions;
+	const char *extensions, *version;
 	EGLConfig context_config;
 	EGLBoolean ret;
 
@@ -3147,6 +4328,40 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	if (weston_check_egl_extension(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = 1;
 
+	version = (const char *) glGetString(GL_VERSION);
+	if (version && strncmp(version, "OpenGL ES 3", 11) == 0) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRange");
+		gr->unmap_buffer =
+			(void *) eglGetProcAddress("glUnmapBuffer");
+	} else if (weston_check_egl_extension(extensions, "GL_NV_pixel_buffer_object") &&
+		   weston_check_egl_extension(extensions, "GL_EXT_map_buffer_range")) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRangeEXT");
+		gr->unmap_buffer =
+			(void *) eglGetProcAddress("glUnmapBufferOES");
+	}
+
+	if (gr->map_buffer_range && gr->unmap_buffer) {
+		gr->has_pack_buffer = 1;
+		gr->has_unpack_buffer = 1;
+	}
+
+	if (version && strncmp(version, "OpenGL ES 3", 11) == 0) {
+		gr->get_program_binary =
+			(void *) eglGetProcAddress("glGetProgramBinary");
+		gr->program_binary =
+			(void *) eglGetProcAddress("glProgramBinary");
+	} else if (weston_check_egl_extension(extensions, "GL_OES_get_program_binary")) {
+		gr->get_program_binary =
+			(void *) eglGetProcAddress("glGetProgramBinaryOES");
+		gr->program_binary =
+			(void *) eglGetProcAddress("glProgramBinaryOES");
+	}
+
+	if (gr->get_program_binary && gr->program_binary)
+		program_cache_init(gr);
+
 	glActiveTexture(GL_TEXTURE0);
 
 	if (compile_shaders(ec))
@@ -3160,6 +4375,10 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		weston_compositor_add_debug_binding(ec, KEY_F,
 						    fan_debug_repaint_binding,
 						    ec);
+	gr->two_pass_binding =
+		weston_compositor_add_debug_binding(ec, KEY_P,
+						    two_pass_binding,
+						    ec);
 
 	gr->output_destroy_listener.notify = output_handle_destroy;
 	wl_signal_add(&ec->output_destroyed_signal,
@@ -3170,6 +4389,12 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		ec->read_format == PIXMAN_a8r8g8b8 ? "BGRA" : "RGBA");
 	weston_log_continue(STAMP_SPACE "wl_shm sub-image to texture: %s\n",
 			    gr->has_unpack_subimage ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "asynchronous read-back: %s\n",
+			    gr->has_pack_buffer ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "wl_shm upload through PBOs: %s\n",
+			    gr->has_unpack_buffer ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "GL program cache: %s\n",
+			    gr->program_cache_dir ? gr->program_cache_dir : "no");
 	weston_log_continue(STAMP_SPACE "EGL Wayland extension: %s\n",
 			    gr->has_bind_display ? "yes" : "no");
 
@@ -3180,10 +4405,12 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 WL_EXPORT struct gl_renderer_interface gl_renderer_interface = {
 	.opaque_attribs = gl_renderer_opaque_attribs,
 	.alpha_attribs = gl_renderer_alpha_attribs,
+	.pbuffer_attribs = gl_renderer_pbuffer_attribs,
 
 	.create = gl_renderer_create,
 	.display = gl_renderer_display,
 	.output_create = gl_renderer_output_create,
+	.output_pbuffer_create = gl_renderer_output_pbuffer_create,
 	.output_destroy = gl_renderer_output_destroy,
 	.output_surface = gl_renderer_output_surface,
 	.output_set_border = gl_renderer_output_set_border,
@@ -49,6 +49,10 @@ typedef intptr_t EGLNativeWindowType;
 
 #define NO_EGL_PLATFORM 0
 
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
 enum gl_renderer_border_side {
 	GL_RENDERER_BORDER_TOP = 0,
 	GL_RENDERER_BORDER_LEFT = 1,
@@ -59,6 +63,7 @@ enum gl_renderer_border_side {
 struct gl_renderer_interface {
 	const EGLint *opaque_attribs;
 	const EGLint *alpha_attribs;
+	const EGLint *pbuffer_attribs;
 
 	int (*create)(struct weston_compositor *ec,
 		      EGLenum platform,
@@ -76,6 +81,12 @@ struct gl_renderer_interface {
 			     const EGLint *visual_id,
 			     const int n_ids);
 
+	/* Creates an output rendered into an offscreen pbuffer of the
+	 * given size, for backends without a window system. */
+	int (*output_pbuffer_create)(struct weston_output *output,
+				     const EGLint *attribs,
+				     int32_t width, int32_t height);
+
 	void (*output_destroy)(struct weston_output *output);
 
 	EGLSurface (*output_surface)(struct weston_output *output);
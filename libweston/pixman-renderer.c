@@ -31,13 +31,17 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "pixman-renderer.h"
 #include "shared/helpers.h"
+#include "timeline.h"
 
 #include <linux/input.h>
 
 struct pixman_output_state {
+	/* NULL with PIXMAN_RENDERER_OUTPUT_CACHEABLE, views are then
+	 * composited straight into hw_buffer */
 	void *shadow_buffer;
 	pixman_image_t *shadow_image;
 	pixman_image_t *hw_buffer;
@@ -47,6 +51,7 @@ struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	pixman_color_t color;	/* of a solid fill image */
 	struct weston_buffer_reference buffer_ref;
 
 	struct wl_listener buffer_destroy_listener;
@@ -54,6 +59,40 @@ struct pixman_surface_state {
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* Damage is split into this many bands per thread, so that a band
+ * crossing many views does not leave the other threads idle. */
+#define PIXMAN_BANDS_PER_THREAD 2
+
+/* Repaints damaging fewer pixels stay on the main thread. */
+#define PIXMAN_PARALLEL_MIN_AREA (128 * 128)
+
+/* A horizontal slice of an output, painted by one thread. Pixman images
+ * carry mutable state such as the clip region and transformation, so
+ * each band paints through images of its own, sharing only the pixel
+ * data. */
+struct pixman_band {
+	pixman_box32_t box;	/* in output coordinates */
+	pixman_image_t *target;
+};
+
+struct pixman_worker_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	pthread_t *threads;
+	int nthreads;
+	bool destroying;
+
+	/* The current repaint, valid while pending > 0 */
+	unsigned int generation;
+	struct weston_output *output;
+	pixman_region32_t *damage;
+	struct pixman_band *bands;
+	int nbands;
+	int next_band;
+	int pending;
+};
+
 struct pixman_renderer {
 	struct weston_renderer base;
 
@@ -61,6 +100,8 @@ struct pixman_renderer {
 	pixman_image_t *debug_color;
 	struct weston_binding *debug_binding;
 
+	struct pixman_worker_pool *pool;
+
 	struct wl_signal destroy_signal;
 };
 
@@ -70,6 +111,14 @@ get_output_state(struct weston_output *output)
 	return (struct pixman_output_state *)output->renderer_state;
 }
 
+/* The image views are composited into: the shadow if there is one,
+ * otherwise the backend's buffer. */
+static inline pixman_image_t *
+get_target_image(struct pixman_output_state *po)
+{
+	return po->shadow_image ? po->shadow_image : po->hw_buffer;
+}
+
 static int
 pixman_renderer_create_surface(struct weston_surface *surface);
 
@@ -316,10 +365,29 @@ composite_clipped(pixman_image_t *src,
 	}
 }
 
+/* A private image sharing the pixels of the surface's image, for use
+ * by a band. */
+static pixman_image_t *
+band_source_image(struct pixman_surface_state *ps)
+{
+	pixman_image_t *image = ps->image;
+
+	if (!pixman_image_get_data(image))
+		return pixman_image_create_solid_fill(&ps->color);
+
+	return pixman_image_create_bits_no_clear(pixman_image_get_format(image),
+						 pixman_image_get_width(image),
+						 pixman_image_get_height(image),
+						 pixman_image_get_data(image),
+						 pixman_image_get_stride(image));
+}
+
 /** Paint an intersected region
  *
  * \param ev The view to be painted.
  * \param output The output being painted.
+ * \param band The band being painted, or NULL when painting the whole
+ *             output on the main thread.
  * \param repaint_output The region to be painted in output coordinates.
  * \param source_clip The region of the source image to use, in source image
  *                    coordinates. If NULL, use the whole source image.
@@ -327,6 +395,7 @@ composite_clipped(pixman_image_t *src,
  */
 static void
 repaint_region(struct weston_view *ev, struct weston_output *output,
+	       struct pixman_band *band,
 	       pixman_region32_t *repaint_output,
 	       pixman_region32_t *source_clip,
 	       pixman_op_t pixman_op)
@@ -339,10 +408,27 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	pixman_transform_t transform;
 	pixman_filter_t filter;
 	pixman_image_t *mask_image;
+	pixman_image_t *src, *dest, *debug_color;
 	pixman_color_t mask = { 0, };
+	pixman_color_t red = { 0x3fff, 0x0000, 0x0000, 0x3fff };
+
+	if (band) {
+		pixman_region32_intersect_rect(repaint_output, repaint_output,
+					       band->box.x1, band->box.y1,
+					       band->box.x2 - band->box.x1,
+					       band->box.y2 - band->box.y1);
+		if (!pixman_region32_not_empty(repaint_output))
+			return;
+
+		src = band_source_image(ps);
+		dest = band->target;
+	} else {
+		src = ps->image;
+		dest = get_target_image(po);
+	}
 
 	/* Clip rendering to the damaged output region */
-	pixman_image_set_clip_region32(po->shadow_image, repaint_output);
+	pixman_image_set_clip_region32(dest, repaint_output);
 
 	pixman_renderer_compute_transform(&transform, ev, output);
 
@@ -362,11 +448,11 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	}
 
 	if (source_clip)
-		composite_clipped(ps->image, mask_image, po->shadow_image,
+		composite_clipped(src, mask_image, dest,
 				  &transform, filter, source_clip);
 	else
-		composite_whole(pixman_op, ps->image, mask_image,
-				po->shadow_image, &transform, filter);
+		composite_whole(pixman_op, src, mask_image,
+				dest, &transform, filter);
 
 	if (mask_image)
 		pixman_image_unref(mask_image);
@@ -374,22 +460,31 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
 
-	if (pr->repaint_debug)
+	if (pr->repaint_debug) {
+		debug_color = band ? pixman_image_create_solid_fill(&red) :
+				     pr->debug_color;
 		pixman_image_composite32(PIXMAN_OP_OVER,
-					 pr->debug_color, /* src */
+					 debug_color, /* src */
 					 NULL /* mask */,
-					 po->shadow_image, /* dest */
+					 dest, /* dest */
 					 0, 0, /* src_x, src_y */
 					 0, 0, /* mask_x, mask_y */
 					 0, 0, /* dest_x, dest_y */
-					 pixman_image_get_width (po->shadow_image), /* width */
-					 pixman_image_get_height (po->shadow_image) /* height */);
+					 pixman_image_get_width (dest), /* width */
+					 pixman_image_get_height (dest) /* height */);
+		if (band)
+			pixman_image_unref(debug_color);
+	}
 
-	pixman_image_set_clip_region32 (po->shadow_image, NULL);
+	pixman_image_set_clip_region32 (dest, NULL);
+
+	if (band)
+		pixman_image_unref(src);
 }
 
 static void
 draw_view_translated(struct weston_view *view, struct weston_output *output,
+		     struct pixman_band *band,
 		     pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -417,8 +512,8 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 							  view);
 			region_global_to_output(output, &repaint_output);
 
-			repaint_region(view, output, &repaint_output, NULL,
-				       PIXMAN_OP_SRC);
+			repaint_region(view, output, band, &repaint_output,
+				       NULL, PIXMAN_OP_SRC);
 		}
 	}
 
@@ -428,7 +523,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 						  &surface_blend, view);
 		region_global_to_output(output, &repaint_output);
 
-		repaint_region(view, output, &repaint_output, NULL,
+		repaint_region(view, output, band, &repaint_output, NULL,
 			       PIXMAN_OP_OVER);
 	}
 
@@ -439,6 +534,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 static void
 draw_view_source_clipped(struct weston_view *view,
 			 struct weston_output *output,
+			 struct pixman_band *band,
 			 pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -464,7 +560,7 @@ draw_view_source_clipped(struct weston_view *view,
 	pixman_region32_copy(&repaint_output, repaint_global);
 	region_global_to_output(output, &repaint_output);
 
-	repaint_region(view, output, &repaint_output, &buffer_region,
+	repaint_region(view, output, band, &repaint_output, &buffer_region,
 		       PIXMAN_OP_OVER);
 
 	pixman_region32_fini(&repaint_output);
@@ -474,6 +570,7 @@ draw_view_source_clipped(struct weston_view *view,
 
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
+	  struct pixman_band *band,
 	  pixman_region32_t *damage) /* in global coordinates */
 {
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
@@ -500,7 +597,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * Also the boundingbox is accurate rather than an
 		 * approximation.
 		 */
-		draw_view_translated(ev, output, &repaint);
+		draw_view_translated(ev, output, band, &repaint);
 	} else {
 		/* The complex case: the view transformation does not allow
 		 * converting opaque etc. regions into global coordinate space.
@@ -509,48 +606,280 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * to be used whole. Source clipping does not work with
 		 * PIXMAN_OP_SRC.
 		 */
-		draw_view_source_clipped(ev, output, &repaint);
+		draw_view_source_clipped(ev, output, band, &repaint);
 	}
 
 out:
 	pixman_region32_fini(&repaint);
 }
 static void
-repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+repaint_surfaces(struct weston_output *output, struct pixman_band *band,
+		 pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_view *view;
 
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
 		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+			draw_view(view, output, band, damage);
 }
 
 static void
-copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
+copy_to_hw_buffer(struct weston_output *output, struct pixman_band *band,
+		  pixman_region32_t *region)
 {
 	struct pixman_output_state *po = get_output_state(output);
 	pixman_region32_t output_region;
+	pixman_image_t *shadow, *hw_buffer;
 
 	pixman_region32_init(&output_region);
 	pixman_region32_copy(&output_region, region);
 
 	region_global_to_output(output, &output_region);
 
-	pixman_image_set_clip_region32 (po->hw_buffer, &output_region);
+	if (band) {
+		pixman_region32_intersect_rect(&output_region, &output_region,
+					       band->box.x1, band->box.y1,
+					       band->box.x2 - band->box.x1,
+					       band->box.y2 - band->box.y1);
+		shadow = band->target;
+		hw_buffer = pixman_image_create_bits_no_clear(
+				pixman_image_get_format(po->hw_buffer),
+				pixman_image_get_width(po->hw_buffer),
+				pixman_image_get_height(po->hw_buffer),
+				pixman_image_get_data(po->hw_buffer),
+				pixman_image_get_stride(po->hw_buffer));
+	} else {
+		shadow = po->shadow_image;
+		hw_buffer = po->hw_buffer;
+	}
+
+	pixman_image_set_clip_region32 (hw_buffer, &output_region);
 	pixman_region32_fini(&output_region);
 
 	pixman_image_composite32(PIXMAN_OP_SRC,
-				 po->shadow_image, /* src */
+				 shadow, /* src */
 				 NULL /* mask */,
-				 po->hw_buffer, /* dest */
+				 hw_buffer, /* dest */
 				 0, 0, /* src_x, src_y */
 				 0, 0, /* mask_x, mask_y */
 				 0, 0, /* dest_x, dest_y */
-				 pixman_image_get_width (po->hw_buffer), /* width */
-				 pixman_image_get_height (po->hw_buffer) /* height */);
+				 pixman_image_get_width (hw_buffer), /* width */
+				 pixman_image_get_height (hw_buffer) /* height */);
+
+	pixman_image_set_clip_region32 (hw_buffer, NULL);
+
+	if (band)
+		pixman_image_unref(hw_buffer);
+}
+
+static void
+paint_band(struct weston_output *output, struct pixman_band *band,
+	   pixman_region32_t *damage)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_image_t *target = get_target_image(po);
+
+	band->target =
+		pixman_image_create_bits_no_clear(
+			pixman_image_get_format(target),
+			pixman_image_get_width(target),
+			pixman_image_get_height(target),
+			pixman_image_get_data(target),
+			pixman_image_get_stride(target));
+
+	repaint_surfaces(output, band, damage);
+	if (po->shadow_image)
+		copy_to_hw_buffer(output, band, damage);
+
+	pixman_image_unref(band->target);
+	band->target = NULL;
+}
+
+/* Take bands of the current repaint until there are none left. Runs on
+ * the workers and on the main thread alike. */
+static void
+worker_pool_paint(struct pixman_worker_pool *pool)
+{
+	int i;
+
+	while (1) {
+		pthread_mutex_lock(&pool->mutex);
+		if (pool->next_band == pool->nbands) {
+			pthread_mutex_unlock(&pool->mutex);
+			return;
+		}
+		i = pool->next_band++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		paint_band(pool->output, &pool->bands[i], pool->damage);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (--pool->pending == 0)
+			pthread_cond_signal(&pool->done_cond);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+}
+
+static void *
+worker_thread(void *data)
+{
+	struct pixman_worker_pool *pool = data;
+	unsigned int generation = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (1) {
+		while (!pool->destroying && pool->generation == generation)
+			pthread_cond_wait(&pool->start_cond, &pool->mutex);
+
+		if (pool->destroying)
+			break;
+
+		generation = pool->generation;
+		pthread_mutex_unlock(&pool->mutex);
+		worker_pool_paint(pool);
+		pthread_mutex_lock(&pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+static void
+worker_pool_destroy(struct pixman_worker_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->destroying = true;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->start_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool->bands);
+	free(pool);
+}
+
+/* The main thread paints too, so nthreads - 1 workers are started. */
+static struct pixman_worker_pool *
+worker_pool_create(int nthreads)
+{
+	struct pixman_worker_pool *pool;
+
+	pool = zalloc(sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->start_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	pool->threads = calloc(nthreads - 1, sizeof *pool->threads);
+	pool->bands = calloc(nthreads * PIXMAN_BANDS_PER_THREAD,
+			     sizeof *pool->bands);
+	if (!pool->threads || !pool->bands)
+		goto err;
+
+	for (pool->nthreads = 0; pool->nthreads < nthreads - 1;
+	     pool->nthreads++)
+		if (pthread_create(&pool->threads[pool->nthreads], NULL,
+				   worker_thread, pool) != 0)
+			goto err;
+
+	return pool;
+
+err:
+	worker_pool_destroy(pool);
+	return NULL;
+}
+
+static uint64_t
+region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *rects;
+	uint64_t area = 0;
+	int i, n;
+
+	rects = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++)
+		area += (uint64_t) (rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	return area;
+}
+
+static bool
+repaint_parallel(struct weston_output *output, pixman_region32_t *damage)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct pixman_renderer *pr = get_renderer(compositor);
+	struct pixman_worker_pool *pool = pr->pool;
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_region32_t output_damage;
+	struct weston_view *view;
+	uint64_t area;
+	int32_t y1, y2, height;
+	int i, nbands;
+
+	if (!pool)
+		return false;
+
+	pixman_region32_init(&output_damage);
+	pixman_region32_copy(&output_damage, damage);
+	region_global_to_output(output, &output_damage);
+
+	area = region_area(&output_damage);
+	y1 = output_damage.extents.y1;
+	y2 = output_damage.extents.y2;
+	pixman_region32_fini(&output_damage);
 
-	pixman_image_set_clip_region32 (po->hw_buffer, NULL);
+	if (area < PIXMAN_PARALLEL_MIN_AREA)
+		return false;
+
+	/* Surface states are created on demand, do that here rather
+	 * than racing on it in the bands. */
+	wl_list_for_each(view, &compositor->view_list, link)
+		if (view->plane == &compositor->primary_plane)
+			get_surface_state(view->surface);
+
+	nbands = (pool->nthreads + 1) * PIXMAN_BANDS_PER_THREAD;
+	height = (y2 - y1 + nbands - 1) / nbands;
+	if (height < 16)
+		height = 16;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	for (i = 0; i < nbands && y1 < y2; i++, y1 += height) {
+		pool->bands[i].box.x1 = 0;
+		pool->bands[i].box.x2 =
+			pixman_image_get_width(get_target_image(po));
+		pool->bands[i].box.y1 = y1;
+		pool->bands[i].box.y2 = MIN(y1 + height, y2);
+	}
+
+	pool->output = output;
+	pool->damage = damage;
+	pool->nbands = i;
+	pool->next_band = 0;
+	pool->pending = i;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	worker_pool_paint(pool);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return true;
 }
 
 static void
@@ -558,12 +887,35 @@ pixman_renderer_repaint_output(struct weston_output *output,
 			     pixman_region32_t *output_damage)
 {
 	struct pixman_output_state *po = get_output_state(output);
+	pixman_region32_t damage;
+	uint64_t damage_pixels, copy_bytes = 0;
 
 	if (!po->hw_buffer)
 		return;
 
-	repaint_surfaces(output, output_damage);
-	copy_to_hw_buffer(output, output_damage);
+	if (!repaint_parallel(output, output_damage)) {
+		repaint_surfaces(output, NULL, output_damage);
+		if (po->shadow_image)
+			copy_to_hw_buffer(output, NULL, output_damage);
+	}
+
+	pixman_region32_init(&damage);
+	pixman_region32_copy(&damage, output_damage);
+	region_global_to_output(output, &damage);
+	pixman_region32_intersect_rect(&damage, &damage, 0, 0,
+				       pixman_image_get_width(po->hw_buffer),
+				       pixman_image_get_height(po->hw_buffer));
+	damage_pixels = region_area(&damage);
+	pixman_region32_fini(&damage);
+
+	if (po->shadow_image)
+		copy_bytes = damage_pixels *
+			PIXMAN_FORMAT_BPP(pixman_image_get_format(po->hw_buffer)) / 8;
+
+	TL_POINT("renderer_pixman_draw", TLP_OUTPUT(output),
+		 TLP_COUNTER("damage_pixels", damage_pixels),
+		 TLP_COUNTER("copy_bytes", copy_bytes),
+		 TLP_END);
 
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
@@ -735,6 +1087,7 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	color.green = green * 0xffff;
 	color.blue = blue * 0xffff;
 	color.alpha = alpha * 0xffff;
+	ps->color = color;
 
 	if (ps->image) {
 		pixman_image_unref(ps->image);
@@ -751,6 +1104,8 @@ pixman_renderer_destroy(struct weston_compositor *ec)
 
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
+	if (pr->pool)
+		worker_pool_destroy(pr->pool);
 	free(pr);
 
 	ec->renderer = NULL;
@@ -858,6 +1213,16 @@ pixman_renderer_init(struct weston_compositor *ec)
 
 	wl_signal_init(&renderer->destroy_signal);
 
+	if (ec->pixman_threads > 1) {
+		renderer->pool = worker_pool_create(ec->pixman_threads);
+		if (renderer->pool)
+			weston_log("Pixman renderer compositing on %d threads\n",
+				   ec->pixman_threads);
+		else
+			weston_log("Failed to start pixman renderer threads, "
+				   "compositing on the main thread\n");
+	}
+
 	return 0;
 }
 
@@ -877,7 +1242,7 @@ pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *
 }
 
 WL_EXPORT int
-pixman_renderer_output_create(struct weston_output *output)
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags)
 {
 	struct pixman_output_state *po;
 	int w, h;
@@ -886,6 +1251,11 @@ pixman_renderer_output_create(struct weston_output *output)
 	if (po == NULL)
 		return -1;
 
+	if (flags & PIXMAN_RENDERER_OUTPUT_CACHEABLE) {
+		output->renderer_state = po;
+		return 0;
+	}
+
 	/* set shadow image transformation */
 	w = output->current_mode->width;
 	h = output->current_mode->height;
@@ -917,7 +1287,8 @@ pixman_renderer_output_destroy(struct weston_output *output)
 {
 	struct pixman_output_state *po = get_output_state(output);
 
-	pixman_image_unref(po->shadow_image);
+	if (po->shadow_image)
+		pixman_image_unref(po->shadow_image);
 
 	if (po->hw_buffer)
 		pixman_image_unref(po->hw_buffer);
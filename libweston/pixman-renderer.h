@@ -30,8 +30,18 @@
 int
 pixman_renderer_init(struct weston_compositor *ec);
 
+/* The buffers passed to pixman_renderer_output_set_buffer() are in
+ * ordinary cached memory, so views are composited into them directly
+ * instead of into a shadow image that is then copied over. Leave this
+ * out for uncached or write-combined memory such as framebuffers. The
+ * buffer contents must persist between repaints, or the backend must
+ * add the damage of the frames a buffer missed to the repaint. */
+enum pixman_renderer_output_flags {
+	PIXMAN_RENDERER_OUTPUT_CACHEABLE = (1 << 0),
+};
+
 int
-pixman_renderer_output_create(struct weston_output *output);
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags);
 
 void
 pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *buffer);
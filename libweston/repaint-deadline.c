@@ -0,0 +1,127 @@
+/*
+ * Copyright © 2016 The Weston Authors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "shared/helpers.h"
+#include "repaint-deadline.h"
+
+void
+repaint_deadline_init(struct weston_repaint_deadline *d, int32_t repaint_msec)
+{
+	memset(d, 0, sizeof *d);
+	d->window_usec = repaint_msec * 1000;
+	d->margin_usec = REPAINT_MARGIN_MIN_USEC;
+}
+
+int32_t
+repaint_deadline_percentile(const struct weston_repaint_deadline *d,
+			    int percent)
+{
+	int i, count = 0, want;
+
+	if (d->nsamples == 0)
+		return 0;
+
+	want = (d->nsamples * percent + 99) / 100;
+	for (i = 0; i < WESTON_REPAINT_BUCKETS; i++) {
+		count += d->histogram[i];
+		if (count >= want)
+			break;
+	}
+
+	/* The upper end of the bucket, to stay on the safe side */
+	return (i + 1) * WESTON_REPAINT_BUCKET_USEC;
+}
+
+void
+repaint_deadline_add_sample(struct weston_repaint_deadline *d, int32_t usec)
+{
+	int bucket = usec / WESTON_REPAINT_BUCKET_USEC;
+
+	if (bucket >= WESTON_REPAINT_BUCKETS)
+		bucket = WESTON_REPAINT_BUCKETS - 1;
+
+	if (d->nsamples == WESTON_REPAINT_HISTORY)
+		d->histogram[d->history[d->next]]--;
+	else
+		d->nsamples++;
+
+	d->history[d->next] = bucket;
+	d->histogram[bucket]++;
+	d->next = (d->next + 1) % WESTON_REPAINT_HISTORY;
+	d->last_usec = usec;
+}
+
+/* Account the repaint aimed at d->target_nsec, presented at stamp_nsec,
+ * and update the repaint window. Misses are only meaningful for outputs
+ * synchronized to a real vblank. The window never starts repaints
+ * earlier than repaint_msec before the vblank, nor more than a refresh
+ * period before it. */
+void
+repaint_deadline_present(struct weston_repaint_deadline *d,
+			 int64_t stamp_nsec, int64_t refresh_nsec, bool vsync,
+			 bool adaptive, int32_t repaint_msec)
+{
+	int32_t window;
+
+	d->repaints++;
+	if (!vsync) {
+		/* nothing to miss */
+	} else if (stamp_nsec > d->target_nsec + refresh_nsec / 2) {
+		d->misses++;
+		d->margin_usec = MIN(d->margin_usec + REPAINT_MARGIN_MISS_USEC,
+				     REPAINT_MARGIN_MAX_USEC);
+	} else {
+		d->margin_usec = MAX(d->margin_usec - REPAINT_MARGIN_DECAY_USEC,
+				     REPAINT_MARGIN_MIN_USEC);
+	}
+	d->target_nsec = 0;
+
+	if (!adaptive || d->nsamples < REPAINT_MIN_SAMPLES) {
+		d->window_usec = repaint_msec * 1000;
+		return;
+	}
+
+	window = repaint_deadline_percentile(d, REPAINT_PERCENTILE) +
+		 d->margin_usec;
+	window = MIN(window, repaint_msec * 1000);
+	if (refresh_nsec)
+		window = MIN(window, refresh_nsec / 1000);
+	d->window_usec = window;
+}
+
+int32_t
+repaint_deadline_window_msec(const struct weston_repaint_deadline *d,
+			     bool adaptive, int32_t repaint_msec)
+{
+	if (!adaptive || d->nsamples < REPAINT_MIN_SAMPLES)
+		return repaint_msec;
+
+	return (d->window_usec + 999) / 1000;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright © 2016 The Weston Authors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef _WESTON_REPAINT_DEADLINE_H
+#define _WESTON_REPAINT_DEADLINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "compositor.h"
+
+/* The adaptive repaint window is the REPAINT_PERCENTILE of the recent
+ * repaint durations plus a safety margin for the work the durations do
+ * not cover, such as the GPU finishing the frame. The margin grows on
+ * every missed vblank and slowly shrinks back while none are missed. */
+#define REPAINT_MIN_SAMPLES 16
+#define REPAINT_PERCENTILE 99
+#define REPAINT_MARGIN_MIN_USEC 1000
+#define REPAINT_MARGIN_MAX_USEC 16000
+#define REPAINT_MARGIN_MISS_USEC 500
+#define REPAINT_MARGIN_DECAY_USEC 10
+
+void
+repaint_deadline_init(struct weston_repaint_deadline *d, int32_t repaint_msec);
+
+int32_t
+repaint_deadline_percentile(const struct weston_repaint_deadline *d,
+			    int percent);
+
+void
+repaint_deadline_add_sample(struct weston_repaint_deadline *d, int32_t usec);
+
+void
+repaint_deadline_present(struct weston_repaint_deadline *d,
+			 int64_t stamp_nsec, int64_t refresh_nsec, bool vsync,
+			 bool adaptive, int32_t repaint_msec);
+
+int32_t
+repaint_deadline_window_msec(const struct weston_repaint_deadline *d,
+			     bool adaptive, int32_t repaint_msec);
+
+#endif
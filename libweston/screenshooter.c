@@ -25,6 +25,7 @@
 
 #include "config.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -33,45 +34,63 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/uio.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "compositor.h"
 #include "shared/helpers.h"
 
 #include "wcap/wcap-decode.h"
+#include "wcap/wcap-kernels.h"
 
 struct screenshooter_frame_listener {
 	struct wl_listener listener;
 	struct weston_buffer *buffer;
+	struct wl_listener buffer_destroy_listener;
+	struct weston_compositor *compositor;
+	int32_t width, height;
 	weston_screenshooter_done_func_t done;
 	void *data;
 };
 
 static void
-copy_bgra_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_row_swap_RB(void *vdst, const void *vsrc, int bytes)
 {
-	uint8_t *end;
+	uint32_t *dst = vdst;
+	const uint32_t *src = vsrc;
+	uint32_t *end = dst + bytes / 4;
 
-	end = dst + height * stride;
-	while (dst < end) {
-		memcpy(dst, src, stride);
-		dst += stride;
-		src -= stride;
-	}
-}
+#if defined(__SSE2__)
+	const __m128i ag = _mm_set1_epi32(0xff00ff00);
+	const __m128i lo = _mm_set1_epi32(0x000000ff);
 
-static void
-copy_bgra(uint8_t *dst, uint8_t *src, int height, int stride)
-{
-	/* TODO: optimize this out */
-	memcpy(dst, src, height * stride);
-}
+	while (end - dst >= 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *) src);
+		__m128i t = _mm_and_si128(v, ag);
 
-static void
-copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
-{
-	uint32_t *dst = vdst;
-	uint32_t *src = vsrc;
-	uint32_t *end = dst + bytes / 4;
+		t = _mm_or_si128(t, _mm_and_si128(_mm_srli_epi32(v, 16), lo));
+		t = _mm_or_si128(t, _mm_slli_epi32(_mm_and_si128(v, lo), 16));
+		_mm_storeu_si128((__m128i *) dst, t);
+		dst += 4;
+		src += 4;
+	}
+#elif defined(__ARM_NEON)
+	while (end - dst >= 16) {
+		uint8x16x4_t v = vld4q_u8((const uint8_t *) src);
+		uint8x16_t t = v.val[0];
+
+		v.val[0] = v.val[2];
+		v.val[2] = t;
+		vst4q_u8((uint8_t *) dst, v);
+		dst += 16;
+		src += 16;
+	}
+#endif
 
 	while (dst < end) {
 		uint32_t v = *src++;
@@ -83,30 +102,87 @@ copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
 	}
 }
 
+/* Copy the read back image into the client buffer, turning it the
+ * right way up and converting RGBA to BGRA on the way as needed. */
 static void
-copy_rgba_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+screenshooter_copy(struct screenshooter_frame_listener *l,
+		   const uint8_t *src, int32_t src_stride)
 {
-	uint8_t *end;
+	struct weston_compositor *compositor = l->compositor;
+	struct wl_shm_buffer *shm_buffer = l->buffer->shm_buffer;
+	int32_t dst_stride = wl_shm_buffer_get_stride(shm_buffer);
+	int32_t row = l->width * 4;
+	uint8_t *dst;
+	bool swap;
+	int i;
 
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src -= stride;
+	switch (compositor->read_format) {
+	case PIXMAN_a8r8g8b8:
+	case PIXMAN_x8r8g8b8:
+		swap = false;
+		break;
+	case PIXMAN_x8b8g8r8:
+	case PIXMAN_a8b8g8r8:
+		swap = true;
+		break;
+	default:
+		return;
+	}
+
+	if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP) {
+		src += src_stride * (l->height - 1);
+		src_stride = -src_stride;
+	}
+
+	wl_shm_buffer_begin_access(shm_buffer);
+
+	dst = wl_shm_buffer_get_data(shm_buffer);
+	for (i = 0; i < l->height; i++) {
+		if (swap)
+			copy_row_swap_RB(dst, src, row);
+		else
+			memcpy(dst, src, row);
+		dst += dst_stride;
+		src += src_stride;
 	}
+
+	wl_shm_buffer_end_access(shm_buffer);
 }
 
 static void
-copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
+screenshooter_frame_listener_destroy(struct screenshooter_frame_listener *l)
 {
-	uint8_t *end;
+	if (l->buffer)
+		wl_list_remove(&l->buffer_destroy_listener.link);
+	free(l);
+}
 
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src += stride;
+static void
+screenshooter_buffer_destroyed(struct wl_listener *listener, void *data)
+{
+	struct screenshooter_frame_listener *l =
+		container_of(listener, struct screenshooter_frame_listener,
+			     buffer_destroy_listener);
+
+	wl_list_remove(&listener->link);
+	l->buffer = NULL;
+}
+
+static void
+screenshooter_read_done(void *data, const void *pixels, int32_t stride)
+{
+	struct screenshooter_frame_listener *l = data;
+
+	if (!l->buffer) {
+		l->done(l->data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+	} else if (!pixels) {
+		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
+	} else {
+		screenshooter_copy(l, pixels, stride);
+		l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
 	}
+
+	screenshooter_frame_listener_destroy(l);
 }
 
 static void
@@ -117,56 +193,57 @@ screenshooter_frame_notify(struct wl_listener *listener, void *data)
 			     struct screenshooter_frame_listener, listener);
 	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
+	struct weston_renderer *renderer = compositor->renderer;
+	struct wl_shm_buffer *shm_buffer;
 	int32_t stride;
-	uint8_t *pixels, *d, *s;
+	uint8_t *pixels;
 
 	output->disable_planes--;
 	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
 
-	if (pixels == NULL) {
-		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
-		free(l);
+	if (!l->buffer) {
+		screenshooter_read_done(l, NULL, 0);
 		return;
 	}
 
-	compositor->renderer->read_pixels(output,
-			     compositor->read_format, pixels,
-			     0, 0, output->current_mode->width,
-			     output->current_mode->height);
-
-	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
-
-	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
-	s = pixels + stride * (l->buffer->height - 1);
-
-	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
+	/* Let the renderer copy the frame behind the GPU's back and
+	 * pick the pixels up once the copy is done, rather than stalling
+	 * the compositor until rendering has finished. */
+	if (renderer->read_pixels_async &&
+	    renderer->read_pixels_async(output, compositor->read_format,
+					0, 0, l->width, l->height,
+					screenshooter_read_done, l) == 0)
+		return;
 
-	switch (compositor->read_format) {
-	case PIXMAN_a8r8g8b8:
-	case PIXMAN_x8r8g8b8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_bgra_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_bgra(d, pixels, output->current_mode->height, stride);
-		break;
-	case PIXMAN_x8b8g8r8:
-	case PIXMAN_a8b8g8r8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_rgba_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_rgba(d, pixels, output->current_mode->height, stride);
-		break;
-	default:
-		break;
+	shm_buffer = l->buffer->shm_buffer;
+	stride = l->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
+
+	/* If the read back already has the layout of the client buffer,
+	 * skip the intermediate copy. */
+	if (compositor->read_format == PIXMAN_a8r8g8b8 &&
+	    !(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP) &&
+	    wl_shm_buffer_get_stride(shm_buffer) == stride) {
+		wl_shm_buffer_begin_access(shm_buffer);
+		renderer->read_pixels(output, compositor->read_format,
+				      wl_shm_buffer_get_data(shm_buffer),
+				      0, 0, l->width, l->height);
+		wl_shm_buffer_end_access(shm_buffer);
+
+		l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
+		screenshooter_frame_listener_destroy(l);
+		return;
 	}
 
-	wl_shm_buffer_end_access(l->buffer->shm_buffer);
+	pixels = malloc(stride * l->height);
+	if (pixels == NULL) {
+		screenshooter_read_done(l, NULL, 0);
+		return;
+	}
 
-	l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
+	renderer->read_pixels(output, compositor->read_format, pixels,
+			      0, 0, l->width, l->height);
+	screenshooter_read_done(l, pixels, stride);
 	free(pixels);
-	free(l);
 }
 
 WL_EXPORT int
@@ -198,6 +275,11 @@ weston_screenshooter_shoot(struct weston_output *output,
 	}
 
 	l->buffer = buffer;
+	l->buffer_destroy_listener.notify = screenshooter_buffer_destroyed;
+	wl_signal_add(&buffer->destroy_signal, &l->buffer_destroy_listener);
+	l->compositor = output->compositor;
+	l->width = output->current_mode->width;
+	l->height = output->current_mode->height;
 	l->done = done;
 	l->data = data;
 	l->listener.notify = screenshooter_frame_notify;
@@ -208,45 +290,177 @@ weston_screenshooter_shoot(struct weston_output *output,
 	return 0;
 }
 
+/* Number of captured frames that can wait for the encoder thread. When
+ * all of them are in use, frames are dropped and their damage is folded
+ * into the next frame that does get captured. */
+#define RECORDER_QUEUE_LENGTH 3
+
+/* Number of frames between two keyframes, bounding how many frames a
+ * decoder has to replay to seek. */
+#define RECORDER_KEYFRAME_INTERVAL 120
+
+struct weston_recorder_frame {
+	uint32_t msecs;
+	struct wl_array rects;		/* pixman_box32_t */
+	struct wl_array dropped;	/* uint32_t msecs of dropped frames */
+	int keyframe;
+	uint32_t *pixels;
+};
+
 struct weston_recorder {
 	struct weston_output *output;
-	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
-	uint32_t total;
+	int width, height;
+	int do_yflip;
 	int fd;
 	struct wl_listener frame_listener;
 	int count, destroying;
+
+	/* Owned by the compositor thread */
+	pixman_region32_t carried_damage;
+	struct wl_array dropped;
+	int total_dropped;
+	int frames_since_keyframe;
+
+	/* Owned by the encoder thread */
+	const struct wcap_kernels *kernels;
+	uint32_t *frame, *outbuf, *row;
+	uint64_t offset;
+	uint32_t frames_written;
+	struct wl_array index;		/* struct wcap_index_entry */
+
+	pthread_t worker_thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t queue_cond;
+	struct weston_recorder_frame queue[RECORDER_QUEUE_LENGTH];
+	int queue_head, queue_length;
+	int worker_exit;
+	uint32_t total;
 };
 
+/* Delta and run length encode one rectangle against the previous
+ * frame, bottom row first.  The snapshot rows are stored bottom-up
+ * when the renderer reads back y-flipped, top-down otherwise. */
 static uint32_t *
-output_run(uint32_t *p, uint32_t delta, int run)
+recorder_encode_rect(struct weston_recorder *recorder,
+		     const pixman_box32_t *r, const uint32_t *pixels,
+		     uint32_t *p)
 {
-	int i;
+	struct wcap_run run = { 0, 0 };
+	const uint32_t *s;
+	uint32_t *d;
+	int j, width, height;
 
-	while (run > 0) {
-		if (run <= 0xe0) {
-			*p++ = delta | ((run - 1) << 24);
-			break;
-		}
+	width = r->x2 - r->x1;
+	height = r->y2 - r->y1;
 
-		i = 24 - __builtin_clz(run);
-		*p++ = delta | ((i + 0xe0) << 24);
-		run -= 1 << (7 + i);
+	for (j = 0; j < height; j++) {
+		if (recorder->do_yflip)
+			s = pixels + width * j;
+		else
+			s = pixels + width * (height - j - 1);
+		d = recorder->frame + recorder->width * (r->y2 - j - 1) + r->x1;
+
+		p = wcap_encode_row(recorder->kernels, p, &run, d, s,
+				    recorder->row, width);
 	}
 
-	return p;
+	return wcap_output_run(p, run.delta, run.length);
 }
 
 static uint32_t
-component_delta(uint32_t next, uint32_t prev)
+recorder_write_frame(struct weston_recorder *recorder,
+		     struct weston_recorder_frame *frame)
+{
+	struct wcap_frame_header header;
+	struct wcap_index_entry *entry;
+	pixman_box32_t *r;
+	uint32_t *msecs, *pixels, *p;
+	uint32_t total = 0;
+	struct iovec v[2];
+	int i, n;
+
+	/* Frames the compositor had to drop are recorded as frames
+	 * without rectangles, which older decoders simply treat as a
+	 * repeat of the previous frame. */
+	wl_array_for_each(msecs, &frame->dropped) {
+		header.msecs = *msecs;
+		header.nrects = 0;
+		total += write(recorder->fd, &header, sizeof header);
+		recorder->frames_written++;
+	}
+
+	r = frame->rects.data;
+	n = frame->rects.size / sizeof *r;
+
+	header.msecs = frame->msecs;
+	header.nrects = n;
+
+	if (frame->keyframe) {
+		entry = wl_array_add(&recorder->index, sizeof *entry);
+		if (entry) {
+			entry->msecs = frame->msecs;
+			entry->frame = recorder->frames_written;
+			entry->offset = recorder->offset + total;
+		}
+		memset(recorder->frame, 0,
+		       recorder->width * recorder->height * 4);
+		header.nrects |= WCAP_FRAME_KEYFRAME;
+	}
+	recorder->frames_written++;
+
+	v[0].iov_base = &header;
+	v[0].iov_len = sizeof header;
+	v[1].iov_base = r;
+	v[1].iov_len = n * sizeof *r;
+	total += writev(recorder->fd, v, 2);
+
+	pixels = frame->pixels;
+	for (i = 0; i < n; i++) {
+		p = recorder_encode_rect(recorder, &r[i], pixels,
+					 recorder->outbuf);
+		total += write(recorder->fd, recorder->outbuf,
+			       (p - recorder->outbuf) * 4);
+		pixels += (r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1);
+	}
+
+	return total;
+}
+
+static void *
+recorder_worker_thread(void *data)
 {
-	unsigned char dr, dg, db;
+	struct weston_recorder *recorder = data;
+	struct weston_recorder_frame *frame;
+	uint32_t written;
+
+	pthread_mutex_lock(&recorder->mutex);
+
+	for (;;) {
+		while (recorder->queue_length == 0 && !recorder->worker_exit)
+			pthread_cond_wait(&recorder->queue_cond,
+					  &recorder->mutex);
+
+		/* Drain the queue before honouring an exit request, so
+		 * stopping the recorder never loses captured frames. */
+		if (recorder->queue_length == 0)
+			break;
+
+		frame = &recorder->queue[recorder->queue_head];
+		pthread_mutex_unlock(&recorder->mutex);
+
+		written = recorder_write_frame(recorder, frame);
+		recorder->offset += written;
+
+		pthread_mutex_lock(&recorder->mutex);
+		recorder->total += written;
+		recorder->queue_head =
+			(recorder->queue_head + 1) % RECORDER_QUEUE_LENGTH;
+		recorder->queue_length--;
+	}
 
-	dr = (next >> 16) - (prev >> 16);
-	dg = (next >>  8) - (prev >>  8);
-	db = (next >>  0) - (prev >>  0);
+	pthread_mutex_unlock(&recorder->mutex);
 
-	return (dr << 16) | (dg << 8) | (db << 0);
+	return NULL;
 }
 
 static void
@@ -259,25 +473,12 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 		container_of(listener, struct weston_recorder, frame_listener);
 	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = output->frame_time;
-	pixman_box32_t *r;
+	struct weston_recorder_frame *frame;
+	pixman_box32_t *r, *rects;
 	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
-	struct {
-		uint32_t msecs;
-		uint32_t nrects;
-	} header;
-	struct iovec v[2];
-	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
+	uint32_t *pixels, *msecs;
+	struct wl_array tmp;
+	int i, n, width, height, queued, slot, y_orig, keyframe;
 
 	pixman_region32_init(&damage);
 	pixman_region32_init(&transformed_damage);
@@ -289,75 +490,89 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 				 &damage, &transformed_damage);
 	pixman_region32_fini(&damage);
 
+	pixman_region32_union(&transformed_damage, &transformed_damage,
+			      &recorder->carried_damage);
+
+	/* A keyframe is the whole output, encoded from scratch. */
+	keyframe = recorder->frames_since_keyframe >=
+		RECORDER_KEYFRAME_INTERVAL;
+	if (keyframe)
+		pixman_region32_union_rect(&transformed_damage,
+					   &transformed_damage, 0, 0,
+					   recorder->width, recorder->height);
+
 	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
-		pixman_region32_fini(&transformed_damage);
-		return;
+	if (n == 0)
+		goto out;
+
+	pthread_mutex_lock(&recorder->mutex);
+	queued = recorder->queue_length;
+	slot = (recorder->queue_head + queued) % RECORDER_QUEUE_LENGTH;
+	pthread_mutex_unlock(&recorder->mutex);
+
+	if (queued == RECORDER_QUEUE_LENGTH) {
+		/* The encoder is falling behind; never stall the
+		 * compositor for it. */
+		msecs = wl_array_add(&recorder->dropped, sizeof *msecs);
+		if (msecs)
+			*msecs = output->frame_time;
+		pixman_region32_copy(&recorder->carried_damage,
+				     &transformed_damage);
+		recorder->total_dropped++;
+		goto out;
 	}
 
-	header.msecs = msecs;
-	header.nrects = n;
-	v[0].iov_base = &header;
-	v[0].iov_len = sizeof header;
-	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
-	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
+	/* The slot after the queued ones is not touched by the encoder
+	 * thread until we hand it over below. */
+	frame = &recorder->queue[slot];
+	frame->msecs = output->frame_time;
+	frame->keyframe = keyframe;
+
+	frame->rects.size = 0;
+	rects = wl_array_add(&frame->rects, n * sizeof *r);
+	if (rects == NULL) {
+		pixman_region32_copy(&recorder->carried_damage,
+				     &transformed_damage);
+		goto out;
+	}
+	memcpy(rects, r, n * sizeof *r);
+
+	tmp = frame->dropped;
+	frame->dropped = recorder->dropped;
+	recorder->dropped = tmp;
+	recorder->dropped.size = 0;
 
+	pixels = frame->pixels;
 	for (i = 0; i < n; i++) {
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
 
-		if (do_yflip)
+		if (recorder->do_yflip)
 			y_orig = output->current_mode->height - r[i].y2;
 		else
 			y_orig = r[i].y1;
 
 		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
+				compositor->read_format, pixels,
 				r[i].x1, y_orig, width, height);
+		pixels += width * height;
+	}
 
-		p = outbuf;
-		run = prev = 0; /* quiet gcc */
-		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				s = recorder->rect + width * j;
-			else
-				s = recorder->rect + width * (height - j - 1);
-			y_orig = r[i].y2 - j - 1;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
-		}
-
-		p = output_run(p, prev, run);
+	pixman_region32_clear(&recorder->carried_damage);
 
-		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->queue_length++;
+	pthread_cond_signal(&recorder->queue_cond);
+	pthread_mutex_unlock(&recorder->mutex);
 
-#if 0
-		fprintf(stderr,
-			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
-			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
-#endif
-	}
+	recorder->count++;
+	if (keyframe)
+		recorder->frames_since_keyframe = 0;
+	else
+		recorder->frames_since_keyframe++;
 
+out:
 	pixman_region32_fini(&transformed_damage);
-	recorder->count++;
 
 	if (recorder->destroying)
 		weston_recorder_destroy(recorder);
@@ -366,11 +581,21 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 static void
 weston_recorder_free(struct weston_recorder *recorder)
 {
+	int i;
+
 	if (recorder == NULL)
 		return;
 
-	free(recorder->tmpbuf);
-	free(recorder->rect);
+	for (i = 0; i < RECORDER_QUEUE_LENGTH; i++) {
+		wl_array_release(&recorder->queue[i].rects);
+		wl_array_release(&recorder->queue[i].dropped);
+		free(recorder->queue[i].pixels);
+	}
+	wl_array_release(&recorder->dropped);
+	wl_array_release(&recorder->index);
+	pixman_region32_fini(&recorder->carried_damage);
+	free(recorder->row);
+	free(recorder->outbuf);
 	free(recorder->frame);
 	free(recorder);
 }
@@ -380,11 +605,8 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_recorder *recorder;
-	int stride, size;
-	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	int i, size;
+	struct wcap_header header;
 
 	recorder = zalloc(sizeof *recorder);
 	if (recorder == NULL) {
@@ -392,26 +614,42 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		return NULL;
 	}
 
-	stride = output->current_mode->width;
-	size = stride * 4 * output->current_mode->height;
-	recorder->frame = zalloc(size);
-	recorder->rect = malloc(size);
 	recorder->output = output;
+	recorder->width = output->current_mode->width;
+	recorder->height = output->current_mode->height;
+	recorder->do_yflip =
+		!!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	recorder->kernels = wcap_kernels_get();
+	recorder->frames_since_keyframe = RECORDER_KEYFRAME_INTERVAL;
+	pixman_region32_init(&recorder->carried_damage);
+	wl_array_init(&recorder->dropped);
+	wl_array_init(&recorder->index);
+	for (i = 0; i < RECORDER_QUEUE_LENGTH; i++) {
+		wl_array_init(&recorder->queue[i].rects);
+		wl_array_init(&recorder->queue[i].dropped);
+	}
 
-	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
+	/* Damage rectangles never overlap, so a full frame is enough to
+	 * hold the snapshot or the encoding of any one frame. */
+	size = recorder->width * 4 * recorder->height;
+	recorder->frame = zalloc(size);
+	recorder->outbuf = malloc(size);
+	recorder->row = malloc(recorder->width * 4);
+	if ((recorder->frame == NULL) || (recorder->outbuf == NULL) ||
+	    (recorder->row == NULL)) {
 		weston_log("%s: out of memory\n", __func__);
 		goto err_recorder;
 	}
 
-	if (!do_yflip) {
-		recorder->tmpbuf = malloc(size);
-		if (recorder->tmpbuf == NULL) {
+	for (i = 0; i < RECORDER_QUEUE_LENGTH; i++) {
+		recorder->queue[i].pixels = malloc(size);
+		if (recorder->queue[i].pixels == NULL) {
 			weston_log("%s: out of memory\n", __func__);
 			goto err_recorder;
 		}
 	}
 
-	header.magic = WCAP_HEADER_MAGIC;
+	header.magic = WCAP_HEADER_MAGIC_V2;
 
 	switch (compositor->read_format) {
 	case PIXMAN_x8r8g8b8:
@@ -434,9 +672,21 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		goto err_recorder;
 	}
 
-	header.width = output->current_mode->width;
-	header.height = output->current_mode->height;
+	header.width = recorder->width;
+	header.height = recorder->height;
 	recorder->total += write(recorder->fd, &header, sizeof header);
+	recorder->offset = sizeof header;
+
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->queue_cond, NULL);
+	if (pthread_create(&recorder->worker_thread, NULL,
+			   recorder_worker_thread, recorder) != 0) {
+		weston_log("failed to start recorder thread\n");
+		pthread_cond_destroy(&recorder->queue_cond);
+		pthread_mutex_destroy(&recorder->mutex);
+		close(recorder->fd);
+		goto err_recorder;
+	}
 
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
@@ -450,12 +700,47 @@ err_recorder:
 	return NULL;
 }
 
+/* Finish the file with the keyframe index, which lets decoders seek
+ * without scanning the whole recording. */
+static void
+recorder_write_index(struct weston_recorder *recorder)
+{
+	struct wcap_index_trailer trailer;
+	struct iovec v[2];
+
+	trailer.magic = WCAP_INDEX_MAGIC;
+	trailer.nentries = recorder->index.size / sizeof(struct wcap_index_entry);
+	trailer.offset = recorder->offset;
+	v[0].iov_base = recorder->index.data;
+	v[0].iov_len = recorder->index.size;
+	v[1].iov_base = &trailer;
+	v[1].iov_len = sizeof trailer;
+	recorder->total += writev(recorder->fd, v, 2);
+}
+
 static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
 	wl_list_remove(&recorder->frame_listener.link);
-	close(recorder->fd);
 	recorder->output->disable_planes--;
+
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->worker_exit = 1;
+	pthread_cond_signal(&recorder->queue_cond);
+	pthread_mutex_unlock(&recorder->mutex);
+
+	pthread_join(recorder->worker_thread, NULL);
+	pthread_mutex_destroy(&recorder->mutex);
+	pthread_cond_destroy(&recorder->queue_cond);
+
+	recorder_write_index(recorder);
+
+	weston_log("recorder finished, total file size %dM, "
+		   "%d frames, %d dropped\n",
+		   recorder->total / (1024 * 1024), recorder->count,
+		   recorder->total_dropped);
+
+	close(recorder->fd);
 	weston_recorder_free(recorder);
 }
 
@@ -480,8 +765,8 @@ weston_recorder_start(struct weston_output *output, const char *filename)
 WL_EXPORT void
 weston_recorder_stop(struct weston_recorder *recorder)
 {
-	weston_log("stopping recorder, total file size %dM, %d frames\n",
-		   recorder->total / (1024 * 1024), recorder->count);
+	weston_log("stopping recorder for output %s\n",
+		   recorder->output->name);
 
 	recorder->destroying = 1;
 	weston_output_schedule_repaint(recorder->output);
@@ -0,0 +1,96 @@
+/*
+ * Copyright © 2016 The Weston Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_TIMELINE_BINARY_H
+#define WESTON_TIMELINE_BINARY_H
+
+#include <stdint.h>
+
+/*
+ * Binary timeline log, written when WESTON_TIMELINE_FORMAT=binary.
+ *
+ * The file is a header followed by a ring of fixed size records. The
+ * header's head field counts all records ever written; record n lives
+ * at index n % capacity. Once the ring has wrapped, only the last
+ * capacity records are available.
+ *
+ * Names and descriptions are written once as TLR_STRING records and
+ * referred to by id afterwards. Strings and object descriptions are
+ * written again every capacity / 2 records, so a wrapped ring still
+ * defines everything used in its newer half.
+ */
+
+#define WESTON_TIMELINE_BINARY_MAGIC	0x4c425457	/* "WTBL" */
+#define WESTON_TIMELINE_BINARY_VERSION	1
+
+struct weston_timeline_binary_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t capacity;	/* in records, a power of two */
+	uint64_t head;		/* records written, updated atomically */
+	uint64_t reserved[5];
+};
+
+enum weston_timeline_record_type {
+	/* id is the name string; args hold the timeline point's
+	 * arguments, type being an enum timeline_type. */
+	TLR_POINT = 1,
+	/* id is the string id; count bytes of text follow in this and
+	 * the next continuation records. */
+	TLR_STRING,
+	/* id is the object id; args[0].value the name string or 0. */
+	TLR_OUTPUT,
+	/* id is the object id; args[0].value the description string
+	 * or 0, args[1].value the main surface id or 0. */
+	TLR_SURFACE,
+	/* More arguments or text of the preceding record. */
+	TLR_CONTINUATION,
+};
+
+/* For TLT_COUNTER, key is the name string id. For TLT_VBLANK, value is
+ * in nanoseconds. Other types carry an object id in value. */
+struct weston_timeline_arg {
+	uint32_t type;
+	uint32_t key;
+	uint64_t value;
+};
+
+#define WESTON_TIMELINE_RECORD_ARGS	3
+#define WESTON_TIMELINE_RECORD_TEXT	\
+	(WESTON_TIMELINE_RECORD_ARGS * sizeof(struct weston_timeline_arg))
+
+struct weston_timeline_record {
+	uint64_t ts;		/* nanoseconds, CLOCK_MONOTONIC */
+	uint16_t type;
+	uint16_t count;		/* args in this record, or text length */
+	uint32_t id;
+	union {
+		struct weston_timeline_arg args[WESTON_TIMELINE_RECORD_ARGS];
+		char text[WESTON_TIMELINE_RECORD_TEXT];
+	};
+};
+
+#endif /* WESTON_TIMELINE_BINARY_H */
@@ -0,0 +1,386 @@
+/*
+ * Copyright © 2016 The Weston Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Convert a binary timeline log, as written with
+ * WESTON_TIMELINE_FORMAT=binary, to the JSON lines format of the text
+ * timeline or to the Chrome trace event format. */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "timeline.h"
+#include "timeline-binary.h"
+
+struct string {
+	uint32_t id;
+	char *str;
+};
+
+struct converter {
+	const struct weston_timeline_binary_header *header;
+	const struct weston_timeline_record *records;
+	uint64_t first, last;
+	int chrome;
+	int nevents;
+
+	struct string *strings;
+	int nstrings, astrings;
+};
+
+static const struct weston_timeline_record *
+get_record(struct converter *c, uint64_t pos)
+{
+	return &c->records[pos & (c->header->capacity - 1)];
+}
+
+static const char *
+lookup_string(struct converter *c, uint32_t id)
+{
+	int i;
+
+	if (id == 0)
+		return NULL;
+
+	/* Newer definitions win, ids are never reused. */
+	for (i = c->nstrings - 1; i >= 0; i--)
+		if (c->strings[i].id == id)
+			return c->strings[i].str;
+
+	return NULL;
+}
+
+static uint64_t
+read_string(struct converter *c, uint64_t pos)
+{
+	const struct weston_timeline_record *rec = get_record(c, pos);
+	uint32_t id = rec->id;
+	size_t len = rec->count, off = 0, chunk;
+	struct string *s;
+	char *str;
+
+	str = malloc(len + 1);
+	if (!str)
+		return pos + 1;
+
+	do {
+		chunk = len - off;
+		if (chunk > WESTON_TIMELINE_RECORD_TEXT)
+			chunk = WESTON_TIMELINE_RECORD_TEXT;
+		memcpy(str + off, rec->text, chunk);
+		off += chunk;
+
+		pos++;
+		rec = get_record(c, pos);
+	} while (pos < c->last && rec->type == TLR_CONTINUATION);
+
+	if (off != len) {
+		free(str);
+		return pos;
+	}
+	str[len] = '\0';
+
+	if (c->nstrings == c->astrings) {
+		c->astrings = c->astrings ? c->astrings * 2 : 64;
+		c->strings = realloc(c->strings,
+				     c->astrings * sizeof *c->strings);
+		if (!c->strings) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	s = &c->strings[c->nstrings++];
+	s->id = id;
+	s->str = str;
+
+	return pos;
+}
+
+static void
+print_string(const char *str)
+{
+	if (!str) {
+		printf("null");
+		return;
+	}
+
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+static void
+begin_event(struct converter *c)
+{
+	if (c->chrome)
+		printf(c->nevents++ ? ",\n" : "[\n");
+}
+
+static void
+convert_output(struct converter *c, const struct weston_timeline_record *rec)
+{
+	const char *name = lookup_string(c, rec->args[0].value);
+
+	begin_event(c);
+	if (c->chrome) {
+		printf("{ \"ph\":\"M\", \"name\":\"thread_name\", "
+		       "\"pid\":0, \"tid\":%u, \"args\":{ \"name\":", rec->id);
+		print_string(name);
+		printf(" } }");
+	} else {
+		printf("{ \"id\":%u, \"type\":\"weston_output\", \"name\":",
+		       rec->id);
+		print_string(name);
+		printf(" }\n");
+	}
+}
+
+static void
+convert_surface(struct converter *c, const struct weston_timeline_record *rec)
+{
+	if (c->chrome)
+		return;
+
+	printf("{ \"id\":%u, \"type\":\"weston_surface\", \"desc\":",
+	       rec->id);
+	print_string(lookup_string(c, rec->args[0].value));
+	if (rec->args[1].value)
+		printf(", \"main_surface\":%" PRIu64, rec->args[1].value);
+	printf(" }\n");
+}
+
+static void
+print_arg(struct converter *c, const struct weston_timeline_arg *arg)
+{
+	const char *key;
+
+	switch (arg->type) {
+	case TLT_OUTPUT:
+		printf("\"wo\":%" PRIu64, arg->value);
+		break;
+	case TLT_SURFACE:
+		printf("\"ws\":%" PRIu64, arg->value);
+		break;
+	case TLT_VBLANK:
+		printf("\"vblank\":[%" PRIu64 ", %" PRIu64 "]",
+		       arg->value / 1000000000, arg->value % 1000000000);
+		break;
+	case TLT_COUNTER:
+		key = lookup_string(c, arg->key);
+		print_string(key ? key : "counter");
+		printf(":%" PRIu64, arg->value);
+		break;
+	}
+}
+
+static uint64_t
+convert_point(struct converter *c, uint64_t pos)
+{
+	const struct weston_timeline_record *rec = get_record(c, pos);
+	const char *name = lookup_string(c, rec->id);
+	uint64_t ts = rec->ts;
+	uint32_t tid = 0;
+	int first = 1;
+	int i;
+
+	if (!name) {
+		/* Defined before the oldest record still in the ring. */
+		for (pos++; pos < c->last; pos++)
+			if (get_record(c, pos)->type != TLR_CONTINUATION)
+				break;
+		return pos;
+	}
+
+	begin_event(c);
+	if (c->chrome)
+		printf("{ \"ph\":\"i\", \"s\":\"t\", \"pid\":0, "
+		       "\"ts\":%" PRIu64 ".%03u, \"name\":",
+		       ts / 1000, (unsigned) (ts % 1000));
+	else
+		printf("{ \"T\":[%" PRIu64 ", %" PRIu64 "], \"N\":",
+		       ts / 1000000000, ts % 1000000000);
+	print_string(name);
+	if (c->chrome)
+		printf(", \"args\":{ ");
+
+	do {
+		for (i = 0; i < rec->count && i < WESTON_TIMELINE_RECORD_ARGS;
+		     i++) {
+			if (c->chrome && rec->args[i].type == TLT_OUTPUT)
+				tid = rec->args[i].value;
+			printf(first && c->chrome ? "" : ", ");
+			print_arg(c, &rec->args[i]);
+			first = 0;
+		}
+
+		pos++;
+		rec = get_record(c, pos);
+	} while (pos < c->last && rec->type == TLR_CONTINUATION);
+
+	if (c->chrome)
+		printf(" }, \"tid\":%u }", tid);
+	else
+		printf(" }\n");
+
+	return pos;
+}
+
+static int
+convert(struct converter *c)
+{
+	const struct weston_timeline_record *rec;
+	uint64_t pos = c->first;
+
+	/* The oldest records may be the tail of an overwritten one. */
+	while (pos < c->last && get_record(c, pos)->type == TLR_CONTINUATION)
+		pos++;
+
+	while (pos < c->last) {
+		rec = get_record(c, pos);
+		switch (rec->type) {
+		case TLR_STRING:
+			pos = read_string(c, pos);
+			break;
+		case TLR_OUTPUT:
+			convert_output(c, rec);
+			pos++;
+			break;
+		case TLR_SURFACE:
+			convert_surface(c, rec);
+			pos++;
+			break;
+		case TLR_POINT:
+			pos = convert_point(c, pos);
+			break;
+		default:
+			/* A record that was reserved but never filled. */
+			pos++;
+			break;
+		}
+	}
+
+	if (c->chrome)
+		printf(c->nevents ? "\n]\n" : "[]\n");
+
+	return 0;
+}
+
+static void
+usage(const char *name, int status)
+{
+	fprintf(status ? stderr : stdout,
+		"usage: %s [--chrome] <weston-timeline-*.bin>\n\n"
+		"  --chrome\twrite Chrome trace event JSON instead of\n"
+		"          \tthe timeline JSON lines format\n", name);
+	exit(status);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct converter c;
+	const char *filename = NULL;
+	struct stat st;
+	size_t size;
+	void *map;
+	int fd, i;
+
+	memset(&c, 0, sizeof c);
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--chrome") == 0)
+			c.chrome = 1;
+		else if (strcmp(argv[i], "--help") == 0)
+			usage(argv[0], EXIT_SUCCESS);
+		else if (!filename)
+			filename = argv[i];
+		else
+			usage(argv[0], EXIT_FAILURE);
+	}
+
+	if (!filename)
+		usage(argv[0], EXIT_FAILURE);
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: %m\n", filename);
+		return EXIT_FAILURE;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: %m\n", filename);
+		return EXIT_FAILURE;
+	}
+
+	c.header = map;
+	if ((size_t) st.st_size < sizeof *c.header ||
+	    c.header->magic != WESTON_TIMELINE_BINARY_MAGIC ||
+	    c.header->version != WESTON_TIMELINE_BINARY_VERSION ||
+	    c.header->record_size != sizeof *c.records ||
+	    c.header->capacity == 0 ||
+	    (c.header->capacity & (c.header->capacity - 1)) != 0) {
+		fprintf(stderr, "%s: not a binary timeline\n", filename);
+		return EXIT_FAILURE;
+	}
+
+	size = sizeof *c.header +
+		(size_t) c.header->capacity * sizeof *c.records;
+	if ((size_t) st.st_size < size) {
+		fprintf(stderr, "%s: truncated\n", filename);
+		return EXIT_FAILURE;
+	}
+
+	c.records = (const void *) (c.header + 1);
+	c.last = c.header->head;
+	if (c.last > c.header->capacity)
+		c.first = c.last - c.header->capacity;
+
+	convert(&c);
+
+	for (i = 0; i < c.nstrings; i++)
+		free(c.strings[i].str);
+	free(c.strings);
+	munmap(map, st.st_size);
+
+	return EXIT_SUCCESS;
+}
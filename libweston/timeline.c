@@ -27,32 +27,99 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "timeline.h"
+#include "timeline-binary.h"
 #include "compositor.h"
 #include "file-util.h"
 
+/* 16 MiB worth of records */
+#define TIMELINE_BINARY_CAPACITY (1 << 18)
+
+enum timeline_format {
+	TIMELINE_FORMAT_JSON,
+	TIMELINE_FORMAT_BINARY,
+};
+
+struct timeline_string {
+	const char *str;
+	uint32_t id;
+	uint64_t epoch;
+};
+
 struct timeline_log {
 	clock_t clk_id;
 	FILE *file;
 	unsigned series;
 	struct wl_listener compositor_destroy_listener;
+
+	enum timeline_format format;
+	struct weston_timeline_binary_header *binary;
+	size_t binary_size;
+	uint64_t epoch;
+	uint32_t string_id;
+	struct wl_array strings;	/* struct timeline_string */
 };
 
 WL_EXPORT int weston_timeline_enabled_;
 static struct timeline_log timeline_ = { CLOCK_MONOTONIC, NULL, 0 };
 
+static int
+timeline_binary_map(void)
+{
+	struct weston_timeline_binary_header *header;
+	size_t size;
+	int fd;
+
+	size = sizeof *header + (size_t) TIMELINE_BINARY_CAPACITY *
+		sizeof(struct weston_timeline_record);
+	fd = fileno(timeline_.file);
+	if (ftruncate(fd, size) < 0)
+		return -1;
+
+	header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED)
+		return -1;
+
+	header->magic = WESTON_TIMELINE_BINARY_MAGIC;
+	header->version = WESTON_TIMELINE_BINARY_VERSION;
+	header->record_size = sizeof(struct weston_timeline_record);
+	header->capacity = TIMELINE_BINARY_CAPACITY;
+	header->head = 0;
+
+	timeline_.binary = header;
+	timeline_.binary_size = size;
+	timeline_.epoch = 0;
+	timeline_.string_id = 0;
+	wl_array_init(&timeline_.strings);
+
+	return 0;
+}
+
 static int
 weston_timeline_do_open(void)
 {
 	const char *prefix = "weston-timeline-";
 	const char *suffix = ".log";
+	const char *format;
 	char fname[1000];
 
+	format = getenv("WESTON_TIMELINE_FORMAT");
+	if (format && strcmp(format, "binary") == 0) {
+		timeline_.format = TIMELINE_FORMAT_BINARY;
+		suffix = ".bin";
+	} else {
+		timeline_.format = TIMELINE_FORMAT_JSON;
+	}
+
 	timeline_.file = file_create_dated(prefix, suffix,
 					   fname, sizeof(fname));
 	if (!timeline_.file) {
@@ -71,6 +138,14 @@ weston_timeline_do_open(void)
 		return -1;
 	}
 
+	if (timeline_.format == TIMELINE_FORMAT_BINARY &&
+	    timeline_binary_map() < 0) {
+		weston_log("Cannot map timeline file '%s': %m\n", fname);
+		fclose(timeline_.file);
+		timeline_.file = NULL;
+		return -1;
+	}
+
 	weston_log("Opened timeline file '%s'\n", fname);
 
 	return 0;
@@ -111,6 +186,12 @@ weston_timeline_close(void)
 
 	wl_list_remove(&timeline_.compositor_destroy_listener.link);
 
+	if (timeline_.binary) {
+		munmap(timeline_.binary, timeline_.binary_size);
+		timeline_.binary = NULL;
+		wl_array_release(&timeline_.strings);
+	}
+
 	fclose(timeline_.file);
 	timeline_.file = NULL;
 	weston_log("Timeline log file closed.\n");
@@ -232,14 +313,246 @@ emit_vblank_timestamp(struct timeline_emit_context *ctx, void *obj)
 	return 1;
 }
 
+static int
+emit_counter(struct timeline_emit_context *ctx, void *obj)
+{
+	struct weston_timeline_counter *counter = obj;
+
+	fprintf(ctx->cur, "\"%s\":%" PRIu64, counter->name, counter->value);
+
+	return 1;
+}
+
 typedef int (*type_func)(struct timeline_emit_context *ctx, void *obj);
 
 static const type_func type_dispatch[] = {
 	[TLT_OUTPUT] = emit_weston_output,
 	[TLT_SURFACE] = emit_weston_surface,
 	[TLT_VBLANK] = emit_vblank_timestamp,
+	[TLT_COUNTER] = emit_counter,
 };
 
+static struct weston_timeline_record *
+timeline_binary_record(uint64_t pos)
+{
+	struct weston_timeline_record *records = (void *) (timeline_.binary + 1);
+
+	return &records[pos & (timeline_.binary->capacity - 1)];
+}
+
+/* Claim n consecutive records. This is the only synchronisation the
+ * ring needs; nothing on this path formats text or takes a lock. */
+static uint64_t
+timeline_binary_reserve(unsigned n)
+{
+	return __atomic_fetch_add(&timeline_.binary->head, n,
+				  __ATOMIC_RELAXED);
+}
+
+static uint32_t
+timeline_binary_emit_string(const char *str, uint64_t ts)
+{
+	struct weston_timeline_record *rec;
+	size_t len, chunk, off;
+	unsigned n, i;
+	uint64_t pos;
+	uint32_t id;
+
+	len = strlen(str);
+	if (len > UINT16_MAX)
+		len = UINT16_MAX;
+
+	n = len / WESTON_TIMELINE_RECORD_TEXT + 1;
+	pos = timeline_binary_reserve(n);
+	id = ++timeline_.string_id;
+
+	for (i = 0, off = 0; i < n; i++, off += chunk) {
+		rec = timeline_binary_record(pos + i);
+		rec->ts = ts;
+		rec->type = i == 0 ? TLR_STRING : TLR_CONTINUATION;
+		rec->id = id;
+		chunk = len - off;
+		if (chunk > WESTON_TIMELINE_RECORD_TEXT)
+			chunk = WESTON_TIMELINE_RECORD_TEXT;
+		rec->count = i == 0 ? len : chunk;
+		memcpy(rec->text, str + off, chunk);
+	}
+
+	return id;
+}
+
+/* Names passed to TL_POINT and TLP_COUNTER are string literals, so
+ * they are interned by address. */
+static uint32_t
+timeline_binary_intern(const char *str, uint64_t ts)
+{
+	struct timeline_string *s;
+
+	wl_array_for_each(s, &timeline_.strings) {
+		if (s->str != str)
+			continue;
+
+		if (s->epoch != timeline_.epoch) {
+			s->id = timeline_binary_emit_string(str, ts);
+			s->epoch = timeline_.epoch;
+		}
+		return s->id;
+	}
+
+	s = wl_array_add(&timeline_.strings, sizeof *s);
+	if (!s)
+		return 0;
+
+	s->str = str;
+	s->id = timeline_binary_emit_string(str, ts);
+	s->epoch = timeline_.epoch;
+
+	return s->id;
+}
+
+static void
+timeline_binary_emit_output(struct timeline_emit_context *ctx,
+			    struct weston_output *o, uint64_t ts)
+{
+	struct weston_timeline_record *rec;
+	uint32_t name = 0;
+
+	if (!check_series(ctx, &o->timeline))
+		return;
+
+	if (o->name)
+		name = timeline_binary_emit_string(o->name, ts);
+
+	rec = timeline_binary_record(timeline_binary_reserve(1));
+	memset(rec, 0, sizeof *rec);
+	rec->ts = ts;
+	rec->type = TLR_OUTPUT;
+	rec->count = 1;
+	rec->id = o->timeline.id;
+	rec->args[0].value = name;
+}
+
+static void
+timeline_binary_emit_surface(struct timeline_emit_context *ctx,
+			     struct weston_surface *s, uint64_t ts)
+{
+	struct weston_timeline_record *rec;
+	struct weston_surface *mains;
+	uint32_t desc = 0, main_id = 0;
+	char d[512];
+
+	if (!check_series(ctx, &s->timeline))
+		return;
+
+	mains = weston_surface_get_main_surface(s);
+	if (mains != s) {
+		timeline_binary_emit_surface(ctx, mains, ts);
+		main_id = mains->timeline.id;
+	}
+
+	if (s->get_label && s->get_label(s, d, sizeof(d)) >= 0 && d[0])
+		desc = timeline_binary_emit_string(d, ts);
+
+	rec = timeline_binary_record(timeline_binary_reserve(1));
+	memset(rec, 0, sizeof *rec);
+	rec->ts = ts;
+	rec->type = TLR_SURFACE;
+	rec->count = 2;
+	rec->id = s->timeline.id;
+	rec->args[0].value = desc;
+	rec->args[1].value = main_id;
+}
+
+#define TIMELINE_BINARY_MAX_ARGS 12
+
+static void
+timeline_binary_point(const struct timespec *tspec, const char *name,
+		      va_list argp)
+{
+	struct weston_timeline_arg args[TIMELINE_BINARY_MAX_ARGS];
+	struct weston_timeline_record *rec;
+	struct timeline_emit_context ctx;
+	struct weston_timeline_counter *counter;
+	enum timeline_type otype;
+	struct timespec *vblank;
+	unsigned nargs = 0, n, i, j;
+	uint64_t ts, pos, epoch;
+	uint32_t name_id;
+	void *obj;
+
+	ts = (uint64_t) tspec->tv_sec * 1000000000 + tspec->tv_nsec;
+
+	/* Start describing strings and objects anew every half ring, so
+	 * that the definitions are never all overwritten. */
+	epoch = timeline_.binary->head / (timeline_.binary->capacity / 2);
+	if (epoch != timeline_.epoch) {
+		timeline_.epoch = epoch;
+		if (++timeline_.series == 0)
+			++timeline_.series;
+	}
+
+	ctx.out = NULL;
+	ctx.cur = NULL;
+	ctx.series = timeline_.series;
+
+	while (1) {
+		otype = va_arg(argp, enum timeline_type);
+		if (otype == TLT_END)
+			break;
+
+		obj = va_arg(argp, void *);
+		if (nargs == TIMELINE_BINARY_MAX_ARGS)
+			continue;
+
+		args[nargs].type = otype;
+		args[nargs].key = 0;
+		switch (otype) {
+		case TLT_OUTPUT:
+			timeline_binary_emit_output(&ctx, obj, ts);
+			args[nargs].value =
+				((struct weston_output *) obj)->timeline.id;
+			break;
+		case TLT_SURFACE:
+			timeline_binary_emit_surface(&ctx, obj, ts);
+			args[nargs].value =
+				((struct weston_surface *) obj)->timeline.id;
+			break;
+		case TLT_VBLANK:
+			vblank = obj;
+			args[nargs].value =
+				(uint64_t) vblank->tv_sec * 1000000000 +
+				vblank->tv_nsec;
+			break;
+		case TLT_COUNTER:
+			counter = obj;
+			args[nargs].key =
+				timeline_binary_intern(counter->name, ts);
+			args[nargs].value = counter->value;
+			break;
+		default:
+			continue;
+		}
+		nargs++;
+	}
+
+	n = nargs ? (nargs + WESTON_TIMELINE_RECORD_ARGS - 1) /
+		WESTON_TIMELINE_RECORD_ARGS : 1;
+	name_id = timeline_binary_intern(name, ts);
+	pos = timeline_binary_reserve(n);
+
+	for (i = 0, j = 0; i < n; i++) {
+		rec = timeline_binary_record(pos + i);
+		rec->ts = ts;
+		rec->type = i == 0 ? TLR_POINT : TLR_CONTINUATION;
+		rec->id = name_id;
+		rec->count = nargs - j;
+		if (rec->count > WESTON_TIMELINE_RECORD_ARGS)
+			rec->count = WESTON_TIMELINE_RECORD_ARGS;
+		memcpy(rec->args, &args[j], rec->count * sizeof args[0]);
+		j += rec->count;
+	}
+}
+
 WL_EXPORT void
 weston_timeline_point(const char *name, ...)
 {
@@ -252,6 +565,13 @@ weston_timeline_point(const char *name, ...)
 
 	clock_gettime(timeline_.clk_id, &ts);
 
+	if (timeline_.format == TIMELINE_FORMAT_BINARY) {
+		va_start(argp, name);
+		timeline_binary_point(&ts, name, argp);
+		va_end(argp);
+		return;
+	}
+
 	ctx.out = timeline_.file;
 	ctx.cur = fmemopen(buf, sizeof(buf), "w");
 	ctx.series = timeline_.series;
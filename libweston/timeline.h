@@ -27,6 +27,8 @@
 #ifndef WESTON_TIMELINE_H
 #define WESTON_TIMELINE_H
 
+#include <stdint.h>
+
 extern int weston_timeline_enabled_;
 
 struct weston_compositor;
@@ -42,6 +44,13 @@ enum timeline_type {
 	TLT_OUTPUT,
 	TLT_SURFACE,
 	TLT_VBLANK,
+	TLT_COUNTER,
+};
+
+/* A named integer value attached to a timeline point, e.g. statistics. */
+struct weston_timeline_counter {
+	const char *name;
+	uint64_t value;
 };
 
 #define TYPEVERIFY(type, arg) ({			\
@@ -53,6 +62,8 @@ enum timeline_type {
 #define TLP_OUTPUT(o) TLT_OUTPUT, TYPEVERIFY(struct weston_output *, (o))
 #define TLP_SURFACE(s) TLT_SURFACE, TYPEVERIFY(struct weston_surface *, (s))
 #define TLP_VBLANK(t) TLT_VBLANK, TYPEVERIFY(const struct timespec *, (t))
+#define TLP_COUNTER(n, v) TLT_COUNTER, \
+	(&(struct weston_timeline_counter){ .name = (n), .value = (v) })
 
 #define TL_POINT(...) do { \
 	if (weston_timeline_enabled_) \
@@ -25,9 +25,22 @@
 #include <assert.h>
 #include <float.h>
 #include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "vertex-clipping.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CLIP_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CLIP_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
 float
 float_difference(float a, float b)
 {
@@ -296,6 +309,31 @@ clip_simple(struct clip_context *ctx,
 	return surf->n;
 }
 
+/* Copy a polygon, getting rid of duplicate vertices */
+static int
+remove_duplicates(const float *x, const float *y, int count,
+		  float *ex, float *ey)
+{
+	int i, n;
+
+	ex[0] = x[0];
+	ey[0] = y[0];
+	n = 1;
+	for (i = 1; i < count; i++) {
+		if (float_difference(ex[n - 1], x[i]) == 0.0f &&
+		    float_difference(ey[n - 1], y[i]) == 0.0f)
+			continue;
+		ex[n] = x[i];
+		ey[n] = y[i];
+		n++;
+	}
+	if (float_difference(ex[n - 1], x[0]) == 0.0f &&
+	    float_difference(ey[n - 1], y[0]) == 0.0f)
+		n--;
+
+	return n;
+}
+
 int
 clip_transformed(struct clip_context *ctx,
 		 struct polygon8 *surf,
@@ -303,28 +341,330 @@ clip_transformed(struct clip_context *ctx,
 		 float *ey)
 {
 	struct polygon8 polygon;
-	int i, n;
 
 	polygon.n = clip_polygon_left(ctx, surf, polygon.x, polygon.y);
 	surf->n = clip_polygon_right(ctx, &polygon, surf->x, surf->y);
 	polygon.n = clip_polygon_top(ctx, surf, polygon.x, polygon.y);
 	surf->n = clip_polygon_bottom(ctx, &polygon, surf->x, surf->y);
 
-	/* Get rid of duplicate vertices */
-	ex[0] = surf->x[0];
-	ey[0] = surf->y[0];
-	n = 1;
-	for (i = 1; i < surf->n; i++) {
-		if (float_difference(ex[n - 1], surf->x[i]) == 0.0f &&
-		    float_difference(ey[n - 1], surf->y[i]) == 0.0f)
-			continue;
-		ex[n] = surf->x[i];
-		ey[n] = surf->y[i];
-		n++;
+	return remove_duplicates(surf->x, surf->y, surf->n, ex, ey);
+}
+
+/* How a quad relates to a clip box, judged by its bounding box */
+enum clip_class {
+	CLIP_CLASS_OUTSIDE,
+	CLIP_CLASS_INSIDE,
+	CLIP_CLASS_PARTIAL,
+};
+
+/* The per pair work of clip_batch(). Every implementation gives
+ * exactly the results of the scalar one. */
+struct clip_kernels {
+	/* Classify the quads with the given bounding boxes, stored as
+	 * { min x, min y, max x, max y }, against one clip box. */
+	void (*classify)(const struct clip_box *box,
+			 const float (*bounds)[4], int n, uint8_t *result);
+
+	/* clip_simple() of an axis aligned quad */
+	void (*clamp)(const struct clip_quad *quad,
+		      const struct clip_box *box, float *ex, float *ey);
+};
+
+/* The comparisons match the bounding box test the renderers used to do
+ * and the edge tests of the polygon clipper, so a quad classified as
+ * inside comes out of clip_transformed() unchanged. */
+static void
+classify_scalar(const struct clip_box *box,
+		const float (*bounds)[4], int n, uint8_t *result)
+{
+	const float *b;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		b = bounds[i];
+		if (b[0] >= box->x2 || b[2] <= box->x1 ||
+		    b[1] >= box->y2 || b[3] <= box->y1)
+			result[i] = CLIP_CLASS_OUTSIDE;
+		else if (b[0] >= box->x1 && b[2] < box->x2 &&
+			 b[1] >= box->y1 && b[3] < box->y2)
+			result[i] = CLIP_CLASS_INSIDE;
+		else
+			result[i] = CLIP_CLASS_PARTIAL;
 	}
-	if (float_difference(ex[n - 1], surf->x[0]) == 0.0f &&
-	    float_difference(ey[n - 1], surf->y[0]) == 0.0f)
-		n--;
+}
 
-	return n;
+static void
+clamp_scalar(const struct clip_quad *quad, const struct clip_box *box,
+	     float *ex, float *ey)
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		ex[i] = clip(quad->x[i], box->x1, box->x2);
+		ey[i] = clip(quad->y[i], box->y1, box->y2);
+	}
+}
+
+static const struct clip_kernels kernels_scalar = {
+	classify_scalar,
+	clamp_scalar
+};
+
+#ifdef CLIP_HAVE_SSE2
+
+/* A clip box is { x1, y1, x2, y2 }, which lines up with the bounds
+ * { min x, min y, max x, max y } for the inside test, and with the
+ * bounds swapped in halves for the outside test. */
+
+__attribute__((target("sse2"))) static void
+classify_sse2(const struct clip_box *box,
+	      const float (*bounds)[4], int n, uint8_t *result)
+{
+	__m128 b = _mm_loadu_ps(&box->x1);
+	__m128 lo, hi;
+	int i, outside, inside;
+
+	for (i = 0; i < n; i++) {
+		lo = _mm_loadu_ps(bounds[i]);
+		hi = _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(1, 0, 3, 2));
+
+		outside = (_mm_movemask_ps(_mm_cmple_ps(hi, b)) & 0x3) |
+			  (_mm_movemask_ps(_mm_cmpge_ps(hi, b)) & 0xc);
+		inside = (_mm_movemask_ps(_mm_cmpge_ps(lo, b)) & 0x3) |
+			 (_mm_movemask_ps(_mm_cmplt_ps(lo, b)) & 0xc);
+
+		if (outside)
+			result[i] = CLIP_CLASS_OUTSIDE;
+		else if (inside == 0xf)
+			result[i] = CLIP_CLASS_INSIDE;
+		else
+			result[i] = CLIP_CLASS_PARTIAL;
+	}
+}
+
+__attribute__((target("sse2"))) static void
+clamp_sse2(const struct clip_quad *quad, const struct clip_box *box,
+	   float *ex, float *ey)
+{
+	__m128 x = _mm_loadu_ps(quad->x);
+	__m128 y = _mm_loadu_ps(quad->y);
+
+	x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(box->x1)),
+		       _mm_set1_ps(box->x2));
+	y = _mm_min_ps(_mm_max_ps(y, _mm_set1_ps(box->y1)),
+		       _mm_set1_ps(box->y2));
+	_mm_storeu_ps(ex, x);
+	_mm_storeu_ps(ey, y);
+}
+
+static const struct clip_kernels kernels_sse2 = {
+	classify_sse2,
+	clamp_sse2
+};
+
+#endif
+
+#ifdef CLIP_HAVE_NEON
+
+static void
+classify_neon(const struct clip_box *box,
+	      const float (*bounds)[4], int n, uint8_t *result)
+{
+	static const uint32_t low_half[4] = { ~0u, ~0u, 0, 0 };
+	uint32x4_t sel = vld1q_u32(low_half);
+	float32x4_t b = vld1q_f32(&box->x1);
+	float32x4_t lo, hi;
+	uint32x4_t outside, inside;
+	uint32x2_t any, all;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		lo = vld1q_f32(bounds[i]);
+		hi = vextq_f32(lo, lo, 2);
+
+		outside = vbslq_u32(sel, vcleq_f32(hi, b), vcgeq_f32(hi, b));
+		inside = vbslq_u32(sel, vcgeq_f32(lo, b), vcltq_f32(lo, b));
+		any = vorr_u32(vget_low_u32(outside), vget_high_u32(outside));
+		all = vand_u32(vget_low_u32(inside), vget_high_u32(inside));
+
+		if (vget_lane_u32(any, 0) | vget_lane_u32(any, 1))
+			result[i] = CLIP_CLASS_OUTSIDE;
+		else if (vget_lane_u32(all, 0) & vget_lane_u32(all, 1))
+			result[i] = CLIP_CLASS_INSIDE;
+		else
+			result[i] = CLIP_CLASS_PARTIAL;
+	}
+}
+
+static void
+clamp_neon(const struct clip_quad *quad, const struct clip_box *box,
+	   float *ex, float *ey)
+{
+	float32x4_t x = vld1q_f32(quad->x);
+	float32x4_t y = vld1q_f32(quad->y);
+
+	x = vminq_f32(vmaxq_f32(x, vdupq_n_f32(box->x1)),
+		      vdupq_n_f32(box->x2));
+	y = vminq_f32(vmaxq_f32(y, vdupq_n_f32(box->y1)),
+		      vdupq_n_f32(box->y2));
+	vst1q_f32(ex, x);
+	vst1q_f32(ey, y);
+}
+
+static const struct clip_kernels kernels_neon = {
+	classify_neon,
+	clamp_neon
+};
+
+#endif
+
+static const struct clip_kernels *
+clip_kernels_get(enum clip_impl impl)
+{
+	switch (impl) {
+	case CLIP_IMPL_SCALAR:
+		return &kernels_scalar;
+#ifdef CLIP_HAVE_SSE2
+	case CLIP_IMPL_SSE2:
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse2"))
+			return &kernels_sse2;
+		return NULL;
+#endif
+#ifdef CLIP_HAVE_NEON
+	case CLIP_IMPL_NEON:
+		return &kernels_neon;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+static void
+quad_bounds(const struct clip_quad *quad, float *b)
+{
+	int i;
+
+	b[0] = b[2] = quad->x[0];
+	b[1] = b[3] = quad->y[0];
+	for (i = 1; i < 4; i++) {
+		b[0] = min(b[0], quad->x[i]);
+		b[1] = min(b[1], quad->y[i]);
+		b[2] = max(b[2], quad->x[i]);
+		b[3] = max(b[3], quad->y[i]);
+	}
+}
+
+/* Quads handled without allocating */
+#define CLIP_BATCH_STACK_QUADS 64
+
+/** Clip quads against boxes using a specific implementation
+ *
+ * \param batch The quads, boxes and output arrays.
+ * \param impl The implementation to use.
+ * \return The number of polygons written, or -1 if the CPU or the
+ * build does not support \c impl.
+ *
+ * See clip_batch().
+ */
+int
+clip_batch_impl(struct clip_batch *batch, enum clip_impl impl)
+{
+	const struct clip_kernels *k = clip_kernels_get(impl);
+	float stack_bounds[CLIP_BATCH_STACK_QUADS][4];
+	uint8_t stack_class[CLIP_BATCH_STACK_QUADS];
+	float (*bounds)[4] = stack_bounds;
+	uint8_t *classes = stack_class;
+	const struct clip_quad *quad;
+	const struct clip_box *box;
+	struct clip_context ctx;
+	struct polygon8 polygon;
+	float *ex = batch->x, *ey = batch->y;
+	int i, j, n, count = 0;
+
+	if (!k)
+		return -1;
+
+	if (batch->nquads > CLIP_BATCH_STACK_QUADS) {
+		bounds = malloc(batch->nquads * sizeof *bounds);
+		classes = malloc(batch->nquads * sizeof *classes);
+		if (!bounds || !classes)
+			goto out;
+	}
+
+	for (j = 0; j < batch->nquads; j++)
+		quad_bounds(&batch->quads[j], bounds[j]);
+
+	for (i = 0; i < batch->nboxes; i++) {
+		box = &batch->boxes[i];
+		k->classify(box, (const float (*)[4]) bounds,
+			    batch->nquads, classes);
+
+		for (j = 0; j < batch->nquads; j++) {
+			quad = &batch->quads[j];
+
+			if (classes[j] == CLIP_CLASS_OUTSIDE)
+				continue;
+
+			if (!batch->transformed) {
+				k->clamp(quad, box, ex, ey);
+				n = 4;
+			} else if (classes[j] == CLIP_CLASS_INSIDE) {
+				n = remove_duplicates(quad->x, quad->y, 4,
+						      ex, ey);
+			} else {
+				ctx.clip.x1 = box->x1;
+				ctx.clip.y1 = box->y1;
+				ctx.clip.x2 = box->x2;
+				ctx.clip.y2 = box->y2;
+				polygon.n = 4;
+				memcpy(polygon.x, quad->x, sizeof quad->x);
+				memcpy(polygon.y, quad->y, sizeof quad->y);
+				n = clip_transformed(&ctx, &polygon, ex, ey);
+			}
+
+			if (n < 3)
+				continue;
+
+			batch->n[count++] = n;
+			ex += n;
+			ey += n;
+		}
+	}
+
+out:
+	if (bounds != stack_bounds)
+		free(bounds);
+	if (classes != stack_class)
+		free(classes);
+
+	return count;
+}
+
+/** Clip quads against boxes
+ *
+ * \param batch The quads, boxes and output arrays.
+ * \return The number of polygons written.
+ *
+ * Each polygon is the intersection of a quad and a box, with either
+ * 3 to 8 vertices and a non-zero area, or for quads aligned to the axes
+ * exactly 4 vertices. Polygons are not emitted for pairs that do not
+ * intersect. The results are the same as clipping every pair with
+ * clip_simple() or clip_transformed(), but the bounding box tests are
+ * done in bulk with the SIMD instructions available.
+ */
+int
+clip_batch(struct clip_batch *batch)
+{
+	static enum clip_impl best = CLIP_IMPL_COUNT;
+	int i;
+
+	if (best == CLIP_IMPL_COUNT) {
+		for (i = CLIP_IMPL_COUNT - 1; i > 0; i--)
+			if (clip_kernels_get(i))
+				break;
+		best = i;
+	}
+
+	return clip_batch_impl(batch, best);
 }
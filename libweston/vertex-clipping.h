@@ -25,6 +25,8 @@
 #ifndef _WESTON_VERTEX_CLIPPING_H
 #define _WESTON_VERTEX_CLIPPING_H
 
+#include <stdbool.h>
+
 struct polygon8 {
 	float x[8];
 	float y[8];
@@ -61,6 +63,49 @@ int
 clip_transformed(struct clip_context *ctx,
 		 struct polygon8 *surf,
 		 float *ex,
-		 float *ey);\
+		 float *ey);
+
+/* A quadrilateral in clockwise winding order. */
+struct clip_quad {
+	float x[4];
+	float y[4];
+};
+
+struct clip_box {
+	float x1, y1;
+	float x2, y2;
+};
+
+/* Clips every quad against every box. Polygons are emitted box by box,
+ * and for each box in the order of the quads. */
+struct clip_batch {
+	const struct clip_quad *quads;
+	int nquads;
+	const struct clip_box *boxes;
+	int nboxes;
+
+	/* If false, the quads are rectangles aligned to the axes */
+	bool transformed;
+
+	/* Vertices of the resulting polygons, packed one after another.
+	 * Must have room for 8 * nquads * nboxes vertices. */
+	float *x;
+	float *y;
+	/* Vertex counts of the polygons, room for nquads * nboxes */
+	int *n;
+};
+
+enum clip_impl {
+	CLIP_IMPL_SCALAR,
+	CLIP_IMPL_SSE2,
+	CLIP_IMPL_NEON,
+	CLIP_IMPL_COUNT
+};
+
+int
+clip_batch(struct clip_batch *batch);
+
+int
+clip_batch_impl(struct clip_batch *batch, enum clip_impl impl);
 
 #endif
@@ -0,0 +1,80 @@
+/*
+ * Copyright © 2016 The Weston Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "weston-test-client-helper.h"
+#include "shared/timespec-util.h"
+
+/* Two 320x240 outputs side by side */
+char *server_parameters="--width=320 --height=240 --output-count=2";
+
+/*
+ * A surface straddling both outputs, hidden behind an opaque surface
+ * on the output it is assigned to but still showing on the other one,
+ * must keep getting its frame callbacks at the output rate rather than
+ * at the rate of occluded surfaces.
+ */
+TEST(partially_occluded_surface_frame_rate)
+{
+	struct client *client, *cover;
+	struct wl_surface *surface;
+	struct wl_region *region;
+	struct timespec start, end, elapsed;
+	int frame, done;
+
+	/* 120 pixels wide on the first output, 80 on the second */
+	client = create_client_and_test_surface(200, 50, 200, 100);
+	assert(client);
+	surface = client->surface->wl_surface;
+
+	cover = create_client_and_test_surface(0, 0, 320, 240);
+	assert(cover);
+	region = wl_compositor_create_region(cover->wl_compositor);
+	wl_region_add(region, 0, 0, 320, 240);
+	wl_surface_set_opaque_region(cover->surface->wl_surface, region);
+	wl_region_destroy(region);
+	move_client(cover, 0, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (frame = 0; frame < 10; frame++) {
+		wl_surface_damage(surface, 0, 0, 200, 100);
+		frame_callback_set(surface, &done);
+		wl_surface_commit(surface);
+		frame_callback_wait(client, &done);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* At 60 Hz this takes a sixth of a second; throttled to the
+	 * default occluded-frame-rate it would take nine seconds. */
+	timespec_sub(&elapsed, &end, &start);
+	fprintf(stderr, "10 frames in %lld ms\n",
+		(long long) timespec_to_nsec(&elapsed) / 1000000);
+	assert(timespec_to_nsec(&elapsed) < 1000000000LL);
+}
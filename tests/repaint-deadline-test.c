@@ -0,0 +1,176 @@
+/*
+ * Copyright © 2016 The Weston Authors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "weston-test-runner.h"
+
+#include "repaint-deadline.h"
+
+#define REPAINT_MSEC 7
+#define REFRESH_NSEC 16666667LL
+
+static void
+add_samples(struct weston_repaint_deadline *d, int n, int32_t usec)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		repaint_deadline_add_sample(d, usec);
+}
+
+/* Present a vsynced repaint either on its target vblank or one late */
+static void
+present(struct weston_repaint_deadline *d, bool missed)
+{
+	d->target_nsec = 10 * REFRESH_NSEC;
+	repaint_deadline_present(d, d->target_nsec +
+				 (missed ? REFRESH_NSEC : 0),
+				 REFRESH_NSEC, true, true, REPAINT_MSEC);
+}
+
+TEST(percentile_of_recent_samples)
+{
+	struct weston_repaint_deadline d;
+
+	repaint_deadline_init(&d, REPAINT_MSEC);
+	assert(repaint_deadline_percentile(&d, 99) == 0);
+
+	/* Percentiles report the upper end of their bucket */
+	add_samples(&d, 99, 1000);
+	add_samples(&d, 1, 5000);
+	assert(repaint_deadline_percentile(&d, 50) == 1100);
+	assert(repaint_deadline_percentile(&d, 99) == 1100);
+	assert(repaint_deadline_percentile(&d, 100) == 5100);
+
+	/* Only the last WESTON_REPAINT_HISTORY samples count */
+	add_samples(&d, WESTON_REPAINT_HISTORY, 3000);
+	assert(d.nsamples == WESTON_REPAINT_HISTORY);
+	assert(repaint_deadline_percentile(&d, 1) == 3100);
+	assert(repaint_deadline_percentile(&d, 100) == 3100);
+
+	/* Durations beyond the histogram land in its last bucket */
+	repaint_deadline_add_sample(&d, 1000000);
+	assert(repaint_deadline_percentile(&d, 100) ==
+	       WESTON_REPAINT_BUCKETS * WESTON_REPAINT_BUCKET_USEC);
+	assert(d.last_usec == 1000000);
+}
+
+TEST(margin_grows_on_misses_and_decays)
+{
+	struct weston_repaint_deadline d;
+	int i;
+
+	repaint_deadline_init(&d, REPAINT_MSEC);
+	assert(d.margin_usec == REPAINT_MARGIN_MIN_USEC);
+
+	present(&d, true);
+	present(&d, true);
+	assert(d.misses == 2);
+	assert(d.margin_usec ==
+	       REPAINT_MARGIN_MIN_USEC + 2 * REPAINT_MARGIN_MISS_USEC);
+
+	present(&d, false);
+	assert(d.misses == 2);
+	assert(d.repaints == 3);
+	assert(d.margin_usec == REPAINT_MARGIN_MIN_USEC +
+	       2 * REPAINT_MARGIN_MISS_USEC - REPAINT_MARGIN_DECAY_USEC);
+
+	for (i = 0; i < 1000; i++)
+		present(&d, false);
+	assert(d.margin_usec == REPAINT_MARGIN_MIN_USEC);
+
+	for (i = 0; i < 1000; i++)
+		present(&d, true);
+	assert(d.margin_usec == REPAINT_MARGIN_MAX_USEC);
+
+	/* Without vsync there is no vblank to miss */
+	d.target_nsec = 0;
+	repaint_deadline_present(&d, 10 * REFRESH_NSEC, REFRESH_NSEC,
+				 false, true, REPAINT_MSEC);
+	assert(d.margin_usec == REPAINT_MARGIN_MAX_USEC);
+	assert(d.misses == 1000 + 2);
+}
+
+TEST(window_follows_repaint_durations)
+{
+	struct weston_repaint_deadline d;
+
+	repaint_deadline_init(&d, REPAINT_MSEC);
+	assert(repaint_deadline_window_msec(&d, true, REPAINT_MSEC) ==
+	       REPAINT_MSEC);
+
+	/* The configured window until there are enough samples */
+	add_samples(&d, REPAINT_MIN_SAMPLES - 1, 2000);
+	present(&d, false);
+	assert(d.window_usec == REPAINT_MSEC * 1000);
+	assert(repaint_deadline_window_msec(&d, true, REPAINT_MSEC) ==
+	       REPAINT_MSEC);
+
+	/* Then the recent durations plus the margin, rounded up */
+	repaint_deadline_add_sample(&d, 2000);
+	present(&d, false);
+	assert(d.window_usec == 2100 + REPAINT_MARGIN_MIN_USEC);
+	assert(repaint_deadline_window_msec(&d, true, REPAINT_MSEC) == 4);
+
+	/* Unless adapting is off */
+	d.target_nsec = 10 * REFRESH_NSEC;
+	repaint_deadline_present(&d, d.target_nsec, REFRESH_NSEC, true,
+				 false, REPAINT_MSEC);
+	assert(d.window_usec == REPAINT_MSEC * 1000);
+	assert(repaint_deadline_window_msec(&d, false, REPAINT_MSEC) ==
+	       REPAINT_MSEC);
+}
+
+TEST(window_clamped_to_repaint_window)
+{
+	struct weston_repaint_deadline d;
+
+	/* Slow repaints never start earlier than repaint-window asks */
+	repaint_deadline_init(&d, REPAINT_MSEC);
+	add_samples(&d, REPAINT_MIN_SAMPLES, 9000);
+	present(&d, false);
+	assert(d.window_usec == REPAINT_MSEC * 1000);
+	assert(repaint_deadline_window_msec(&d, true, REPAINT_MSEC) ==
+	       REPAINT_MSEC);
+
+	/* ...nor more than a refresh period before the vblank */
+	repaint_deadline_init(&d, 100);
+	add_samples(&d, REPAINT_MIN_SAMPLES, 20000);
+	d.target_nsec = 10 * REFRESH_NSEC;
+	repaint_deadline_present(&d, d.target_nsec, REFRESH_NSEC, true,
+				 true, 100);
+	assert(d.window_usec == REFRESH_NSEC / 1000);
+
+	/* ...which outputs of unknown refresh rate do not have */
+	d.target_nsec = 10 * REFRESH_NSEC;
+	repaint_deadline_present(&d, d.target_nsec, 0, false, true, 100);
+	assert(d.window_usec == 20100 + REPAINT_MARGIN_MIN_USEC);
+}
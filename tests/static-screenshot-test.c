@@ -0,0 +1,63 @@
+/*
+ * Copyright © 2016 The Weston Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "weston-test-client-helper.h"
+
+/*
+ * Screenshots of an output that has nothing else to repaint. The
+ * capture forces one repaint; a renderer reading back asynchronously
+ * must deliver the result without waiting for a further frame.
+ */
+TEST(static_screenshot)
+{
+	struct client *client;
+	struct buffer *first, *second;
+	struct rectangle clip;
+
+	client = create_client_and_test_surface(100, 100, 100, 100);
+	assert(client);
+
+	/* the scene is fully presented, nothing is damaged any more */
+	client_roundtrip(client);
+
+	first = capture_screenshot_of_output(client);
+	assert(first);
+	second = capture_screenshot_of_output(client);
+	assert(second);
+
+	clip.x = 0;
+	clip.y = 0;
+	clip.width = client->output->width;
+	clip.height = client->output->height;
+	assert(check_images_match(first->image, second->image, &clip));
+
+	buffer_destroy(first);
+	buffer_destroy(second);
+}
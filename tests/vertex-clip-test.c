@@ -26,7 +26,11 @@
 #include "config.h"
 
 #include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "weston-test-runner.h"
 
@@ -221,3 +225,212 @@ TEST(float_difference_same)
 	assert(float_difference(1.0f, 1.0f) == 0.0f);
 }
 
+
+#define BATCH_QUADS 40
+#define BATCH_BOXES 30
+#define BATCH_PAIRS (BATCH_QUADS * BATCH_BOXES)
+
+struct batch_fixture {
+	struct clip_quad quads[BATCH_QUADS];
+	struct clip_box boxes[BATCH_BOXES];
+	float x[8 * BATCH_PAIRS];
+	float y[8 * BATCH_PAIRS];
+	int n[BATCH_PAIRS];
+};
+
+/* Rectangles of 10-90 units somewhere in a 200x200 area, rotated about
+ * their center unless axis aligned ones are asked for. Some are given
+ * whole number coordinates so that edges coincide with box edges. */
+static void
+batch_fixture_init(struct batch_fixture *f, bool transformed,
+		   unsigned int seed)
+{
+	float cx, cy, w, h, a, c, s;
+	int i, k;
+
+	for (i = 0; i < BATCH_QUADS; i++) {
+		cx = rand_r(&seed) % 200;
+		cy = rand_r(&seed) % 200;
+		w = 10 + rand_r(&seed) % 80;
+		h = 10 + rand_r(&seed) % 80;
+		a = transformed ? (rand_r(&seed) % 360) * M_PI / 180.0 : 0.0;
+		c = cosf(a);
+		s = sinf(a);
+
+		for (k = 0; k < 4; k++) {
+			float dx = (k == 1 || k == 2) ? w / 2 : -w / 2;
+			float dy = (k >= 2) ? h / 2 : -h / 2;
+
+			f->quads[i].x[k] = cx + dx * c - dy * s;
+			f->quads[i].y[k] = cy + dx * s + dy * c;
+		}
+	}
+
+	for (i = 0; i < BATCH_BOXES; i++) {
+		f->boxes[i].x1 = rand_r(&seed) % 180;
+		f->boxes[i].y1 = rand_r(&seed) % 180;
+		f->boxes[i].x2 = f->boxes[i].x1 + 1 + rand_r(&seed) % 60;
+		f->boxes[i].y2 = f->boxes[i].y1 + 1 + rand_r(&seed) % 60;
+	}
+
+	/* Fully inside and touching boxes */
+	f->boxes[0].x1 = -1000;
+	f->boxes[0].y1 = -1000;
+	f->boxes[0].x2 = 1000;
+	f->boxes[0].y2 = 1000;
+	f->boxes[1].x1 = floorf(f->quads[0].x[0]);
+	f->boxes[1].x2 = f->boxes[1].x1 + 20;
+}
+
+/* Clip one pair at a time, the way the renderer used to */
+static int
+clip_pairwise(struct batch_fixture *f, bool transformed)
+{
+	struct clip_context ctx;
+	struct polygon8 surf;
+	float min_x, max_x, min_y, max_y;
+	float *ex = f->x, *ey = f->y;
+	int i, j, k, n, count = 0;
+
+	for (i = 0; i < BATCH_BOXES; i++) {
+		ctx.clip.x1 = f->boxes[i].x1;
+		ctx.clip.y1 = f->boxes[i].y1;
+		ctx.clip.x2 = f->boxes[i].x2;
+		ctx.clip.y2 = f->boxes[i].y2;
+
+		for (j = 0; j < BATCH_QUADS; j++) {
+			surf.n = 4;
+			memcpy(surf.x, f->quads[j].x, sizeof f->quads[j].x);
+			memcpy(surf.y, f->quads[j].y, sizeof f->quads[j].y);
+
+			min_x = max_x = surf.x[0];
+			min_y = max_y = surf.y[0];
+			for (k = 1; k < 4; k++) {
+				min_x = MIN(min_x, surf.x[k]);
+				max_x = MAX(max_x, surf.x[k]);
+				min_y = MIN(min_y, surf.y[k]);
+				max_y = MAX(max_y, surf.y[k]);
+			}
+			if ((min_x >= ctx.clip.x2) || (max_x <= ctx.clip.x1) ||
+			    (min_y >= ctx.clip.y2) || (max_y <= ctx.clip.y1))
+				continue;
+
+			if (transformed)
+				n = clip_transformed(&ctx, &surf, ex, ey);
+			else
+				n = clip_simple(&ctx, &surf, ex, ey);
+			if (n < 3)
+				continue;
+
+			f->n[count++] = n;
+			ex += n;
+			ey += n;
+		}
+	}
+
+	return count;
+}
+
+static int
+clip_batched(struct batch_fixture *f, bool transformed, enum clip_impl impl)
+{
+	struct clip_batch batch = {
+		f->quads, BATCH_QUADS,
+		f->boxes, BATCH_BOXES,
+		transformed,
+		f->x, f->y, f->n
+	};
+
+	return clip_batch_impl(&batch, impl);
+}
+
+static void
+check_batch(bool transformed)
+{
+	static struct batch_fixture ref, f;
+	unsigned int seed;
+	int i, count, vertices;
+	enum clip_impl impl;
+
+	for (seed = 1; seed <= 20; seed++) {
+		batch_fixture_init(&ref, transformed, seed);
+		count = clip_pairwise(&ref, transformed);
+		assert(count > 0);
+
+		for (vertices = 0, i = 0; i < count; i++)
+			vertices += ref.n[i];
+
+		for (impl = 0; impl < CLIP_IMPL_COUNT; impl++) {
+			f = ref;
+			if (clip_batched(&f, transformed, impl) < 0)
+				continue;
+
+			assert(clip_batched(&f, transformed, impl) == count);
+			assert(memcmp(f.n, ref.n, count * sizeof f.n[0]) == 0);
+			assert(memcmp(f.x, ref.x, vertices * sizeof f.x[0]) == 0);
+			assert(memcmp(f.y, ref.y, vertices * sizeof f.y[0]) == 0);
+		}
+	}
+}
+
+TEST(clip_batch_transformed_matches_pairwise)
+{
+	check_batch(true);
+}
+
+TEST(clip_batch_simple_matches_pairwise)
+{
+	check_batch(false);
+}
+
+static double
+elapsed_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+/* Not a correctness test: prints the time per quad and box pair of
+ * the pairwise clipping and every batched implementation. Skipped
+ * unless WESTON_TEST_BENCHMARK is set, to keep timing out of the
+ * regular test runs. */
+TEST(clip_batch_benchmark)
+{
+	static const char *names[] = { "scalar", "sse2", "neon" };
+	static struct batch_fixture f;
+	struct timespec start, end;
+	const int rounds = 200;
+	int i, transformed;
+	enum clip_impl impl;
+
+	if (!getenv("WESTON_TEST_BENCHMARK")) {
+		fprintf(stderr, "set WESTON_TEST_BENCHMARK to run\n");
+		exit(77);
+	}
+
+	for (transformed = 0; transformed <= 1; transformed++) {
+		batch_fixture_init(&f, transformed, 1);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < rounds; i++)
+			clip_pairwise(&f, transformed);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		fprintf(stderr, "%s pairwise: %.1f ns per pair\n",
+			transformed ? "transformed" : "simple",
+			elapsed_ns(&start, &end) / (rounds * BATCH_PAIRS));
+
+		for (impl = 0; impl < CLIP_IMPL_COUNT; impl++) {
+			if (clip_batched(&f, transformed, impl) < 0)
+				continue;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (i = 0; i < rounds; i++)
+				clip_batched(&f, transformed, impl);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			fprintf(stderr, "%s batch %s: %.1f ns per pair\n",
+				transformed ? "transformed" : "simple",
+				names[impl],
+				elapsed_ns(&start, &end) /
+				(rounds * BATCH_PAIRS));
+		}
+	}
+}
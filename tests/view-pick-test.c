@@ -0,0 +1,142 @@
+/*
+ * Copyright © 2016 The Weston Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+
+#include "compositor.h"
+
+static struct weston_view *
+create_view(struct weston_compositor *compositor,
+	    int x, int y, int width, int height)
+{
+	struct weston_surface *surface;
+	struct weston_view *view;
+
+	surface = weston_surface_create(compositor);
+	assert(surface);
+	view = weston_view_create(surface);
+	assert(view);
+	surface->width = width;
+	surface->height = height;
+	weston_view_set_position(view, x, y);
+	weston_view_update_transform(view);
+
+	/* Top-most view first, like weston_compositor_build_view_list() */
+	wl_list_insert(compositor->view_list.prev, &view->link);
+
+	return view;
+}
+
+static void
+destroy_view(struct weston_view *view)
+{
+	struct weston_surface *surface = view->surface;
+
+	weston_view_destroy(view);
+	weston_surface_destroy(surface);
+}
+
+static struct weston_view *
+pick(struct weston_compositor *compositor, int x, int y,
+     int32_t *vx, int32_t *vy)
+{
+	struct weston_view *view;
+	wl_fixed_t fx, fy;
+
+	view = weston_compositor_pick_view(compositor,
+					   wl_fixed_from_int(x),
+					   wl_fixed_from_int(y),
+					   &fx, &fy);
+	*vx = wl_fixed_to_int(fx);
+	*vy = wl_fixed_to_int(fy);
+
+	return view;
+}
+
+static void
+view_pick(void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_view *top, *middle, *bottom;
+	struct wl_list saved;
+	int32_t vx, vy;
+
+	wl_list_init(&saved);
+	wl_list_insert_list(&saved, &compositor->view_list);
+	wl_list_init(&compositor->view_list);
+
+	top = create_view(compositor, 100, 100, 200, 200);
+	middle = create_view(compositor, 50, 50, 100, 100);
+	bottom = create_view(compositor, 0, 0, 1000, 1000);
+	weston_compositor_invalidate_view_list(compositor);
+
+	assert(pick(compositor, 120, 120, &vx, &vy) == top);
+	assert(vx == 20 && vy == 20);
+	assert(pick(compositor, 60, 60, &vx, &vy) == middle);
+	assert(vx == 10 && vy == 10);
+	assert(pick(compositor, 500, 500, &vx, &vy) == bottom);
+	assert(pick(compositor, 2000, 2000, &vx, &vy) == NULL);
+
+	/* The grid wraps around, but the bounding box must still be hit. */
+	assert(pick(compositor, 10 + 4096, 10, &vx, &vy) == NULL);
+
+	/* Moving a view updates the grid without a view list rebuild. */
+	weston_view_set_position(top, 600, 600);
+	weston_view_update_transform(top);
+	assert(compositor->pick_grid.valid);
+	assert(pick(compositor, 120, 120, &vx, &vy) == middle);
+	assert(pick(compositor, 650, 650, &vx, &vy) == top);
+	assert(vx == 50 && vy == 50);
+
+	/* Views without input region are transparent to picking. */
+	pixman_region32_clear(&middle->surface->input);
+	assert(pick(compositor, 60, 60, &vx, &vy) == bottom);
+
+	destroy_view(top);
+	assert(pick(compositor, 650, 650, &vx, &vy) == bottom);
+
+	destroy_view(middle);
+	destroy_view(bottom);
+
+	wl_list_insert_list(&compositor->view_list, &saved);
+	weston_compositor_invalidate_view_list(compositor);
+
+	wl_display_terminate(compositor->wl_display);
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor, int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+
+	wl_event_loop_add_idle(loop, view_pick, compositor);
+
+	return 0;
+}
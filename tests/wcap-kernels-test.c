@@ -0,0 +1,126 @@
+/*
+ * Copyright © 2016 The Weston Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "wcap/wcap-kernels.h"
+
+#define MAX_PIXELS 67
+
+static const int lengths[] = { 0, 1, 3, 4, 7, 8, 9, 16, 31, 33, MAX_PIXELS };
+
+/* Few distinct values, so there are plenty of runs of every length. */
+static void
+fill_random(uint32_t *p, int n, unsigned int *seed)
+{
+	static const uint32_t values[] = {
+		0xff000000, 0x00ffffff, 0x80102030, 0xfffefdfc
+	};
+	int i;
+
+	for (i = 0; i < n; i++)
+		p[i] = values[rand_r(seed) % ARRAY_LENGTH(values)] +
+		       (rand_r(seed) % 3);
+}
+
+static void
+check_kernels(const struct wcap_kernels *k)
+{
+	const struct wcap_kernels *ref = wcap_kernels_get_impl(WCAP_KERNEL_SCALAR);
+	uint32_t next[MAX_PIXELS], a[MAX_PIXELS], b[MAX_PIXELS];
+	uint32_t da[MAX_PIXELS], db[MAX_PIXELS];
+	unsigned int seed = 1;
+	unsigned int i, round;
+	int n, j;
+
+	for (round = 0; round < 100; round++) {
+		for (i = 0; i < ARRAY_LENGTH(lengths); i++) {
+			n = lengths[i];
+			fill_random(next, n, &seed);
+			fill_random(a, n, &seed);
+			memcpy(b, a, sizeof a);
+
+			ref->delta(da, a, next, n);
+			k->delta(db, b, next, n);
+			assert(memcmp(da, db, n * 4) == 0);
+			assert(memcmp(a, b, n * 4) == 0);
+
+			for (j = 0; j < n; j++)
+				assert(ref->run_length(da + j, n - j, da[j]) ==
+				       k->run_length(da + j, n - j, da[j]));
+			assert(k->run_length(da, n, 0x12345678) == 0);
+
+			ref->apply_delta(a, n, next[0] | 0xab000000);
+			k->apply_delta(b, n, next[0] | 0xab000000);
+			assert(memcmp(a, b, n * 4) == 0);
+		}
+	}
+}
+
+TEST(wcap_kernels_match_scalar)
+{
+	const struct wcap_kernels *k;
+	int i;
+
+	for (i = 0; i < WCAP_KERNEL_COUNT; i++) {
+		k = wcap_kernels_get_impl(i);
+		if (k)
+			check_kernels(k);
+	}
+}
+
+TEST(wcap_kernels_best_available)
+{
+	assert(wcap_kernels_get() != NULL);
+}
+
+TEST(wcap_encode_row_runs_span_rows)
+{
+	const struct wcap_kernels *k = wcap_kernels_get();
+	uint32_t ref[8] = { 0 }, next[8], scratch[8], out[16], *p;
+	struct wcap_run run = { 0, 0 };
+	int i;
+
+	for (i = 0; i < 8; i++)
+		next[i] = 0x00010203;
+
+	/* Two identical rows encode to a single run of 16. */
+	p = wcap_encode_row(k, out, &run, ref, next, scratch, 8);
+	memset(ref, 0, sizeof ref);
+	p = wcap_encode_row(k, p, &run, ref, next, scratch, 8);
+	assert(p == out);
+	assert(run.length == 16);
+	p = wcap_output_run(p, run.delta, run.length);
+	assert(p == out + 1);
+	assert(out[0] == (0x00010203 | (15 << 24)));
+}
@@ -36,6 +36,12 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <smmintrin.h>
+#endif
 
 #include <cairo.h>
 
@@ -98,63 +104,190 @@ int clamp_uv(int u)
 		return clamp;
 }
 
+typedef void (*yv12_row_pair_func_t)(unsigned char *y1, unsigned char *y2,
+				     unsigned char *u, unsigned char *v,
+				     const uint32_t *p1, const uint32_t *p2,
+				     int width, uint32_t format);
+
 static void
-convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
+yv12_row_pair(unsigned char *y1, unsigned char *y2,
+	      unsigned char *u, unsigned char *v,
+	      const uint32_t *p1, const uint32_t *p2,
+	      int width, uint32_t format)
+{
+	const uint32_t *end = p1 + width;
+	int u_accum, v_accum;
+
+	while (p1 < end) {
+		u_accum = 0;
+		v_accum = 0;
+		y1[0] = rgb_to_yuv(format, p1[0], &u_accum, &v_accum);
+		y1[1] = rgb_to_yuv(format, p1[1], &u_accum, &v_accum);
+		y2[0] = rgb_to_yuv(format, p2[0], &u_accum, &v_accum);
+		y2[1] = rgb_to_yuv(format, p2[1], &u_accum, &v_accum);
+		u[0] = clamp_uv(u_accum);
+		v[0] = clamp_uv(v_accum);
+
+		y1 += 2;
+		p1 += 2;
+		y2 += 2;
+		p2 += 2;
+		u++;
+		v++;
+	}
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_YV12_SSE41 1
+
+/* Same arithmetic as rgb_to_yuv(), four pixels at a time. Returns the
+ * luma and the per pixel chroma terms to be summed. */
+__attribute__((target("sse4.1"))) static inline __m128i
+rgb_to_yuv_sse41(__m128i p, __m128i rshift, __m128i bshift,
+		 __m128i *u, __m128i *v)
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	__m128i r, g, b, y;
+
+	r = _mm_and_si128(_mm_srl_epi32(p, rshift), mask);
+	g = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+	b = _mm_and_si128(_mm_srl_epi32(p, bshift), mask);
+
+	y = _mm_mullo_epi32(r, _mm_set1_epi32(19595));
+	y = _mm_add_epi32(y, _mm_mullo_epi32(g, _mm_set1_epi32(38469)));
+	y = _mm_add_epi32(y, _mm_mullo_epi32(b, _mm_set1_epi32(7472)));
+	y = _mm_min_epi32(_mm_srli_epi32(y, 16), mask);
+
+	*u = _mm_mullo_epi32(_mm_sub_epi32(r, y), _mm_set1_epi32(46727));
+	*v = _mm_mullo_epi32(_mm_sub_epi32(b, y), _mm_set1_epi32(36962));
+
+	return y;
+}
+
+/* Sum the chroma terms of each 2x2 block and clamp like clamp_uv().
+ * The results end up in lanes 0 and 2. */
+__attribute__((target("sse4.1"))) static inline __m128i
+clamp_uv_sse41(__m128i a, __m128i b)
+{
+	__m128i s = _mm_add_epi32(a, b);
+
+	s = _mm_add_epi32(s, _mm_srli_epi64(s, 32));
+	s = _mm_add_epi32(_mm_srai_epi32(s, 18), _mm_set1_epi32(128));
+	s = _mm_max_epi32(s, _mm_setzero_si128());
+
+	return _mm_min_epi32(s, _mm_set1_epi32(255));
+}
+
+__attribute__((target("sse4.1"))) static void
+yv12_row_pair_sse41(unsigned char *y1, unsigned char *y2,
+		    unsigned char *u, unsigned char *v,
+		    const uint32_t *p1, const uint32_t *p2,
+		    int width, uint32_t format)
+{
+	__m128i rshift, bshift, ya, yb, ua, ub, va, vb, c;
+	uint32_t y4;
+	int i;
+
+	switch (format) {
+	case WCAP_FORMAT_XRGB8888:
+		rshift = _mm_cvtsi32_si128(16);
+		bshift = _mm_cvtsi32_si128(0);
+		break;
+	case WCAP_FORMAT_XBGR8888:
+		rshift = _mm_cvtsi32_si128(0);
+		bshift = _mm_cvtsi32_si128(16);
+		break;
+	default:
+		assert(0);
+	}
+
+	for (i = 0; i + 4 <= width; i += 4) {
+		ya = rgb_to_yuv_sse41(_mm_loadu_si128((const __m128i *) (p1 + i)),
+				      rshift, bshift, &ua, &va);
+		yb = rgb_to_yuv_sse41(_mm_loadu_si128((const __m128i *) (p2 + i)),
+				      rshift, bshift, &ub, &vb);
+
+		c = _mm_packus_epi16(_mm_packus_epi32(ya, yb),
+				     _mm_setzero_si128());
+		y4 = _mm_cvtsi128_si32(c);
+		memcpy(y1 + i, &y4, 4);
+		y4 = _mm_cvtsi128_si32(_mm_srli_si128(c, 4));
+		memcpy(y2 + i, &y4, 4);
+
+		c = clamp_uv_sse41(ua, ub);
+		u[i / 2] = _mm_cvtsi128_si32(c);
+		u[i / 2 + 1] = _mm_extract_epi32(c, 2);
+		c = clamp_uv_sse41(va, vb);
+		v[i / 2] = _mm_cvtsi128_si32(c);
+		v[i / 2 + 1] = _mm_extract_epi32(c, 2);
+	}
+
+	yv12_row_pair(y1 + i, y2 + i, u + i / 2, v + i / 2,
+		      p1 + i, p2 + i, width - i, format);
+}
+#endif
+
+static yv12_row_pair_func_t
+get_yv12_row_pair_func(void)
+{
+#ifdef HAVE_YV12_SSE41
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1"))
+		return yv12_row_pair_sse41;
+#endif
+
+	return yv12_row_pair;
+}
+
+struct frame_layout {
+	int width, height;
+	uint32_t format;
+	yv12_row_pair_func_t yv12_row_pair;
+};
+
+/* Convert rows [row0, row1) of frame, row0 being even. */
+static void
+convert_to_yv12(const struct frame_layout *layout, const uint32_t *frame,
+		unsigned char *out, int row0, int row1)
 {
 	unsigned char *y1, *y2, *u, *v;
-	uint32_t *p1, *p2, *end;
-	int i, u_accum, v_accum, stride0, stride1;
-	uint32_t format = decoder->format;
+	const uint32_t *p1, *p2;
+	int i, stride0, stride1;
 
-	stride0 = decoder->width;
-	stride1 = decoder->width / 2;
-	for (i = 0; i < decoder->height; i += 2) {
+	stride0 = layout->width;
+	stride1 = layout->width / 2;
+	for (i = row0; i < row1; i += 2) {
 		y1 = out + stride0 * i;
 		y2 = y1 + stride0;
-		v = out + stride0 * decoder->height + stride1 * i / 2;
-		u = v + stride1 * decoder->height / 2;
-		p1 = decoder->frame + decoder->width * i;
-		p2 = p1 + decoder->width;
-		end = p1 + decoder->width;
-
-		while (p1 < end) {
-			u_accum = 0;
-			v_accum = 0;
-			y1[0] = rgb_to_yuv(format, p1[0], &u_accum, &v_accum);
-			y1[1] = rgb_to_yuv(format, p1[1], &u_accum, &v_accum);
-			y2[0] = rgb_to_yuv(format, p2[0], &u_accum, &v_accum);
-			y2[1] = rgb_to_yuv(format, p2[1], &u_accum, &v_accum);
-			u[0] = clamp_uv(u_accum);
-			v[0] = clamp_uv(v_accum);
-
-			y1 += 2;
-			p1 += 2;
-			y2 += 2;
-			p2 += 2;
-			u++;
-			v++;
-		}
+		v = out + stride0 * layout->height + stride1 * i / 2;
+		u = v + stride1 * layout->height / 2;
+		p1 = frame + layout->width * i;
+		p2 = p1 + layout->width;
+
+		layout->yv12_row_pair(y1, y2, u, v, p1, p2,
+				      layout->width, layout->format);
 	}
 }
 
 static void
-convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
+convert_to_yuv444(const struct frame_layout *layout, const uint32_t *frame,
+		  unsigned char *out, int row0, int row1)
 {
 
 	unsigned char *yp, *up, *vp;
-	uint32_t *rp, *end;
+	const uint32_t *rp, *end;
 	int u, v;
 	int i, stride, psize;
-	uint32_t format = decoder->format;
+	uint32_t format = layout->format;
 
-	stride = decoder->width;
-	psize = stride * decoder->height;
-	for (i = 0; i < decoder->height; i++) {
+	stride = layout->width;
+	psize = stride * layout->height;
+	for (i = row0; i < row1; i++) {
 		yp = out + stride * i;
 		up = yp + (psize * 2);
 		vp = yp + (psize * 1);
-		rp = decoder->frame + decoder->width * i;
-		end = rp + decoder->width;
+		rp = frame + layout->width * i;
+		end = rp + layout->width;
 		while (rp < end) {
 			u = 0;
 			v = 0;
@@ -169,28 +302,233 @@ convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
 	}
 }
 
+/* Colour conversion runs on a pool of threads, one band of rows per
+ * work item, while the main thread goes on decoding.  Converted frames
+ * are written out in the order they were submitted. */
+
+#define CONVERT_SLOTS	4
+#define BAND_HEIGHT	32
+
+struct convert_slot {
+	uint32_t *frame;
+	unsigned char *out;
+	int next_band, bands_done;
+};
+
+struct converter {
+	struct frame_layout layout;
+	int depth, size, nbands;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond, done_cond;
+	pthread_t *threads;
+	int nthreads, exit;
+
+	struct convert_slot slots[CONVERT_SLOTS];
+	int head, count;
+};
+
 static void
-output_yuv_frame(struct wcap_decoder *decoder, int depth)
+convert_band(struct converter *c, struct convert_slot *slot, int band)
 {
-	static unsigned char *out;
-	int size;
+	int row0 = band * BAND_HEIGHT;
+	int row1 = row0 + BAND_HEIGHT;
 
-	if (depth == 444) {
-		size = decoder->width * decoder->height * 3;
-	} else {
-		size = decoder->width * decoder->height * 3 / 2;
-	}
-	if (out == NULL)
-		out = malloc(size);
+	if (row1 > c->layout.height)
+		row1 = c->layout.height;
+
+	if (c->depth == 444)
+		convert_to_yuv444(&c->layout, slot->frame, slot->out,
+				  row0, row1);
+	else
+		convert_to_yv12(&c->layout, slot->frame, slot->out,
+				row0, row1);
+}
+
+static void *
+converter_thread(void *data)
+{
+	struct converter *c = data;
+	struct convert_slot *slot;
+	int i, band;
+
+	pthread_mutex_lock(&c->mutex);
+
+	for (;;) {
+		slot = NULL;
+		for (i = 0; i < c->count; i++) {
+			slot = &c->slots[(c->head + i) % CONVERT_SLOTS];
+			if (slot->next_band < c->nbands)
+				break;
+			slot = NULL;
+		}
+
+		if (slot == NULL) {
+			if (c->exit)
+				break;
+			pthread_cond_wait(&c->work_cond, &c->mutex);
+			continue;
+		}
+
+		band = slot->next_band++;
+		pthread_mutex_unlock(&c->mutex);
 
-	if (depth == 444) {
-		convert_to_yuv444(decoder, out);
-	} else {
-		convert_to_yv12(decoder, out);
+		convert_band(c, slot, band);
+
+		pthread_mutex_lock(&c->mutex);
+		if (++slot->bands_done == c->nbands)
+			pthread_cond_broadcast(&c->done_cond);
 	}
 
+	pthread_mutex_unlock(&c->mutex);
+
+	return NULL;
+}
+
+/* Wait for the oldest submitted frame and write it out. */
+static void
+converter_write_oldest(struct converter *c)
+{
+	struct convert_slot *slot = &c->slots[c->head];
+
+	pthread_mutex_lock(&c->mutex);
+	while (slot->bands_done < c->nbands)
+		pthread_cond_wait(&c->done_cond, &c->mutex);
+	pthread_mutex_unlock(&c->mutex);
+
 	printf("FRAME\n");
-	fwrite(out, 1, size, stdout);
+	fwrite(slot->out, 1, c->size, stdout);
+
+	pthread_mutex_lock(&c->mutex);
+	c->head = (c->head + 1) % CONVERT_SLOTS;
+	c->count--;
+	pthread_mutex_unlock(&c->mutex);
+}
+
+static void
+converter_submit(struct converter *c, struct wcap_decoder *decoder)
+{
+	struct convert_slot *slot;
+
+	if (c->count == CONVERT_SLOTS)
+		converter_write_oldest(c);
+
+	/* Only the main thread adds or removes slots, so the free slot
+	 * can be filled without holding the lock. */
+	slot = &c->slots[(c->head + c->count) % CONVERT_SLOTS];
+	memcpy(slot->frame, decoder->frame,
+	       decoder->width * decoder->height * 4);
+	slot->next_band = 0;
+	slot->bands_done = 0;
+
+	pthread_mutex_lock(&c->mutex);
+	c->count++;
+	pthread_cond_broadcast(&c->work_cond);
+	pthread_mutex_unlock(&c->mutex);
+}
+
+static void
+converter_destroy(struct converter *c)
+{
+	int i;
+
+	while (c->count > 0)
+		converter_write_oldest(c);
+
+	pthread_mutex_lock(&c->mutex);
+	c->exit = 1;
+	pthread_cond_broadcast(&c->work_cond);
+	pthread_mutex_unlock(&c->mutex);
+
+	for (i = 0; i < c->nthreads; i++)
+		pthread_join(c->threads[i], NULL);
+
+	pthread_mutex_destroy(&c->mutex);
+	pthread_cond_destroy(&c->work_cond);
+	pthread_cond_destroy(&c->done_cond);
+
+	for (i = 0; i < CONVERT_SLOTS; i++) {
+		free(c->slots[i].frame);
+		free(c->slots[i].out);
+	}
+	free(c->threads);
+	free(c);
+}
+
+static struct converter *
+converter_create(struct wcap_decoder *decoder, int depth, int nthreads)
+{
+	struct converter *c;
+	int i;
+
+	c = calloc(1, sizeof *c);
+	if (c == NULL)
+		return NULL;
+
+	c->layout.width = decoder->width;
+	c->layout.height = decoder->height;
+	c->layout.format = decoder->format;
+	c->layout.yv12_row_pair = get_yv12_row_pair_func();
+	c->depth = depth;
+	if (depth == 444)
+		c->size = decoder->width * decoder->height * 3;
+	else
+		c->size = decoder->width * decoder->height * 3 / 2;
+	c->nbands = (decoder->height + BAND_HEIGHT - 1) / BAND_HEIGHT;
+
+	pthread_mutex_init(&c->mutex, NULL);
+	pthread_cond_init(&c->work_cond, NULL);
+	pthread_cond_init(&c->done_cond, NULL);
+
+	for (i = 0; i < CONVERT_SLOTS; i++) {
+		c->slots[i].frame = malloc(decoder->width * decoder->height * 4);
+		c->slots[i].out = malloc(c->size);
+		if (!c->slots[i].frame || !c->slots[i].out)
+			goto err;
+	}
+
+	c->threads = calloc(nthreads, sizeof *c->threads);
+	if (c->threads == NULL)
+		goto err;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&c->threads[i], NULL,
+				   converter_thread, c) != 0)
+			break;
+		c->nthreads++;
+	}
+
+	if (c->nthreads == 0)
+		goto err;
+
+	return c;
+
+err:
+	converter_destroy(c);
+	return NULL;
+}
+
+/* Decode the frame that --frame=<frame> writes out: output frame N
+ * shows the first recorded frame at or after N frame times into the
+ * recording, as in the resampling loop of main(). Reaches it through
+ * the keyframe index instead of replaying the recording. */
+static int
+seek_output_frame(struct wcap_decoder *decoder, int frame,
+		  uint32_t frame_time)
+{
+	uint32_t msecs;
+
+	if (!wcap_decoder_get_frame(decoder))
+		return 0;
+
+	msecs = decoder->msecs + frame * frame_time;
+	if (msecs > decoder->msecs &&
+	    !wcap_decoder_seek_msecs(decoder, msecs - 1))
+		return 0;
+
+	if (decoder->msecs < msecs)
+		return wcap_decoder_get_frame(decoder);
+
+	return 1;
 }
 
 static void
@@ -198,14 +536,21 @@ usage(int exit_code)
 {
 	fprintf(stderr, "usage: wcap-decode "
 		"[--help] [--yuv4mpeg2] [--frame=<frame>] [--all] \n"
-		"\t[--rate=<num:denom>] <wcap file>\n\n"
+		"\t[--recorded-frame=<frame>] [--rate=<num:denom>]\n"
+		"\t[--threads=<n>] <wcap file>\n\n"
 		"\t--help\t\t\tthis help text\n"
 		"\t--yuv4mpeg2\t\tdump wcap file to stdout in yuv4mpeg2 format\n"
 		"\t--yuv4mpeg2-444\t\tdump wcap file to stdout in yuv4mpeg2 444 format\n"
 		"\t--frame=<frame>\t\twrite out the given frame number as png\n"
+		"\t\t\t\tat the replay frame rate\n"
+		"\t--recorded-frame=<frame>\n"
+		"\t\t\t\twrite out the given frame of the recording\n"
+		"\t\t\t\tas png, whatever the replay frame rate\n"
 		"\t--all\t\t\twrite all frames as pngs\n"
-		"\t--rate=<num:denom>\treplay frame rate for yuv4mpeg2,\n"
-		"\t\t\t\tspecified as an integer fraction\n\n");
+		"\t--rate=<num:denom>\treplay frame rate for yuv4mpeg2 and --frame,\n"
+		"\t\t\t\tspecified as an integer fraction\n"
+		"\t--threads=<n>\t\tnumber of yuv4mpeg2 conversion threads,\n"
+		"\t\t\t\tdefaults to the number of CPUs\n\n");
 
 	exit(exit_code);
 }
@@ -213,11 +558,15 @@ usage(int exit_code)
 int main(int argc, char *argv[])
 {
 	struct wcap_decoder *decoder;
+	struct converter *converter = NULL;
 	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0, has_frame;
-	int num = 30, denom = 1;
+	int recorded_frame = -1;
+	int num = 30, denom = 1, nthreads = 0;
 	char filename[200];
 	char *mode;
 	uint32_t msecs, frame_time;
+	struct timespec start, end;
+	double seconds;
 
 	for (i = 1, j = 1; i < argc; i++) {
 		if (strcmp(argv[i], "--yuv4mpeg2-444") == 0) {
@@ -230,10 +579,15 @@ int main(int argc, char *argv[])
 			all = 1;
 		} else if (sscanf(argv[i], "--frame=%d", &output_frame) == 1) {
 			;
+		} else if (sscanf(argv[i], "--recorded-frame=%d",
+				  &recorded_frame) == 1) {
+			;
 		} else if (sscanf(argv[i], "--rate=%d", &num) == 1) {
 			;
 		} else if (sscanf(argv[i], "--rate=%d:%d", &num, &denom) == 2) {
 			;
+		} else if (sscanf(argv[i], "--threads=%d", &nthreads) == 1) {
+			;
 		} else if (strcmp(argv[i], "--") == 0) {
 			break;
 		} else if (argv[i][0] == '-') {
@@ -252,6 +606,10 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "invalid rate, denom can not be 0\n");
 		exit(EXIT_FAILURE);
 	}
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
 
 	decoder = wcap_decoder_create(argv[1]);
 	if (decoder == NULL) {
@@ -277,12 +635,56 @@ int main(int argc, char *argv[])
 		printf("YUV4MPEG2 %s W%d H%d F%d:%d Ip A0:0\n",
 					 mode, decoder->width, decoder->height, num, denom);
 		fflush(stdout);
+
+		converter = converter_create(decoder, yuv4mpeg2, nthreads);
+		if (converter == NULL) {
+			fprintf(stderr, "failed to start conversion threads\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	frame_time = 1000 * denom / num;
+
+	/* A single frame can be reached through the keyframe index,
+	 * without replaying the whole recording. */
+	if (recorded_frame >= 0 && !all && !yuv4mpeg2) {
+		if (!wcap_decoder_seek_frame(decoder, recorded_frame)) {
+			fprintf(stderr, "wcap file has only %d frames\n",
+				decoder->count);
+			wcap_decoder_destroy(decoder);
+			exit(EXIT_FAILURE);
+		}
+		snprintf(filename, sizeof filename,
+			 "wcap-recorded-frame-%d.png", recorded_frame);
+		write_png(decoder, filename);
+		fprintf(stderr, "wrote %s\n", filename);
+		wcap_decoder_destroy(decoder);
+
+		return EXIT_SUCCESS;
+	}
+
+	if (output_frame >= 0 && !all && !yuv4mpeg2) {
+		if (!seek_output_frame(decoder, output_frame, frame_time)) {
+			fprintf(stderr, "wcap file ends before frame %d "
+				"at %d:%d frames per second\n",
+				output_frame, num, denom);
+			wcap_decoder_destroy(decoder);
+			exit(EXIT_FAILURE);
+		}
+		snprintf(filename, sizeof filename,
+			 "wcap-frame-%d.png", output_frame);
+		write_png(decoder, filename);
+		fprintf(stderr, "wrote %s\n", filename);
+		wcap_decoder_destroy(decoder);
+
+		return EXIT_SUCCESS;
 	}
 
 	i = 0;
 	has_frame = wcap_decoder_get_frame(decoder);
 	msecs = decoder->msecs;
-	frame_time = 1000 * denom / num;
 	while (has_frame) {
 		if (all || i == output_frame) {
 			snprintf(filename, sizeof filename,
@@ -290,16 +692,31 @@ int main(int argc, char *argv[])
 			write_png(decoder, filename);
 			fprintf(stderr, "wrote %s\n", filename);
 		}
-		if (yuv4mpeg2)
-			output_yuv_frame(decoder, yuv4mpeg2);
+		if (converter)
+			converter_submit(converter, decoder);
 		i++;
 		msecs += frame_time;
 		while (decoder->msecs < msecs && has_frame)
 			has_frame = wcap_decoder_get_frame(decoder);
 	}
 
-	fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
-		decoder->width, decoder->height, i);
+	if (converter)
+		converter_destroy(converter);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+
+	fprintf(stderr, "wcap file: version %d, size %dx%d, %d frames, "
+		"%d keyframes\n", decoder->version,
+		decoder->width, decoder->height, i, decoder->nindex);
+	if (decoder->dropped)
+		fprintf(stderr, "recorder dropped %d of %d frames\n",
+			decoder->dropped, decoder->count);
+	if (yuv4mpeg2 && seconds > 0)
+		fprintf(stderr, "converted %d frames in %.2f s "
+			"(%.1f frames/s, %d threads)\n",
+			i, seconds, i / seconds, nthreads);
 
 	wcap_decoder_destroy(decoder);
 
@@ -0,0 +1,263 @@
+/*
+ * Copyright © 2016 The Weston Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Measure the wcap kernels on recorded captures.
+ *
+ * Every file is decoded once per kernel implementation, checking that
+ * all of them arrive at the same final frame.  The decoded frames are
+ * then re-encoded with each implementation and compared against the
+ * rectangles stored in the file, which the encoder must reproduce
+ * exactly. */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "wcap-decode.h"
+#include "wcap-kernels.h"
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static uint32_t
+frame_nrects(const struct wcap_decoder *decoder,
+	     const struct wcap_frame_header *header)
+{
+	if (decoder->version >= 2)
+		return header->nrects & WCAP_FRAME_NRECTS_MASK;
+
+	return header->nrects;
+}
+
+static uint64_t
+frame_pixels(const struct wcap_decoder *decoder,
+	     const struct wcap_frame_header *header)
+{
+	const struct wcap_rectangle *r = (const void *) (header + 1);
+	uint64_t pixels = 0;
+	uint32_t i;
+
+	for (i = 0; i < frame_nrects(decoder, header); i++)
+		pixels += (uint64_t) (r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1);
+
+	return pixels;
+}
+
+static int
+bench_decode(const char *filename, const struct wcap_kernels *kernels,
+	     uint32_t *result)
+{
+	struct wcap_decoder *decoder;
+	struct timespec start;
+	uint64_t pixels = 0;
+	double t;
+
+	decoder = wcap_decoder_create(filename);
+	if (decoder == NULL)
+		return -1;
+
+	decoder->kernels = kernels;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (decoder->p != decoder->end) {
+		pixels += frame_pixels(decoder, decoder->p);
+		wcap_decoder_get_frame(decoder);
+	}
+	t = elapsed(&start);
+
+	printf("  decode %-8s %8.1f Mpixel/s\n",
+	       kernels->name, pixels / t / 1e6);
+
+	if (result)
+		memcpy(result, decoder->frame,
+		       decoder->width * decoder->height * 4);
+
+	wcap_decoder_destroy(decoder);
+
+	return 0;
+}
+
+struct encode_state {
+	const struct wcap_kernels *kernels;
+	uint32_t *ref;
+	double time;
+	int mismatches;
+};
+
+static const uint32_t *
+encode_rect(struct encode_state *state, struct wcap_decoder *decoder,
+	    const struct wcap_rectangle *r, const uint32_t *expected,
+	    uint32_t *out, uint32_t *scratch)
+{
+	struct wcap_run run = { 0, 0 };
+	struct timespec start;
+	uint32_t *p = out;
+	int j, offset;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (j = r->y2 - 1; j >= r->y1; j--) {
+		offset = j * decoder->width + r->x1;
+		p = wcap_encode_row(state->kernels, p, &run,
+				    state->ref + offset,
+				    decoder->frame + offset,
+				    scratch, r->x2 - r->x1);
+	}
+	p = wcap_output_run(p, run.delta, run.length);
+	state->time += elapsed(&start);
+
+	if (memcmp(out, expected, (p - out) * 4) != 0)
+		state->mismatches++;
+
+	return expected + (p - out);
+}
+
+static int
+bench_encode(const char *filename)
+{
+	struct encode_state state[WCAP_KERNEL_COUNT];
+	struct wcap_frame_header *header;
+	struct wcap_rectangle *rects;
+	struct wcap_decoder *decoder;
+	const uint32_t *expected;
+	uint32_t *out, *scratch;
+	uint64_t pixels = 0;
+	int i, n = 0, size;
+	uint32_t j, nrects;
+
+	decoder = wcap_decoder_create(filename);
+	if (decoder == NULL)
+		return -1;
+
+	size = decoder->width * decoder->height * 4;
+	out = malloc(size);
+	scratch = malloc(decoder->width * 4);
+	for (i = 0; i < WCAP_KERNEL_COUNT; i++) {
+		state[n].kernels = wcap_kernels_get_impl(i);
+		if (!state[n].kernels)
+			continue;
+		state[n].ref = calloc(1, size);
+		state[n].time = 0;
+		state[n].mismatches = 0;
+		n++;
+	}
+
+	while (decoder->p != decoder->end) {
+		header = decoder->p;
+		rects = (void *) (header + 1);
+		nrects = frame_nrects(decoder, header);
+		pixels += frame_pixels(decoder, header);
+		wcap_decoder_get_frame(decoder);
+
+		for (i = 0; i < n; i++) {
+			if (header->nrects & WCAP_FRAME_KEYFRAME &&
+			    decoder->version >= 2)
+				memset(state[i].ref, 0, size);
+			expected = (void *) (rects + nrects);
+			for (j = 0; j < nrects; j++)
+				expected = encode_rect(&state[i], decoder,
+						       &rects[j], expected,
+						       out, scratch);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		printf("  encode %-8s %8.1f Mpixel/s%s\n",
+		       state[i].kernels->name, pixels / state[i].time / 1e6,
+		       state[i].mismatches ? "  MISMATCH" : "");
+		free(state[i].ref);
+	}
+
+	free(scratch);
+	free(out);
+	wcap_decoder_destroy(decoder);
+
+	for (i = 0; i < n; i++)
+		if (state[i].mismatches)
+			return -1;
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct wcap_kernels *kernels;
+	uint32_t *reference = NULL, *result = NULL;
+	struct wcap_decoder *decoder;
+	int i, k, size, status = EXIT_SUCCESS;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: wcap-bench <wcap file>...\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 1; i < argc; i++) {
+		decoder = wcap_decoder_create(argv[i]);
+		if (decoder == NULL) {
+			fprintf(stderr, "failed to open %s\n", argv[i]);
+			status = EXIT_FAILURE;
+			continue;
+		}
+		size = decoder->width * decoder->height * 4;
+		printf("%s: %dx%d\n", argv[i], decoder->width, decoder->height);
+		wcap_decoder_destroy(decoder);
+
+		reference = realloc(reference, size);
+		result = realloc(result, size);
+
+		for (k = 0; k < WCAP_KERNEL_COUNT; k++) {
+			kernels = wcap_kernels_get_impl(k);
+			if (!kernels)
+				continue;
+
+			bench_decode(argv[i], kernels,
+				     k == WCAP_KERNEL_SCALAR ? reference : result);
+			if (k != WCAP_KERNEL_SCALAR &&
+			    memcmp(reference, result, size) != 0) {
+				printf("  decode %-8s MISMATCH\n",
+				       kernels->name);
+				status = EXIT_FAILURE;
+			}
+		}
+
+		if (bench_encode(argv[i]) < 0)
+			status = EXIT_FAILURE;
+	}
+
+	free(reference);
+	free(result);
+
+	return status;
+}
@@ -35,10 +35,13 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <stddef.h>
 
 #include <cairo.h>
 
+#include "shared/zalloc.h"
 #include "wcap-decode.h"
+#include "wcap-kernels.h"
 
 static void
 wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
@@ -46,8 +49,7 @@ wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 {
 	uint32_t v, *p = decoder->p, *d;
 	int width = rect->x2 - rect->x1, height = rect->y2 - rect->y1;
-	int x, i, j, k, l, count = width * height;
-	unsigned char r, g, b, dr, dg, db;
+	int x, i, j, k, l, n, count = width * height;
 
 	d = decoder->frame + (rect->y2 - 1) * decoder->width;
 	x = rect->x1;
@@ -61,15 +63,13 @@ wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 			j = 1 << (l - 0xe0 + 7);
 		}
 
-		dr = (v >> 16);
-		dg = (v >>  8);
-		db = (v >>  0);
-		for (k = 0; k < j; k++) {
-			r = (d[x] >> 16) + dr;
-			g = (d[x] >>  8) + dg;
-			b = (d[x] >>  0) + db;
-			d[x] = 0xff000000 | (r << 16) | (g << 8) | b;
-			x++;
+		/* Apply the run one row segment at a time. */
+		for (k = 0; k < j; k += n) {
+			n = rect->x2 - x;
+			if (n > j - k)
+				n = j - k;
+			decoder->kernels->apply_delta(d + x, n, v);
+			x += n;
 			if (x == rect->x2) {
 				x = rect->x1;
 				d -= decoder->width;
@@ -90,7 +90,7 @@ wcap_decoder_get_frame(struct wcap_decoder *decoder)
 {
 	struct wcap_rectangle *rects;
 	struct wcap_frame_header *header;
-	uint32_t i;
+	uint32_t i, nrects;
 
 	if (decoder->p == decoder->end)
 		return 0;
@@ -99,14 +99,256 @@ wcap_decoder_get_frame(struct wcap_decoder *decoder)
 	decoder->msecs = header->msecs;
 	decoder->count++;
 
+	nrects = header->nrects;
+	if (decoder->version >= 2) {
+		if (nrects & WCAP_FRAME_KEYFRAME)
+			memset(decoder->frame, 0,
+			       decoder->width * decoder->height * 4);
+		nrects &= WCAP_FRAME_NRECTS_MASK;
+	}
+
+	if (nrects == 0)
+		decoder->dropped++;
+
 	rects = (void *) (header + 1);
-	decoder->p = (uint32_t *) (rects + header->nrects);
-	for (i = 0; i < header->nrects; i++)
+	decoder->p = (uint32_t *) (rects + nrects);
+	for (i = 0; i < nrects; i++)
 		wcap_decoder_decode_rectangle(decoder, &rects[i]);
 
 	return 1;
 }
 
+/* Return the start of the frame after p without decoding it, or NULL
+ * if the frame is truncated. */
+static void *
+wcap_decoder_skip_frame(struct wcap_decoder *decoder, void *p)
+{
+	struct wcap_frame_header *header = p;
+	struct wcap_rectangle *rects;
+	uint32_t *run, nrects, i, l;
+	int64_t count;
+
+	if (p + sizeof *header > decoder->end)
+		return NULL;
+
+	nrects = header->nrects;
+	if (decoder->version >= 2)
+		nrects &= WCAP_FRAME_NRECTS_MASK;
+
+	rects = (void *) (header + 1);
+	run = (uint32_t *) (rects + nrects);
+	if ((void *) run > decoder->end)
+		return NULL;
+
+	for (i = 0; i < nrects; i++) {
+		count = (int64_t) (rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+		while (count > 0) {
+			if ((void *) (run + 1) > decoder->end)
+				return NULL;
+			l = *run++ >> 24;
+			if (l < 0xe0)
+				count -= l + 1;
+			else
+				count -= 1 << (l - 0xe0 + 7);
+		}
+	}
+
+	return run;
+}
+
+static int
+wcap_decoder_add_index_entry(struct wcap_decoder *decoder, void *p,
+			     uint32_t frame)
+{
+	struct wcap_frame_header *header = p;
+	struct wcap_index_entry *index;
+
+	index = realloc(decoder->index,
+			(decoder->nindex + 1) * sizeof *index);
+	if (index == NULL)
+		return -1;
+
+	decoder->index = index;
+	index += decoder->nindex++;
+	index->msecs = p < decoder->end ? header->msecs : 0;
+	index->frame = frame;
+	index->offset = p - decoder->map;
+
+	return 0;
+}
+
+/* Version 1 files, and version 2 files whose recording was never
+ * finished, have no index.  Build one by walking the frame headers;
+ * for version 1 the only place decoding can start is the beginning. */
+static int
+wcap_decoder_scan_index(struct wcap_decoder *decoder)
+{
+	struct wcap_frame_header *header;
+	uint32_t frame = 0;
+	void *p, *next;
+
+	if (wcap_decoder_add_index_entry(decoder, decoder->start, 0) < 0)
+		return -1;
+
+	if (decoder->version < 2)
+		return 0;
+
+	for (p = decoder->start; p < decoder->end; p = next, frame++) {
+		header = p;
+		next = wcap_decoder_skip_frame(decoder, p);
+		if (next == NULL) {
+			/* Drop a frame cut short by a crash. */
+			decoder->end = p;
+			break;
+		}
+
+		if (frame > 0 && (header->nrects & WCAP_FRAME_KEYFRAME) &&
+		    wcap_decoder_add_index_entry(decoder, p, frame) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+wcap_decoder_read_index(struct wcap_decoder *decoder)
+{
+	struct wcap_index_trailer trailer;
+	const struct wcap_index_entry *entry, *prev;
+	size_t index_size;
+	uint32_t i;
+	void *first;
+
+	first = decoder->start;
+	if (decoder->end - first < (ptrdiff_t) sizeof trailer)
+		return -1;
+
+	memcpy(&trailer, decoder->end - sizeof trailer, sizeof trailer);
+	if (trailer.magic != WCAP_INDEX_MAGIC || trailer.nentries == 0)
+		return -1;
+
+	index_size = (size_t) trailer.nentries * sizeof *decoder->index;
+	if (trailer.offset < (uint64_t) (first - decoder->map) ||
+	    trailer.offset + index_size + sizeof trailer != decoder->size)
+		return -1;
+
+	decoder->index = malloc(index_size);
+	if (decoder->index == NULL)
+		return -1;
+
+	memcpy(decoder->index, decoder->map + trailer.offset, index_size);
+
+	/* Seeking trusts the index to point at frames in order, so a
+	 * damaged one is rebuilt by the caller instead. */
+	for (i = 0; i < trailer.nentries; i++) {
+		entry = &decoder->index[i];
+		prev = i > 0 ? entry - 1 : NULL;
+		if (entry->offset < (uint64_t) (first - decoder->map) ||
+		    entry->offset >= trailer.offset ||
+		    (prev && (entry->frame < prev->frame ||
+			      entry->msecs < prev->msecs))) {
+			free(decoder->index);
+			decoder->index = NULL;
+			return -1;
+		}
+	}
+
+	decoder->nindex = trailer.nentries;
+	decoder->end = decoder->map + trailer.offset;
+
+	return 0;
+}
+
+/* Position the decoder so that the next frame it decodes is the one
+ * at the given index entry. */
+static void
+wcap_decoder_jump(struct wcap_decoder *decoder,
+		  const struct wcap_index_entry *entry)
+{
+	decoder->p = decoder->map + entry->offset;
+	decoder->count = entry->frame;
+	memset(decoder->frame, 0, decoder->width * decoder->height * 4);
+}
+
+/** Decode the given frame
+ *
+ * \param decoder The decoder.
+ * \param frame The frame number, counting from 0.
+ * \return 1 if the frame was decoded, 0 if the file has fewer frames.
+ *
+ * Decoding restarts from the closest keyframe at or before \c frame,
+ * unless the decoder is already between that keyframe and \c frame.
+ * Afterwards the decoder continues with the next frame as if every
+ * frame up to \c frame had been decoded.
+ */
+int
+wcap_decoder_seek_frame(struct wcap_decoder *decoder, uint32_t frame)
+{
+	const struct wcap_index_entry *entry = decoder->index;
+	uint32_t lo = 0, hi = decoder->nindex, mid;
+
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (decoder->index[mid].frame <= frame)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	entry = &decoder->index[lo];
+
+	if (decoder->count == 0 || decoder->count - 1 > frame ||
+	    decoder->count - 1 < entry->frame)
+		wcap_decoder_jump(decoder, entry);
+
+	while (decoder->count <= frame)
+		if (!wcap_decoder_get_frame(decoder))
+			return 0;
+
+	return 1;
+}
+
+/** Decode the last frame shown at the given time
+ *
+ * \param decoder The decoder.
+ * \param msecs The time, in the timestamps of the recording.
+ * \return 1 if a frame was decoded, 0 if the file has no frames.
+ *
+ * If \c msecs is before the first frame, the first frame is decoded.
+ */
+int
+wcap_decoder_seek_msecs(struct wcap_decoder *decoder, uint32_t msecs)
+{
+	const struct wcap_index_entry *entry;
+	struct wcap_frame_header *next;
+	uint32_t lo = 0, hi = decoder->nindex, mid;
+
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (decoder->index[mid].msecs <= msecs)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	entry = &decoder->index[lo];
+
+	if (decoder->count == 0 || decoder->msecs > msecs ||
+	    decoder->count - 1 < entry->frame) {
+		wcap_decoder_jump(decoder, entry);
+		if (!wcap_decoder_get_frame(decoder))
+			return 0;
+	}
+
+	while (decoder->p != decoder->end) {
+		next = decoder->p;
+		if (next->msecs > msecs)
+			break;
+		wcap_decoder_get_frame(decoder);
+	}
+
+	return 1;
+}
+
 struct wcap_decoder *
 wcap_decoder_create(const char *filename)
 {
@@ -115,7 +357,7 @@ wcap_decoder_create(const char *filename)
 	int frame_size;
 	struct stat buf;
 
-	decoder = malloc(sizeof *decoder);
+	decoder = zalloc(sizeof *decoder);
 	if (decoder == NULL)
 		return NULL;
 
@@ -127,31 +369,51 @@ wcap_decoder_create(const char *filename)
 
 	fstat(decoder->fd, &buf);
 	decoder->size = buf.st_size;
+	if (decoder->size < sizeof *header) {
+		fprintf(stderr, "%s is not a wcap file\n", filename);
+		close(decoder->fd);
+		free(decoder);
+		return NULL;
+	}
+
 	decoder->map = mmap(NULL, decoder->size,
 			    PROT_READ, MAP_PRIVATE, decoder->fd, 0);
 	if (decoder->map == MAP_FAILED) {
 		fprintf(stderr, "mmap failed\n");
+		close(decoder->fd);
 		free(decoder);
 		return NULL;
 	}
 
 	header = decoder->map;
+	decoder->version = header->magic == WCAP_HEADER_MAGIC_V2 ? 2 : 1;
 	decoder->format = header->format;
 	decoder->count = 0;
+	decoder->dropped = 0;
+	decoder->kernels = wcap_kernels_get();
 	decoder->width = header->width;
 	decoder->height = header->height;
-	decoder->p = header + 1;
+	decoder->start = header + 1;
+	decoder->p = decoder->start;
 	decoder->end = decoder->map + decoder->size;
 
 	frame_size = header->width * header->height * 4;
-	decoder->frame = malloc(frame_size);
-	if (decoder->frame == NULL) {
-		free(decoder);
-		return NULL;
-	}
-	memset(decoder->frame, 0, frame_size);
+	decoder->frame = zalloc(frame_size);
+	if (decoder->frame == NULL)
+		goto err;
+
+	if ((decoder->version < 2 || wcap_decoder_read_index(decoder) < 0) &&
+	    wcap_decoder_scan_index(decoder) < 0)
+		goto err;
 
 	return decoder;
+
+err:
+	free(decoder->frame);
+	munmap(decoder->map, decoder->size);
+	close(decoder->fd);
+	free(decoder);
+	return NULL;
 }
 
 void
@@ -159,6 +421,7 @@ wcap_decoder_destroy(struct wcap_decoder *decoder)
 {
 	munmap(decoder->map, decoder->size);
 	close(decoder->fd);
+	free(decoder->index);
 	free(decoder->frame);
 	free(decoder);
 }
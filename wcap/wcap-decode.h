@@ -28,7 +28,11 @@
 
 #include <stdint.h>
 
+struct wcap_kernels;
+
 #define WCAP_HEADER_MAGIC	0x57434150
+#define WCAP_HEADER_MAGIC_V2	0x57434132
+#define WCAP_INDEX_MAGIC	0x57434958
 
 #define WCAP_FORMAT_XRGB8888	0x34325258
 #define WCAP_FORMAT_XBGR8888	0x34324258
@@ -41,15 +45,38 @@ struct wcap_header {
 	uint32_t width, height;
 };
 
+/* A frame without rectangles marks a frame the recorder could not keep
+ * up with.  Its damage is included in the next regular frame.
+ *
+ * In version 2 files, WCAP_FRAME_KEYFRAME in nrects marks a frame that
+ * covers the whole output and is encoded against a black frame, so
+ * decoding can start there. */
 struct wcap_frame_header {
 	uint32_t msecs;
 	uint32_t nrects;
 };
 
+#define WCAP_FRAME_KEYFRAME	0x80000000
+#define WCAP_FRAME_NRECTS_MASK	0x7fffffff
+
 struct wcap_rectangle {
 	int32_t x1, y1, x2, y2;
 };
 
+/* Version 2 files end in an index of their keyframes, followed by a
+ * trailer pointing back at the start of the index. */
+struct wcap_index_entry {
+	uint32_t msecs;
+	uint32_t frame;
+	uint64_t offset;
+};
+
+struct wcap_index_trailer {
+	uint32_t magic;
+	uint32_t nentries;
+	uint64_t offset;
+};
+
 struct wcap_decoder {
 	int fd;
 	size_t size;
@@ -58,10 +85,19 @@ struct wcap_decoder {
 	uint32_t format;
 	uint32_t msecs;
 	uint32_t count;
+	uint32_t dropped;
 	int width, height;
+	const struct wcap_kernels *kernels;
+
+	int version;
+	void *start;
+	struct wcap_index_entry *index;
+	uint32_t nindex;
 };
 
 int wcap_decoder_get_frame(struct wcap_decoder *decoder);
+int wcap_decoder_seek_frame(struct wcap_decoder *decoder, uint32_t frame);
+int wcap_decoder_seek_msecs(struct wcap_decoder *decoder, uint32_t msecs);
 struct wcap_decoder *wcap_decoder_create(const char *filename);
 void wcap_decoder_destroy(struct wcap_decoder *decoder);
 
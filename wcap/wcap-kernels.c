@@ -0,0 +1,326 @@
+/*
+ * Copyright © 2016 The Weston Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "wcap-kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WCAP_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+static void
+delta_scalar(uint32_t *delta, uint32_t *ref, const uint32_t *next, int n)
+{
+	unsigned char dr, dg, db;
+	uint32_t v;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		v = next[i];
+		dr = (v >> 16) - (ref[i] >> 16);
+		dg = (v >>  8) - (ref[i] >>  8);
+		db = (v >>  0) - (ref[i] >>  0);
+		delta[i] = (dr << 16) | (dg << 8) | (db << 0);
+		ref[i] = v;
+	}
+}
+
+static int
+run_length_scalar(const uint32_t *p, int n, uint32_t v)
+{
+	int i;
+
+	for (i = 0; i < n && p[i] == v; i++)
+		;
+
+	return i;
+}
+
+static void
+apply_delta_scalar(uint32_t *d, int n, uint32_t delta)
+{
+	unsigned char r, g, b, dr, dg, db;
+	int i;
+
+	dr = (delta >> 16);
+	dg = (delta >>  8);
+	db = (delta >>  0);
+	for (i = 0; i < n; i++) {
+		r = (d[i] >> 16) + dr;
+		g = (d[i] >>  8) + dg;
+		b = (d[i] >>  0) + db;
+		d[i] = 0xff000000 | (r << 16) | (g << 8) | b;
+	}
+}
+
+static const struct wcap_kernels kernels_scalar = {
+	"scalar",
+	delta_scalar,
+	run_length_scalar,
+	apply_delta_scalar
+};
+
+#ifdef WCAP_HAVE_X86
+
+/* Byte wise subtraction and addition is all the format needs, so
+ * SSE2 covers it; AVX2 just doubles the width. */
+
+__attribute__((target("sse2"))) static void
+delta_sse2(uint32_t *delta, uint32_t *ref, const uint32_t *next, int n)
+{
+	const __m128i mask = _mm_set1_epi32(0x00ffffff);
+	__m128i a, b;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		a = _mm_loadu_si128((const __m128i *) (next + i));
+		b = _mm_loadu_si128((const __m128i *) (ref + i));
+		_mm_storeu_si128((__m128i *) (delta + i),
+				 _mm_and_si128(_mm_sub_epi8(a, b), mask));
+		_mm_storeu_si128((__m128i *) (ref + i), a);
+	}
+
+	delta_scalar(delta + i, ref + i, next + i, n - i);
+}
+
+__attribute__((target("sse2"))) static int
+run_length_sse2(const uint32_t *p, int n, uint32_t v)
+{
+	const __m128i vv = _mm_set1_epi32(v);
+	int i, mask;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi32(
+			_mm_loadu_si128((const __m128i *) (p + i)), vv));
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask) / 4;
+	}
+
+	return i + run_length_scalar(p + i, n - i, v);
+}
+
+__attribute__((target("sse2"))) static void
+apply_delta_sse2(uint32_t *d, int n, uint32_t delta)
+{
+	const __m128i vd = _mm_set1_epi32(delta & 0x00ffffff);
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	__m128i a;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		a = _mm_loadu_si128((const __m128i *) (d + i));
+		a = _mm_or_si128(_mm_add_epi8(a, vd), alpha);
+		_mm_storeu_si128((__m128i *) (d + i), a);
+	}
+
+	apply_delta_scalar(d + i, n - i, delta);
+}
+
+static const struct wcap_kernels kernels_sse2 = {
+	"sse2",
+	delta_sse2,
+	run_length_sse2,
+	apply_delta_sse2
+};
+
+__attribute__((target("avx2"))) static void
+delta_avx2(uint32_t *delta, uint32_t *ref, const uint32_t *next, int n)
+{
+	const __m256i mask = _mm256_set1_epi32(0x00ffffff);
+	__m256i a, b;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = _mm256_loadu_si256((const __m256i *) (next + i));
+		b = _mm256_loadu_si256((const __m256i *) (ref + i));
+		_mm256_storeu_si256((__m256i *) (delta + i),
+				    _mm256_and_si256(_mm256_sub_epi8(a, b),
+						     mask));
+		_mm256_storeu_si256((__m256i *) (ref + i), a);
+	}
+
+	delta_scalar(delta + i, ref + i, next + i, n - i);
+}
+
+__attribute__((target("avx2"))) static int
+run_length_avx2(const uint32_t *p, int n, uint32_t v)
+{
+	const __m256i vv = _mm256_set1_epi32(v);
+	unsigned int mask;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi32(
+			_mm256_loadu_si256((const __m256i *) (p + i)), vv));
+		if (mask != 0xffffffff)
+			return i + __builtin_ctz(~mask) / 4;
+	}
+
+	return i + run_length_scalar(p + i, n - i, v);
+}
+
+__attribute__((target("avx2"))) static void
+apply_delta_avx2(uint32_t *d, int n, uint32_t delta)
+{
+	const __m256i vd = _mm256_set1_epi32(delta & 0x00ffffff);
+	const __m256i alpha = _mm256_set1_epi32(0xff000000);
+	__m256i a;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = _mm256_loadu_si256((const __m256i *) (d + i));
+		a = _mm256_or_si256(_mm256_add_epi8(a, vd), alpha);
+		_mm256_storeu_si256((__m256i *) (d + i), a);
+	}
+
+	apply_delta_scalar(d + i, n - i, delta);
+}
+
+static const struct wcap_kernels kernels_avx2 = {
+	"avx2",
+	delta_avx2,
+	run_length_avx2,
+	apply_delta_avx2
+};
+
+#endif
+
+/** Get a specific kernel implementation
+ *
+ * \param impl The implementation to look up.
+ * \return The kernels, or NULL if the CPU or the build does not
+ * support them.
+ */
+const struct wcap_kernels *
+wcap_kernels_get_impl(enum wcap_kernel_impl impl)
+{
+	switch (impl) {
+	case WCAP_KERNEL_SCALAR:
+		return &kernels_scalar;
+#ifdef WCAP_HAVE_X86
+	case WCAP_KERNEL_SSE2:
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse2"))
+			return &kernels_sse2;
+		return NULL;
+	case WCAP_KERNEL_AVX2:
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			return &kernels_avx2;
+		return NULL;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+/** Get the fastest kernels supported by this CPU */
+const struct wcap_kernels *
+wcap_kernels_get(void)
+{
+	static const struct wcap_kernels *best;
+	const struct wcap_kernels *k;
+	int i;
+
+	if (best)
+		return best;
+
+	for (i = WCAP_KERNEL_COUNT - 1; i >= 0; i--) {
+		k = wcap_kernels_get_impl(i);
+		if (k) {
+			best = k;
+			break;
+		}
+	}
+
+	return best;
+}
+
+uint32_t *
+wcap_output_run(uint32_t *p, uint32_t delta, int run)
+{
+	int i;
+
+	while (run > 0) {
+		if (run <= 0xe0) {
+			*p++ = delta | ((run - 1) << 24);
+			break;
+		}
+
+		i = 24 - __builtin_clz(run);
+		*p++ = delta | ((i + 0xe0) << 24);
+		run -= 1 << (7 + i);
+	}
+
+	return p;
+}
+
+/** Delta and run length encode one row of pixels
+ *
+ * \param kernels The kernels to use.
+ * \param p Where to write the encoded runs.
+ * \param run The run left open by the previous row, initially zeroed.
+ * \param ref The row of the reference frame, updated to \c next.
+ * \param next The new contents of the row.
+ * \param scratch Room for \c width deltas.
+ * \param width The number of pixels in the row.
+ * \return The end of the encoded data.
+ *
+ * Runs continue across rows, so the last run of a rectangle is still
+ * open on return and has to be written out with wcap_output_run().
+ */
+uint32_t *
+wcap_encode_row(const struct wcap_kernels *kernels, uint32_t *p,
+		struct wcap_run *run, uint32_t *ref, const uint32_t *next,
+		uint32_t *scratch, int width)
+{
+	int i, n;
+
+	kernels->delta(scratch, ref, next, width);
+
+	i = 0;
+	while (i < width) {
+		if (run->length == 0) {
+			run->delta = scratch[i++];
+			run->length = 1;
+			continue;
+		}
+
+		n = kernels->run_length(scratch + i, width - i, run->delta);
+		run->length += n;
+		i += n;
+		if (i < width) {
+			p = wcap_output_run(p, run->delta, run->length);
+			run->length = 0;
+		}
+	}
+
+	return p;
+}
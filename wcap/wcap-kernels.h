@@ -0,0 +1,76 @@
+/*
+ * Copyright © 2016 The Weston Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _WCAP_KERNELS_
+#define _WCAP_KERNELS_
+
+#include <stdint.h>
+
+/* Inner loops of the wcap encoder and decoder.  Every implementation
+ * produces exactly the same output as the scalar one. */
+struct wcap_kernels {
+	const char *name;
+
+	/* delta[i] = per channel difference next[i] - ref[i] with the
+	 * alpha byte cleared; ref is updated to next. */
+	void (*delta)(uint32_t *delta, uint32_t *ref,
+		      const uint32_t *next, int n);
+
+	/* Number of leading elements of p equal to v, at most n. */
+	int (*run_length)(const uint32_t *p, int n, uint32_t v);
+
+	/* Add delta to the color channels of d[0..n) and make the
+	 * pixels opaque. */
+	void (*apply_delta)(uint32_t *d, int n, uint32_t delta);
+};
+
+enum wcap_kernel_impl {
+	WCAP_KERNEL_SCALAR,
+	WCAP_KERNEL_SSE2,
+	WCAP_KERNEL_AVX2,
+	WCAP_KERNEL_COUNT
+};
+
+/* The currently open run of an encoder. */
+struct wcap_run {
+	uint32_t delta;
+	int length;
+};
+
+const struct wcap_kernels *
+wcap_kernels_get(void);
+
+const struct wcap_kernels *
+wcap_kernels_get_impl(enum wcap_kernel_impl impl);
+
+uint32_t *
+wcap_output_run(uint32_t *p, uint32_t delta, int run);
+
+uint32_t *
+wcap_encode_row(const struct wcap_kernels *kernels, uint32_t *p,
+		struct wcap_run *run, uint32_t *ref, const uint32_t *next,
+		uint32_t *scratch, int width);
+
+#endif